@@ -22,6 +22,10 @@
 #include <limits.h>
 #include "foma.h"
 
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#endif
+
 #define RANDOM 1
 #define ENUMERATE 2
 #define MATCH 4
@@ -30,15 +34,22 @@
 #define LOWER 32
 #define UPPER 64
 #define SPACE 128
+#define CALLBACK 256
 
 #define FAIL 0
 #define SUCCEED 1
 
+#define SAMPLE_MAX_TRIES 1000
+#define WRITE_BUFFER_SIZE 1048576
+
 #define DEFAULT_OUTSTRING_SIZE 4096
 #define DEFAULT_STACK_SIZE 128
 
 #define APPLY_BINSEARCH_THRESHOLD 10
 
+/* How many steps of a search pass between looks at the clock */
+#define APPLY_CLOCK_INTERVAL 256
+
 #define BITMASK(b) (1 << ((b) & 7))
 #define BITSLOT(b) ((b) >> 3)
 #define BITSET(a,b) ((a)[BITSLOT(b)] |= BITMASK(b))
@@ -46,6 +57,15 @@
 #define BITTEST(a,b) ((a)[BITSLOT(b)] & BITMASK(b))
 #define BITNSLOTS(nb) ((nb + CHAR_BIT - 1) / CHAR_BIT)
 
+/* Search counters cost nothing unless compiled in with FOMA_APPLY_STATS */
+#ifdef FOMA_APPLY_STATS
+#define APPLY_STAT(h, counter) ((h)->stats.counter++)
+#define APPLY_STAT_MAX(h, counter, value) do { if ((value) > (h)->stats.counter) (h)->stats.counter = (value); } while (0)
+#else
+#define APPLY_STAT(h, counter) ((void) 0)
+#define APPLY_STAT_MAX(h, counter, value) ((void) 0)
+#endif
+
 
 
 static int apply_append(struct apply_handle *h, int cptr, int sym);
@@ -53,6 +73,7 @@ static char *apply_net(struct apply_handle *h);
 static void apply_create_statemap(struct apply_handle *h,struct fsm *net);
 static void apply_create_sigarray(struct apply_handle *h,struct fsm *net);
 static void apply_create_sigmatch(struct apply_handle *h);
+static void apply_fill_sigmatch(struct apply_handle *h, char *symbol, int inlen, struct sigmatch_array *sigmatch);
 int apply_match_length(struct apply_handle *h, int symbol);
 static int apply_match_str(struct apply_handle *h,int symbol, int position);
 static void apply_add_flag(struct apply_handle *h,char *name);
@@ -67,6 +88,7 @@ static int apply_stack_isempty(struct apply_handle *h);
 static void apply_stack_pop (struct apply_handle *h);
 static void apply_stack_push (struct apply_handle *h, int vmark, char *sflagname, char *sflagvalue, int sflagneg);
 static void apply_force_clear_stack(struct apply_handle *h);
+static int apply_emit_result(struct apply_handle *h);
 
 
 void apply_set_obey_flags(struct apply_handle *h, int value) {
@@ -102,6 +124,51 @@ void apply_set_print_pairs(struct apply_handle *h, int value) {
     h->print_pairs = value;
 }
 
+int apply_get_stats(struct apply_handle *h, struct apply_stats *stats) {
+#ifdef FOMA_APPLY_STATS
+    *stats = h->stats;
+    return 1;
+#else
+    memset(stats, 0, sizeof(struct apply_stats));
+    return 0;
+#endif
+}
+
+void apply_reset_stats(struct apply_handle *h) {
+    memset(&h->stats, 0, sizeof(struct apply_stats));
+}
+
+/* Search limits, per word: they hold for one apply_up/apply_down call */
+/* with a word and the calls with NULL that fetch its further results  */
+
+void apply_set_limits(struct apply_handle *h, unsigned long long max_arcs, int max_results, int max_msec) {
+    h->max_arcs = max_arcs;
+    h->max_results = max_results;
+    h->max_msec = max_msec;
+}
+
+int apply_truncated(struct apply_handle *h) {
+    return(h->truncated);
+}
+
+static long long apply_msec_now() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#else
+    return((long long) time(NULL) * 1000);
+#endif
+}
+
+static int apply_over_limits(struct apply_handle *h) {
+    if (h->max_arcs && h->limit_arcs > h->max_arcs)
+	return 1;
+    if (h->max_msec && ++(h->limit_steps) % APPLY_CLOCK_INTERVAL == 0 && apply_msec_now() - h->limit_start >= h->max_msec)
+	return 1;
+    return 0;
+}
+
 static void apply_force_clear_stack(struct apply_handle *h) {
     /* Make sure stack is empty and marks reset */
     if (!apply_stack_isempty(h)) {
@@ -116,6 +183,15 @@ static void apply_force_clear_stack(struct apply_handle *h) {
     }
 }
 
+/* Give up the search of the current word, leaving the handle as if */
+/* it had run out of results                                        */
+static char *apply_truncate(struct apply_handle *h) {
+    *(h->marks+(h->gstates+h->ptr)->state_no) = 0;
+    apply_force_clear_stack(h);
+    h->truncated = 1;
+    return NULL;
+}
+
 char *apply_enumerate(struct apply_handle *h) {
 
     char *result = NULL;
@@ -152,6 +228,172 @@ char *apply_lower_words(struct apply_handle *h) {
     return(apply_enumerate(h));
 }
 
+/* Writing all words of an acyclic net */
+
+/* Without cycles there is no need for the loop checks of apply_net():  */
+/* a plain DFS, which builds each prefix once with apply_append() and   */
+/* keeps it while the suffixes below it are written, suffices.  Words  */
+/* are collected in a large buffer that is written out whenever it     */
+/* fills up.  The work is split by the arcs leaving the start state,   */
+/* one shard each, which worker threads take in turn; each worker has  */
+/* a copy of the handle with its own output string and only reads the */
+/* tables of the handle.  With one thread the words come out in the    */
+/* order of apply_words(); with more, the buffers of different shards  */
+/* are interleaved.                                                    */
+
+struct apply_write_shard {
+    struct apply_handle *h;
+    FILE *out;
+    int mode;
+    int line;                   /* Arc of the start state, -1 for the start state itself */
+    long long count;
+#ifdef FOMA_PTHREADS
+    pthread_mutex_t *lock;
+#endif
+};
+
+struct apply_write_frame {
+    int state;
+    int line;
+    int opos;
+};
+
+static void apply_write_flush(struct apply_write_shard *ws, char *buf, size_t *pos) {
+#ifdef FOMA_PTHREADS
+    pthread_mutex_lock(ws->lock);
+#endif
+    fwrite(buf, 1, *pos, ws->out);
+#ifdef FOMA_PTHREADS
+    pthread_mutex_unlock(ws->lock);
+#endif
+    *pos = 0;
+}
+
+static void *apply_write_shard(void *arg) {
+    struct apply_write_shard *ws;
+    struct apply_handle w;
+    struct apply_write_frame *stack, *f;
+    char *buf;
+    size_t pos, size;
+    int sp, stacksize, line, target;
+
+    ws = arg;
+    w = *(ws->h);
+    w.mode = ws->mode;
+    w.opos = 0;
+    w.outstringtop = DEFAULT_OUTSTRING_SIZE;
+    w.outstring = malloc(w.outstringtop);
+    size = WRITE_BUFFER_SIZE;
+    buf = malloc(size);
+    pos = 0;
+    stacksize = 64;
+    stack = malloc(sizeof(struct apply_write_frame) * stacksize);
+    sp = 0;
+    line = ws->line;
+    if (line == -1) {
+	/* Only the empty word: the start state is final */
+	buf[pos++] = '\n';
+	ws->count++;
+    }
+    while (line != -1) {
+	/* Follow the arc at line */
+	target = (w.gstates+line)->target;
+	w.opos += apply_append(&w, line, (w.gstates+line)->out);
+	if (sp == stacksize) {
+	    stacksize *= 2;
+	    stack = realloc(stack, sizeof(struct apply_write_frame) * stacksize);
+	}
+	f = stack+sp++;
+	f->state = target;
+	f->line = *(w.statemap+target);
+	f->opos = w.opos;
+	if ((w.gstates+f->line)->final_state) {
+	    if (pos + w.opos + 1 > size) {
+		apply_write_flush(ws, buf, &pos);
+		while ((size_t) w.opos + 1 > size) {
+		    size *= 2;
+		    buf = realloc(buf, size);
+		}
+	    }
+	    memcpy(buf+pos, w.outstring, w.opos);
+	    pos += w.opos;
+	    buf[pos++] = '\n';
+	    ws->count++;
+	}
+	/* Find the next arc to follow, backtracking as needed */
+	for (line = -1; sp > 0; sp--) {
+	    f = stack+sp-1;
+	    if ((w.gstates+f->line)->state_no == f->state && (w.gstates+f->line)->target != -1) {
+		line = f->line++;
+		w.opos = f->opos;
+		break;
+	    }
+	}
+    }
+    if (pos > 0)
+	apply_write_flush(ws, buf, &pos);
+    free(stack);
+    free(buf);
+    free(w.outstring);
+    return NULL;
+}
+
+long long apply_write_words(struct apply_handle *h, FILE *out, int type, int nthreads) {
+    struct apply_write_shard *shards;
+    char *(*applyer)(struct apply_handle *h), *result;
+    int *order, nshards, line, start, mode;
+    long long count;
+#ifdef FOMA_PTHREADS
+    pthread_mutex_t lock;
+#endif
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return 0;
+    order = malloc(sizeof(int) * h->last_net->statecount);
+    if (apply_topsort_states(h, h->last_net->statecount, order) == 0) {
+	free(order);
+	return -1;
+    }
+    free(order);
+    mode = type == 1 ? DOWN + ENUMERATE + UPPER : type == 2 ? DOWN + ENUMERATE + LOWER : DOWN + ENUMERATE + LOWER + UPPER;
+
+    /* Flags that are obeyed need the general search */
+    if (h->has_flags && h->obey_flags) {
+	applyer = type == 1 ? &apply_upper_words : type == 2 ? &apply_lower_words : &apply_words;
+	for (count = 0; (result = applyer(h)) != NULL; count++)
+	    fprintf(out, "%s\n", result);
+	apply_reset_enumerator(h);
+	return(count);
+    }
+
+    start = *(h->statemap+h->gstates->state_no);
+    shards = calloc(*(h->numlines+h->gstates->state_no) + 1, sizeof(struct apply_write_shard));
+#ifdef FOMA_PTHREADS
+    pthread_mutex_init(&lock, NULL);
+#endif
+    nshards = 0;
+    if ((h->gstates+start)->final_state)
+	(shards+nshards++)->line = -1;
+    for (line = start; (h->gstates+line)->state_no == h->gstates->state_no && (h->gstates+line)->target != -1; line++)
+	(shards+nshards++)->line = line;
+    for (line = 0; line < nshards; line++) {
+	(shards+line)->h = h;
+	(shards+line)->out = out;
+	(shards+line)->mode = mode;
+#ifdef FOMA_PTHREADS
+	(shards+line)->lock = &lock;
+#endif
+    }
+    foma_parallel_run(apply_write_shard, shards, sizeof(struct apply_write_shard), nshards, nthreads > 0 ? nthreads : foma_num_cpus());
+    for (count = 0, line = 0; line < nshards; line++)
+	count += (shards+line)->count;
+#ifdef FOMA_PTHREADS
+    pthread_mutex_destroy(&lock);
+#endif
+    free(shards);
+    return(count);
+}
+
 char *apply_random_words(struct apply_handle *h) {
     apply_clear_flags(h);
     h->mode = DOWN + ENUMERATE + LOWER + UPPER + RANDOM;
@@ -164,6 +406,49 @@ char *apply_random_lower(struct apply_handle *h) {
     return(apply_enumerate(h));
 }
 
+/* Builds the string of a path drawn by apply_sample_path(); with flags, */
+/* paths that the flags disallow are rejected and another one is drawn  */
+
+static char *apply_sample(struct apply_handle *h, int mode) {
+    struct fsm_state *arc;
+    int i, len, tries, type;
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return (NULL);
+    h->mode = mode;
+    for (tries = 0; tries < SAMPLE_MAX_TRIES; tries++) {
+	if ((len = apply_sample_path(h)) == -1)
+	    return (NULL);
+	apply_clear_flags(h);
+	h->opos = 0;
+	for (i = 0; i < len; i++) {
+	    arc = h->gstates+h->sample_path[i];
+	    if (h->obey_flags && h->has_flags && (type = (h->flag_lookup+arc->in)->type)) {
+		if (apply_check_flag(h, type, (h->flag_lookup+arc->in)->name, (h->flag_lookup+arc->in)->value) == FAIL)
+		    break;
+	    }
+	    h->opos += apply_append(h, h->sample_path[i], arc->out);
+	}
+	if (i == len) {
+	    *(h->outstring+h->opos) = '\0';
+	    return(h->outstring);
+	}
+    }
+    return (NULL);
+}
+
+char *apply_sample_words(struct apply_handle *h) {
+    return(apply_sample(h, DOWN + ENUMERATE + LOWER + UPPER));
+}
+
+char *apply_sample_upper(struct apply_handle *h) {
+    return(apply_sample(h, DOWN + ENUMERATE + UPPER));
+}
+
+char *apply_sample_lower(struct apply_handle *h) {
+    return(apply_sample(h, DOWN + ENUMERATE + LOWER));
+}
+
 char *apply_random_upper(struct apply_handle *h) {
     apply_clear_flags(h);
     h->mode = DOWN + ENUMERATE + UPPER + RANDOM;
@@ -213,14 +498,78 @@ void apply_clear(struct apply_handle *h) {
 	h->flagstates = NULL;
     }
     apply_clear_index(h);
+    if (h->lazy != NULL) {
+	apply_lazy_free(h->lazy);
+	h->lazy = NULL;
+    }
     h->last_net = NULL;
     h->iterator = 0;
+    free(h->views);
+    free(h->cache_buf);
+    free(h->batch_buf);
+    apply_sampler_free(h->sampler);
+    free(h->sample_path);
     free(h->outstring);
     free(h->separator);
     free(h->epsilon_symbol);
     free(h);
 }
 
+void apply_set_cache(struct apply_handle *h, struct apply_cache *cache) {
+    h->cache = cache;
+    h->cache_count = 0;
+}
+
+/* With a cache, all results of a word are collected at once (on a miss) */
+/* or copied from the cache (on a hit) into h->cache_buf, from where     */
+/* they are handed out one by one.                                       */
+
+static char *apply_updown_cached(struct apply_handle *h, char *word) {
+    char *result;
+    size_t len;
+    int count, key;
+
+    if (word != NULL) {
+	/* Everything that changes the output strings goes in the key */
+	key = h->mode | (h->show_flags << 10) | (h->obey_flags << 11) | (h->print_pairs << 12) | (h->print_space << 13);
+	if ((count = apply_cache_find(h->cache, key, word, &h->cache_buf, &h->cache_bufsize)) == -1) {
+	    h->iterate_old = 0;
+	    h->instring = word;
+	    apply_create_sigmatch(h);
+	    apply_force_clear_stack(h);
+	    for (count = 0, len = 0, result = apply_net(h); result != NULL; result = apply_net(h)) {
+		while (len + strlen(result) + 1 > h->cache_bufsize) {
+		    h->cache_bufsize = h->cache_bufsize ? h->cache_bufsize * 2 : DEFAULT_OUTSTRING_SIZE;
+		    h->cache_buf = realloc(h->cache_buf, h->cache_bufsize);
+		}
+		strcpy(h->cache_buf+len, result);
+		len += strlen(result) + 1;
+		count++;
+		h->iterate_old = 1;
+	    }
+	    /* A search cut short by a limit is not the whole answer */
+	    if (!h->truncated)
+		apply_cache_add(h->cache, key, word, h->cache_buf, len, count);
+	} else {
+	    /* Replay no more than a fresh search would have returned */
+	    h->truncated = 0;
+	    if (h->max_results && count > h->max_results) {
+		count = h->max_results;
+		h->truncated = 1;
+	    }
+	}
+	h->cache_count = count;
+	h->cache_pos = 0;
+	h->cache_active = 1;
+    }
+    if (h->cache_count <= 0)
+	return NULL;
+    result = h->cache_buf+h->cache_pos;
+    h->cache_pos += strlen(result) + 1;
+    h->cache_count--;
+    return(result);
+}
+
 char *apply_updown(struct apply_handle *h, char *word) {
 
     char *result = NULL;
@@ -228,6 +577,9 @@ char *apply_updown(struct apply_handle *h, char *word) {
     if (h->last_net == NULL || h->last_net->finalcount == 0)
         return (NULL);
 
+    if (h->cache != NULL && (word != NULL || h->cache_active))
+	return(apply_updown_cached(h, word));
+
     if (word == NULL) {
         h->iterate_old = 1;
         result = apply_net(h);
@@ -268,11 +620,109 @@ char *apply_up(struct apply_handle *h, char *word) {
     return(apply_updown(h, word));
 }
 
+/* Instead of building the output string, pass each result to the callback */
+/* as an array of symbols read off the search stack.  Symbols point into   */
+/* the alphabet, or into the input string for IDENTITY.  Epsilons (and     */
+/* flags unless show_flags is set) are left out.                           */
+
+static int apply_emit_result(struct apply_handle *h) {
+    struct searchstack *ss;
+    struct fsm_state *arc;
+    struct apply_symbol_view *v;
+    int i, sym, count;
+
+    if (h->views_size < h->apply_stack_ptr) {
+	h->views_size = h->apply_stack_ptr * 2;
+	h->views = realloc(h->views, sizeof(struct apply_symbol_view) * h->views_size);
+    }
+    for (i = 0, count = 0; i < h->apply_stack_ptr; i++) {
+	ss = h->searchstack+i;
+	arc = h->gstates+ss->offset;
+	sym = ((h->mode) & DOWN) == DOWN ? arc->out : arc->in;
+	if (sym == EPSILON || (h->has_flags && !h->show_flags && (h->flag_lookup+sym)->type)) {
+	    continue;
+	}
+	v = h->views+count;
+	v->symbol = sym;
+	if (sym == IDENTITY) {
+	    v->string = h->instring+ss->ipos;
+	    v->length = (h->sigmatch_array+ss->ipos)->consumes;
+	} else {
+	    v->string = (h->sigs+sym)->symbol;
+	    v->length = (h->sigs+sym)->length;
+	}
+	count++;
+    }
+    h->callback_results++;
+    return(h->callback(h->callback_data, h->views, count));
+}
+
+static int apply_updown_callback(struct apply_handle *h, char *word, apply_result_callback callback, void *data) {
+    if (h->last_net == NULL || h->last_net->finalcount == 0 || word == NULL)
+        return 0;
+    h->cache_active = 0;
+    h->mode |= CALLBACK;
+    h->callback = callback;
+    h->callback_data = data;
+    h->callback_results = 0;
+    h->iterate_old = 0;
+    h->instring = word;
+    apply_create_sigmatch(h);
+    apply_force_clear_stack(h);
+    apply_net(h);
+    h->mode &= ~CALLBACK;
+    return(h->callback_results);
+}
+
+int apply_down_callback(struct apply_handle *h, char *word, apply_result_callback callback, void *data) {
+    h->mode = DOWN;
+    h->indexed = h->index_in ? 1 : 0;
+    h->binsearch = (h->last_net->arcs_sorted_in == 1) ? 1 : 0;
+    return(apply_updown_callback(h, word, callback, data));
+}
+
+int apply_up_callback(struct apply_handle *h, char *word, apply_result_callback callback, void *data) {
+    h->mode = UP;
+    h->indexed = h->index_out ? 1 : 0;
+    h->binsearch = (h->last_net->arcs_sorted_out == 1) ? 1 : 0;
+    return(apply_updown_callback(h, word, callback, data));
+}
+
+static char *apply_batch(struct apply_handle *h, char *(*applyf)(struct apply_handle *, char *), char **words, int nwords, int *counts, size_t *len) {
+    char *result;
+    size_t pos, rlen;
+    int i;
+
+    for (i = 0, pos = 0; i < nwords; i++) {
+	counts[i] = 0;
+	for (result = applyf(h, words[i]); result != NULL; result = applyf(h, NULL)) {
+	    rlen = strlen(result) + 1;
+	    while (pos + rlen > h->batch_bufsize) {
+		h->batch_bufsize = h->batch_bufsize ? h->batch_bufsize * 2 : DEFAULT_OUTSTRING_SIZE;
+		h->batch_buf = realloc(h->batch_buf, h->batch_bufsize);
+	    }
+	    memcpy(h->batch_buf+pos, result, rlen);
+	    pos += rlen;
+	    counts[i]++;
+	}
+    }
+    *len = pos;
+    return(h->batch_buf);
+}
+
+char *apply_down_batch(struct apply_handle *h, char **words, int nwords, int *counts, size_t *len) {
+    return(apply_batch(h, apply_down, words, nwords, counts, len));
+}
+
+char *apply_up_batch(struct apply_handle *h, char **words, int nwords, int *counts, size_t *len) {
+    return(apply_batch(h, apply_up, words, nwords, counts, len));
+}
+
 struct apply_handle *apply_init(struct fsm *net) {
     struct apply_handle *h;
 
-    srand((unsigned int) time(NULL));
     h = calloc(1,sizeof(struct apply_handle));
+    apply_set_seed(h, (unsigned long long) time(NULL) ^ (unsigned long long) (size_t) h);
     /* Init */
 
     h->iterate_old = 0;
@@ -363,6 +813,8 @@ static void apply_stack_push (struct apply_handle *h, int vmark, char *sflagname
 	ss->flagneg    = sflagneg;
     }
     (h->apply_stack_ptr)++;
+    APPLY_STAT(h, arcs_followed);
+    APPLY_STAT_MAX(h, max_depth, h->apply_stack_ptr);
 }
 
 void apply_reset_enumerator(struct apply_handle *h) {
@@ -375,187 +827,205 @@ void apply_reset_enumerator(struct apply_handle *h) {
     h->iterate_old = 0;
 }
 
-void apply_clear_index_list(struct apply_handle *h, struct apply_state_index **index) {
-    int i, j, statecount;
-    struct apply_state_index *iptr, *iptr_tmp, *iptr_zero;
-    if (index == NULL)
-	return;
-    statecount = h->last_net->statecount;
-    for (i = 0; i < statecount; i++) {
-	iptr = *(index+i);
-	if (iptr == NULL) {
-	    continue;
-	}
-	iptr_zero = *(index+i);
-	for (j = h->sigma_size - 1 ; j >= 0; j--) { /* Make sure to not free the list in EPSILON    */
-	    iptr = *(index+i) + j;                  /* as the other states lists' tails point to it */
-	    for (iptr = iptr->next ; iptr != NULL && iptr != iptr_zero; iptr = iptr_tmp) {
-		iptr_tmp = iptr->next;
-		free(iptr);
-	    }
-	}
-	free(*(index+i));
-    }
+/* Arc indexes: for the states chosen, the arcs are grouped by their  */
+/* in (or out) symbol into chains laid out in one array, and each such */
+/* state has a slot per symbol with the start of its chain.  The chain */
+/* of a symbol goes on into the chain of EPSILON, where flags also go, */
+/* so that one walk covers every arc that can be taken on the symbol.  */
+/* Within a chain, the first arc of the state comes first and the      */
+/* others follow from the last one up, the order in which indexed      */
+/* states have always given their results.  An index depends only on  */
+/* the net, so handles on the same net can share theirs               */
+/* (apply_index_share()); they are reference counted, atomically with */
+/* threads, so that handles sharing one may be freed in any thread.   */
+
+static INLINE int apply_index_symbol(struct apply_handle *h, int line, int inout) {
+    int sym;
+    sym = inout == APPLY_INDEX_INPUT ? (h->gstates+line)->in : (h->gstates+line)->out;
+    if (h->has_flags && (h->flag_lookup+sym)->type) {
+	sym = EPSILON;
+    }
+    if (sym == UNKNOWN) {  /* We make the index of UNKNOWN point to IDENTITY */
+	sym = IDENTITY;    /* since these are really the same symbol         */
+    }
+    return(sym);
 }
 
-void apply_clear_index(struct apply_handle *h) {
-    if (h->index_in) {
-	apply_clear_index_list(h, h->index_in);
-	free(h->index_in);
-	h->index_in = NULL;
-    }
-    if (h->index_out) {
-	apply_clear_index_list(h, h->index_out);
-	free(h->index_out);
-	h->index_out = NULL;
-    }
+/* The position in the index after pos in its chain, or -1 at the end */
+static INLINE int apply_index_next(struct apply_index *idx, int pos) {
+    pos++;
+    if (*(idx->arcs+pos) < -1)
+	pos = -(*(idx->arcs+pos) + 2);
+    return(*(idx->arcs+pos) == -1 ? -1 : pos);
 }
 
-void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only) {
-    struct fsm_state *fsm;
-    unsigned int cnt = 0;
-    int i, j, maxtrans, numtrans, laststate, sym;
-    fsm = h->gstates;
+static INLINE struct apply_index *apply_current_index(struct apply_handle *h) {
+    return(((h->mode) & DOWN) == DOWN ? h->index_in : h->index_out);
+}
 
-    struct apply_state_index **indexptr, *iptr, *tempiptr;
+static void apply_index_retain(struct apply_index *idx) {
+#ifdef FOMA_PTHREADS
+    __atomic_add_fetch(&idx->refcount, 1, __ATOMIC_RELAXED);
+#else
+    idx->refcount++;
+#endif
+}
 
-    struct pre_index {
-	int state_no;
-	struct pre_index *next;
-    } *pre_index, *tp, *tpp;
-    if (flags_only && !h->has_flags) {
+static void apply_index_release(struct apply_index *idx) {
+    if (idx == NULL)
 	return;
-    }
-    /* get numtrans */
-    for (i=0, laststate = 0, maxtrans = 0, numtrans = 0; (fsm+i)->state_no != -1; i++) {
-	if ((fsm+i)->state_no != laststate) {
-	    maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
-	    numtrans = 0;
-	}
-	if ((fsm+i)->target != -1) {
-	    numtrans++;
-	}
-	laststate = (fsm+i)->state_no;
-    }
-
-    pre_index = calloc(maxtrans+1, sizeof(struct pre_index));
-    for (i = 0; i <= maxtrans; i++) {
-	(pre_index+i)->state_no = -1;
-    }
+#ifdef FOMA_PTHREADS
+    if (__atomic_sub_fetch(&idx->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+	return;
+#else
+    if (--(idx->refcount) > 0)
+	return;
+#endif
+    free(idx->state_slots);
+    free(idx->slots);
+    free(idx->arcs);
+    free(idx);
+}
 
-    /* We create an array of states, indexed by how many transitions they have */
-    /* so that later, we can traverse them in order densest first, in case we  */
-    /* only want to index to some predefined maximum memory usage.             */
+void apply_clear_index(struct apply_handle *h) {
+    apply_index_release(h->index_in);
+    apply_index_release(h->index_out);
+    h->index_in = h->index_out = NULL;
+}
 
-    for (i = 0, laststate = 0, maxtrans = 0, numtrans = 0; (fsm+i)->state_no != -1; i++) {
-	if ((fsm+i)->state_no != laststate) {
-	    if ((pre_index+numtrans)->state_no == -1) {
-		(pre_index+numtrans)->state_no = laststate;
-	    } else {
-		tp = calloc(1, sizeof(struct pre_index));
-		tp->state_no = laststate;
-		tp->next = (pre_index+numtrans)->next;
-		(pre_index+numtrans)->next = tp;
-	    }
-	    maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
-	    numtrans = 0;
-	}
-	if ((fsm+i)->target != -1) {
-	    numtrans++;
-	}
-	laststate = (fsm+i)->state_no;
-    }
-    indexptr = NULL;
-    cnt += round_up_to_power_of_two(h->last_net->statecount*sizeof(struct apply_state_index *));
+struct apply_index_candidate {
+    int state_no;
+    int numtrans;
+};
 
-    if (cnt > mem_limit) {
-	cnt -= round_up_to_power_of_two(h->last_net->statecount*sizeof(struct apply_state_index *));
-	goto memlimitnoindex;
-    }
+static int apply_index_candidate_cmp(const void *a, const void *b) {
+    const struct apply_index_candidate *ca = a, *cb = b;
+    if (ca->numtrans != cb->numtrans)
+	return(cb->numtrans - ca->numtrans);
+    return(ca->state_no - cb->state_no);
+}
 
-    indexptr = calloc(h->last_net->statecount, sizeof(struct apply_state_index *));
+static struct apply_index *apply_index_build(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only) {
+    struct apply_index_candidate *cand;
+    struct apply_index *idx;
+    struct fsm_state *fsm;
+    int *count, *placed, i, k, s, line, sym, statecount, numcand, numindexed, apos, epsstart, start, base, arcs_size;
+    long long mem;
 
-    if (h->has_flags && flags_only) {
+    fsm = h->gstates;
+    statecount = h->last_net->statecount;
+    mem = (long long) statecount * sizeof(int);
+    if (mem > mem_limit)
+	return NULL;
+    if (h->has_flags && flags_only && !(h->flagstates)) {
 	/* Mark states that have flags */
-	if (!(h->flagstates)) {
-	    apply_mark_flagstates(h);
-	}
-    }
-
-    for (i = maxtrans; i >= 0; i--) {
-	for (tp = pre_index+i; tp != NULL; tp = tp->next) {
-	    if (tp->state_no >= 0) {
-		if (i < densitycutoff) {
-		    if (!(h->has_flags && flags_only && BITTEST(h->flagstates, tp->state_no))) {
-			continue;
-		    }
-		}
-		cnt += round_up_to_power_of_two(h->sigma_size*sizeof(struct apply_state_index));
-		if (cnt > mem_limit) {
-		    cnt -= round_up_to_power_of_two(h->sigma_size*sizeof(struct apply_state_index));
-		    goto memlimit;
-		}
-		*(indexptr + tp->state_no) = malloc(h->sigma_size*sizeof(struct apply_state_index));
-
-		/* We make the tail of all index linked lists point to the index  */
-		/* for EPSILON, so that we automatically when EPSILON transitions */
-		/* also when traversing an index.                                 */
-
-		for (j = 0; j < h->sigma_size; j++) {
-		    (*(indexptr + tp->state_no) + j)->fsmptr = -1;
-		    if (j == EPSILON)
-			(*(indexptr + tp->state_no) + j)->next = NULL;
-		    else
-			(*(indexptr + tp->state_no) + j)->next = (*(indexptr + tp->state_no)); /* all tails point to epsilon */
-		}
-	    }
-	}
+	apply_mark_flagstates(h);
     }
 
- memlimit:
-
-    for (i=0; (fsm+i)->state_no != -1; i++) {
-	iptr = *(indexptr + (fsm+i)->state_no);
-	if (iptr == NULL || (fsm+i)->target == -1) {
+    /* The states to index, densest first, for as long as memory allows */
+    cand = malloc(sizeof(struct apply_index_candidate) * statecount);
+    for (s = 0, numcand = 0; s < statecount; s++) {
+	if ((line = *(h->statemap+s)) == -1)
 	    continue;
+	for (i = 0; (fsm+line+i)->state_no == s && (fsm+line+i)->target != -1; i++) { }
+	if (i == 0 || (i < densitycutoff && !(h->has_flags && flags_only && BITTEST(h->flagstates, s))))
+	    continue;
+	(cand+numcand)->state_no = s;
+	(cand+numcand)->numtrans = i;
+	numcand++;
+    }
+    qsort(cand, numcand, sizeof(struct apply_index_candidate), apply_index_candidate_cmp);
+    for (numindexed = 0, arcs_size = 0; numindexed < numcand; numindexed++) {
+	/* Slots, and at most an end or jump after each arc */
+	mem += (long long) h->sigma_size * sizeof(int) + (2 * (cand+numindexed)->numtrans + 1) * sizeof(int);
+	if (mem > mem_limit)
+	    break;
+	arcs_size += 2 * (cand+numindexed)->numtrans + 1;
+    }
+
+    idx = calloc(1, sizeof(struct apply_index));
+    idx->refcount = 1;
+    idx->state_slots = malloc(sizeof(int) * statecount);
+    idx->slots = malloc(sizeof(int) * ((size_t) numindexed * h->sigma_size + 1));
+    idx->arcs = malloc(sizeof(int) * (arcs_size + 1));
+    idx->arcs_size = arcs_size;
+    for (s = 0; s < statecount; s++)
+	*(idx->state_slots+s) = -1;
+    count = calloc(h->sigma_size, sizeof(int));
+    placed = calloc(h->sigma_size, sizeof(int));
+
+    for (k = 0, apos = 0; k < numindexed; k++) {
+	s = (cand+k)->state_no;
+	base = k * h->sigma_size;
+	*(idx->state_slots+s) = base;
+	start = *(h->statemap+s);
+	for (line = start; (fsm+line)->state_no == s && (fsm+line)->target != -1; line++)
+	    count[apply_index_symbol(h, line, inout)]++;
+	/* The chain of EPSILON, then the other chains, each leading into it */
+	epsstart = apos;
+	apos += count[EPSILON];
+	*(idx->arcs+apos++) = -1;
+	for (sym = 0; sym < h->sigma_size; sym++) {
+	    if (sym == EPSILON || count[sym] == 0) {
+		*(idx->slots+base+sym) = epsstart;
+		continue;
+	    }
+	    *(idx->slots+base+sym) = apos;
+	    apos += count[sym];
+	    *(idx->arcs+apos++) = -(epsstart + 2);
 	}
-	sym = inout == APPLY_INDEX_INPUT ? (fsm+i)->in : (fsm+i)->out;
-
-	if (h->has_flags && (h->flag_lookup+sym)->type) {
-	    sym = EPSILON;
-	}
-	if (sym == UNKNOWN) {  /* We make the index of UNKNOWN point to IDENTITY */
-	    sym = IDENTITY;    /* since these are really the same symbol         */
+	for (line = start; (fsm+line)->state_no == s && (fsm+line)->target != -1; line++) {
+	    sym = apply_index_symbol(h, line, inout);
+	    i = placed[sym] == 0 ? 0 : count[sym] - placed[sym];
+	    *(idx->arcs+*(idx->slots+base+sym)+i) = line;
+	    placed[sym]++;
 	}
-	if ((iptr+sym)->fsmptr == -1) {
-	    (iptr+sym)->fsmptr = i;
-	} else {
-	    cnt += round_up_to_power_of_two(sizeof(struct apply_state_index));
-	    tempiptr = calloc(1, sizeof(struct apply_state_index));
-
-	    tempiptr->next = (iptr+sym)->next;
-	    tempiptr->fsmptr =  i;
-	    (iptr+sym)->next = tempiptr;
+	for (line = start; (fsm+line)->state_no == s && (fsm+line)->target != -1; line++) {
+	    sym = apply_index_symbol(h, line, inout);
+	    count[sym] = placed[sym] = 0;
 	}
     }
+    free(count);
+    free(placed);
+    free(cand);
+    return(idx);
+}
 
-    /* Free preindex */
-
- memlimitnoindex:
-
-    for (i = maxtrans; i >= 0; i--) {
-	for (tp = (pre_index+i)->next; tp != NULL; tp = tpp) {
-	    tpp = tp->next;
-	    free(tp);
+void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only) {
+    if (flags_only && !h->has_flags) {
+	return;
+    }
+    if (inout & APPLY_INDEX_INPUT) {
+	apply_index_release(h->index_in);
+	h->index_in = apply_index_build(h, APPLY_INDEX_INPUT, densitycutoff, mem_limit, flags_only);
+    }
+    if (inout & APPLY_INDEX_OUTPUT) {
+	apply_index_release(h->index_out);
+	if ((inout & APPLY_INDEX_INPUT) && h->last_net->arity == 1 && h->index_in != NULL) {
+	    /* Both sides are the same */
+	    h->index_out = h->index_in;
+	    apply_index_retain(h->index_out);
+	} else {
+	    h->index_out = apply_index_build(h, APPLY_INDEX_OUTPUT, densitycutoff, mem_limit, flags_only);
 	}
     }
-    free(pre_index);
+}
 
-    if (inout == APPLY_INDEX_INPUT) {
-	h->index_in = indexptr;
-    } else {
-	h->index_out = indexptr;
+int apply_index_share(struct apply_handle *h, struct apply_handle *from) {
+    if (h->gstates != from->gstates || h->sigma_size != from->sigma_size) {
+	return 0;
+    }
+    if (from->index_in != NULL) {
+	apply_index_release(h->index_in);
+	h->index_in = from->index_in;
+	apply_index_retain(h->index_in);
+    }
+    if (from->index_out != NULL) {
+	apply_index_release(h->index_out);
+	h->index_out = from->index_out;
+	apply_index_retain(h->index_out);
     }
+    return 1;
 }
 
 int apply_binarysearch(struct apply_handle *h) {
@@ -574,11 +1044,13 @@ int apply_binarysearch(struct apply_handle *h) {
     if (seeksym == nextsym || (nextsym == UNKNOWN && seeksym == IDENTITY))
 	return 1;
 
+    APPLY_STAT(h, binsearches);
     thisstate = (h->gstates+thisptr)->state_no;
     lastptr = *(h->statemap+thisstate)+*(h->numlines+thisstate)-1;
     thisptr++;
 
     if (seeksym == IDENTITY || lastptr - thisptr < APPLY_BINSEARCH_THRESHOLD) {
+	APPLY_STAT(h, linear_scans);
 	for ( ; thisptr <= lastptr; thisptr++) {
 	    nextsym = (((h->mode) & DOWN) == DOWN) ? (h->gstates+thisptr)->in : (h->gstates+thisptr)->out;
 	    if ((nextsym == seeksym) || (nextsym == UNKNOWN && seeksym == IDENTITY)) {
@@ -614,6 +1086,7 @@ int apply_binarysearch(struct apply_handle *h) {
 }
 
 int apply_follow_next_arc(struct apply_handle *h) {
+    struct apply_index *idx;
     char *fname, *fvalue;
     int eatupi, eatupo, symin, symout, fneg;
     int vcount, marksource, marktarget;
@@ -627,9 +1100,10 @@ int apply_follow_next_arc(struct apply_handle *h) {
     /*     For those states that aren't flag-free, (3) is used */
 
     if (h->state_has_index) {
-	for ( ; h->iptr != NULL && h->iptr->fsmptr != -1; ) {
+	idx = apply_current_index(h);
+	for ( ; h->iptr != -1; ) {
 
-	    h->ptr = h->curr_ptr = h->iptr->fsmptr;
+	    h->ptr = h->curr_ptr = *(idx->arcs+h->iptr);
 	    if (((h->mode) & DOWN) == DOWN) {
 		symin = (h->gstates+h->curr_ptr)->in;
 		symout = (h->gstates+h->curr_ptr)->out;
@@ -640,10 +1114,12 @@ int apply_follow_next_arc(struct apply_handle *h) {
 
 	    marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
 	    marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
+	    APPLY_STAT(h, arcs_tried);
+	    h->limit_arcs++;
 	    eatupi = apply_match_length(h, symin);
-	    if (!(eatupi == -1 || -1-(h->ipos)-eatupi == marktarget)) {     /* input 2x EPSILON loop check */
+	    if (!(eatupi == -1 || -1-(h->ipos)-eatupi == marktarget) && (!h->lazy_active || apply_lazy_live(h, (h->gstates+h->curr_ptr)->target, h->ipos+eatupi))) {     /* input 2x EPSILON loop check */
 		if ((eatupi = apply_match_str(h, symin, h->ipos)) != -1) {
-		    eatupo = apply_append(h, h->curr_ptr, symout);
+		    eatupo = (h->mode & CALLBACK) ? 0 : apply_append(h, h->curr_ptr, symout);
 		    if (h->obey_flags && h->has_flags && ((h->flag_lookup+symin)->type & (FLAG_UNIFY|FLAG_CLEAR|FLAG_POSITIVE|FLAG_NEGATIVE))) {
 			fname = (h->flag_lookup+symin)->name;
 			fvalue = h->oldflagvalue;
@@ -661,7 +1137,7 @@ int apply_follow_next_arc(struct apply_handle *h) {
 		    return 1;
 		}
 	    }
-	    h->iptr = h->iptr->next;
+	    h->iptr = apply_index_next(idx, h->iptr);
 	}
 	return 0;
     } else if ((h->binsearch && !(h->has_flags)) || (h->binsearch && !(BITTEST(h->flagstates, (h->gstates+h->ptr)->state_no)))) {
@@ -678,10 +1154,12 @@ int apply_follow_next_arc(struct apply_handle *h) {
 		marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
 		marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
 
+		APPLY_STAT(h, arcs_tried);
+		h->limit_arcs++;
 		eatupi = apply_match_length(h, symin);
-		if (eatupi != -1 && -1-(h->ipos)-eatupi != marktarget) {
+		if (eatupi != -1 && -1-(h->ipos)-eatupi != marktarget && (!h->lazy_active || apply_lazy_live(h, (h->gstates+h->curr_ptr)->target, h->ipos+eatupi))) {
 		    if ((eatupi = apply_match_str(h, symin, h->ipos)) != -1) {
-			eatupo = apply_append(h, h->curr_ptr, symout);
+			eatupo = (h->mode & CALLBACK) ? 0 : apply_append(h, h->curr_ptr, symout);
 
 			/* Push old position */
 			apply_stack_push(h, marksource, NULL, NULL, 0);
@@ -715,7 +1193,7 @@ int apply_follow_next_arc(struct apply_handle *h) {
 		    vcount++;
 		}
 		if (vcount > 0) {
-		    h->curr_ptr = h->ptr + (rand() % vcount);
+		    h->curr_ptr = h->ptr + (apply_random_next(h) % vcount);
 		} else {
 		    h->curr_ptr = h->ptr;
 		}
@@ -732,11 +1210,14 @@ int apply_follow_next_arc(struct apply_handle *h) {
 	    marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
 	    marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
 
+	    APPLY_STAT(h, arcs_tried);
+	    h->limit_arcs++;
 	    eatupi = apply_match_length(h, symin);
 
 	    if (eatupi == -1 || -1-(h->ipos)-eatupi == marktarget) { continue; } /* loop check */
+	    if (h->lazy_active && !apply_lazy_live(h, (h->gstates+h->curr_ptr)->target, h->ipos+eatupi)) { continue; } /* dead end */
 	    if ((eatupi = apply_match_str(h, symin, h->ipos)) != -1) {
-		eatupo = apply_append(h, h->curr_ptr, symout);
+		eatupo = (h->mode & CALLBACK) ? 0 : apply_append(h, h->curr_ptr, symout);
 		if (h->obey_flags && h->has_flags && ((h->flag_lookup+symin)->type & (FLAG_UNIFY|FLAG_CLEAR|FLAG_POSITIVE|FLAG_NEGATIVE))) {
 
 		    fname = (h->flag_lookup+symin)->name;
@@ -767,7 +1248,7 @@ char *apply_return_string(struct apply_handle *h) {
     *(h->outstring+h->opos) = '\0';
     if (((h->mode) & RANDOM) == RANDOM) {
 	/* To end or not to end */
-	if (!(rand() % 2)) {
+	if (!(apply_random_next(h) % 2)) {
 	    apply_stack_clear(h);
 	    h->iterator = 0;
 	    h->iterate_old = 0;
@@ -801,9 +1282,9 @@ void apply_mark_state(struct apply_handle *h) {
 
 void apply_skip_this_arc(struct apply_handle *h) {
     /* If we have index ptr */
-    if (h->iptr) {
-	h->ptr = h->iptr->fsmptr;
-	h->iptr = h->iptr->next;
+    if (h->iptr != -1) {
+	h->ptr = *(apply_current_index(h)->arcs+h->iptr);
+	h->iptr = apply_index_next(apply_current_index(h), h->iptr);
 	/* Otherwise */
     } else {
 	(h->ptr)++;
@@ -813,7 +1294,7 @@ void apply_skip_this_arc(struct apply_handle *h) {
 int apply_at_last_arc(struct apply_handle *h) {
     int seeksym, nextsym;
     if (h->state_has_index) {
-	if (h->iptr->next == NULL || h->iptr->next->fsmptr == -1) {
+	if (apply_index_next(apply_current_index(h), h->iptr) == -1) {
 	    return 1;
 	}
     } else {
@@ -835,39 +1316,28 @@ int apply_at_last_arc(struct apply_handle *h) {
     return 0;
 }
 
-/* map h->ptr (line pointer) to h->iptr (index pointer) */
+/* map h->ptr (line pointer) to h->iptr (index position) */
 void apply_set_iptr(struct apply_handle *h) {
-    struct apply_state_index **idx, *sidx;
-    int stateno, seeksym;
+    struct apply_index *idx;
+    int stateno, seeksym, pos;
     /* Check if state has index */
-    if ((idx = ((h->mode) & DOWN) == DOWN ? (h->index_in) : (h->index_out)) == NULL) {
+    if ((idx = apply_current_index(h)) == NULL) {
 	return;
     }
 
-    h->iptr = NULL;
+    h->iptr = -1;
     h->state_has_index = 0;
     stateno = (h->gstates+h->ptr)->state_no;
-    if (stateno < 0) {
+    if (stateno < 0 || *(idx->state_slots+stateno) == -1) {
 	return;
     }
-
-    sidx = *(idx + stateno);
-    if (sidx == NULL) { return; }
     seeksym = (h->sigmatch_array+h->ipos)->signumber;
     h->state_has_index = 1;
-    sidx = sidx + seeksym;
-    if (sidx->fsmptr == -1) {
-	if (sidx->next == NULL) {
-	    return;
-	} else {
-	    sidx = sidx->next;
-	}
-    }
-    h->iptr = sidx;
-    if (sidx->fsmptr == -1) {
-	h->iptr = NULL;
+    APPLY_STAT(h, index_hits);
+    pos = *(idx->slots+*(idx->state_slots+stateno)+seeksym);
+    if (*(idx->arcs+pos) != -1) {
+	h->iptr = pos;
     }
-    h->state_has_index = 1;
 }
 
 char *apply_net(struct apply_handle *h) {
@@ -893,14 +1363,36 @@ char *apply_net(struct apply_handle *h) {
     char *returnstring;
 
     if (h->iterate_old == 1) {     /* If called with NULL as the input word, this will be set */
+	if (h->truncated) {
+	    return NULL;
+	}
         goto resume;
     }
 
-    h->iptr = NULL; h->ptr = 0; h->ipos = 0; h->opos = 0;
+    APPLY_STAT(h, searches);
+    h->truncated = 0;
+    h->limited = (h->max_arcs || h->max_results || h->max_msec) && ((h->mode) & (ENUMERATE|RANDOM)) == 0;
+    if (h->limited) {
+	h->limit_arcs = 0;
+	h->limit_results = 0;
+	h->limit_steps = 0;
+	h->limit_start = h->max_msec ? apply_msec_now() : 0;
+    }
+    h->iptr = -1; h->state_has_index = 0; h->ptr = 0; h->ipos = 0; h->opos = 0;
     apply_set_iptr(h);
 
     apply_stack_clear(h);
 
+    /* Reject the word early, or find which states can still lead to */
+    /* acceptance, through the lazily determinized net               */
+    h->lazy_active = 0;
+    if (h->lazy != NULL && ((h->mode) & (ENUMERATE|RANDOM)) == 0) {
+	if ((h->lazy_active = apply_lazy_prepare(h, ((h->mode) & DOWN) == DOWN ? APPLY_INDEX_INPUT : APPLY_INDEX_OUTPUT)) == 0) {
+	    return NULL;
+	}
+	h->lazy_active = h->lazy_active == 1;
+    }
+
     if (h->has_flags) {
 	apply_clear_flags(h);
     }
@@ -912,6 +1404,7 @@ char *apply_net(struct apply_handle *h) {
 
     while(!apply_stack_isempty(h)) {
 	apply_stack_pop(h);
+	APPLY_STAT(h, backtracks);
 	/* If last line was popped */
 	if (apply_at_last_arc(h)) {
 	    *(h->marks+(h->gstates+h->ptr)->state_no) = 0; /* Unmark   */
@@ -919,6 +1412,9 @@ char *apply_net(struct apply_handle *h) {
 	}
 	apply_skip_this_arc(h);                            /* skip old pushed arc */
     L1:
+	if (h->limited && apply_over_limits(h)) {
+	    return(apply_truncate(h));
+	}
 	if (!apply_follow_next_arc(h)) {
 	    *(h->marks+(h->gstates+h->ptr)->state_no) = 0; /* Unmark   */
 	    continue;                                      /* pop next */
@@ -926,7 +1422,17 @@ char *apply_net(struct apply_handle *h) {
     L2:
 	/* Print accumulated string upon entry to state */
 	if ((h->gstates+h->ptr)->final_state == 1 && (h->ipos == h->current_instring_length || ((h->mode) & ENUMERATE) == ENUMERATE)) {
-	    if ((returnstring = (apply_return_string(h))) != NULL) {
+	    if (h->limited && h->max_results && h->limit_results++ >= h->max_results) {
+		return(apply_truncate(h));
+	    }
+	    if ((h->mode & CALLBACK) == CALLBACK) {
+		APPLY_STAT(h, results);
+		if (apply_emit_result(h)) {
+		    apply_force_clear_stack(h);
+		    return NULL;
+		}
+	    } else if ((returnstring = (apply_return_string(h))) != NULL) {
+		APPLY_STAT(h, results);
 		return(returnstring);
 	    }
 	}
@@ -1092,6 +1598,7 @@ int apply_match_str(struct apply_handle *h, int symbol, int position) {
 	    if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name, (h->flag_lookup+symbol)->value) == SUCCEED) {
 		return 0;
 	    } else {
+		APPLY_STAT(h, flag_fails);
 		return -1;
 	    }
 	}
@@ -1111,6 +1618,7 @@ int apply_match_str(struct apply_handle *h, int symbol, int position) {
 	if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name, (h->flag_lookup+symbol)->value) == SUCCEED) {
 	    return 0;
 	} else {
+	    APPLY_STAT(h, flag_fails);
 	    return -1;
 	}
     }
@@ -1220,7 +1728,7 @@ void apply_create_sigarray(struct apply_handle *h, struct fsm *net) {
     h->sigmatch_array = calloc(1024,sizeof(struct sigmatch_array));
     h->sigmatch_array_size = 1024;
 
-    h->sigs = malloc(sizeof(struct sigs)*(maxsigma+1));
+    h->sigs = calloc(maxsigma+1, sizeof(struct sigs));
     h->has_flags = 0;
     h->flag_list = NULL;
 
@@ -1282,22 +1790,9 @@ void apply_create_sigarray(struct apply_handle *h, struct fsm *net) {
 /* has information on which symbol we can match at that position        */
 /* as well as how many symbols matching consumes                        */
 
-void apply_create_sigmatch(struct apply_handle *h) {
-    char *symbol;
+static void apply_fill_sigmatch(struct apply_handle *h, char *symbol, int inlen, struct sigmatch_array *sigmatch) {
     struct sigma_trie *st;
-    int i, j, inlen, lastmatch, consumes, cons;
-    /* We create a sigmatch array only in case we match against a real string */
-    if (((h->mode) & ENUMERATE) == ENUMERATE) {
-	return;
-    }
-    symbol = h->instring;
-    inlen = strlen(symbol);
-    h->current_instring_length = inlen;
-    if (inlen >= h->sigmatch_array_size) {
-	free(h->sigmatch_array);
-	h->sigmatch_array = malloc(sizeof(struct sigmatch_array)*(inlen));
-	h->sigmatch_array_size = inlen;
-    }
+    int i, j, lastmatch, consumes, cons;
     /* Find longest match in alphabet at current position */
     /* by traversing the trie of alphabet symbols         */
     for (i=0; i < inlen; i += consumes ) {
@@ -1319,11 +1814,11 @@ void apply_create_sigmatch(struct apply_handle *h) {
 	    }
 	}
 	if (lastmatch != 0) {
-	    (h->sigmatch_array+i)->signumber = lastmatch;
+	    (sigmatch+i)->signumber = lastmatch;
 	    consumes = (h->sigs+lastmatch)->length;
 	} else {
 	    /* Not found in trie */
-	    (h->sigmatch_array+i)->signumber = IDENTITY;
+	    (sigmatch+i)->signumber = IDENTITY;
 	    consumes = utf8skip(symbol+i)+1;
 	}
 
@@ -1339,10 +1834,113 @@ void apply_create_sigmatch(struct apply_handle *h) {
         /*     [TAG] + D => ? if [TAG] is in the alphabet, but [TAG]+D isn't.     */
 
 	for (  ; (cons = utf8iscombining((unsigned char *)(symbol+i+consumes))); consumes += cons) {
-	    (h->sigmatch_array+i)->signumber = IDENTITY;
+	    (sigmatch+i)->signumber = IDENTITY;
 	}
-	(h->sigmatch_array+i)->consumes = consumes;
+	(sigmatch+i)->consumes = consumes;
+    }
+}
+
+void apply_create_sigmatch(struct apply_handle *h) {
+    int inlen;
+    /* We create a sigmatch array only in case we match against a real string */
+    if (((h->mode) & ENUMERATE) == ENUMERATE) {
+	return;
     }
+    inlen = strlen(h->instring);
+    h->current_instring_length = inlen;
+    if (inlen >= h->sigmatch_array_size) {
+	free(h->sigmatch_array);
+	h->sigmatch_array = malloc(sizeof(struct sigmatch_array)*(inlen));
+	h->sigmatch_array_size = inlen;
+    }
+    apply_fill_sigmatch(h, h->instring, inlen, h->sigmatch_array);
+}
+
+/* A tokenization of a string against the alphabet of a net that can be */
+/* applied several times, to the same handle or to handles of nets that  */
+/* share the same alphabet, without tokenizing the input again.          */
+
+struct apply_tokens *apply_tokenize(struct apply_handle *h, char *word) {
+    struct apply_tokens *t;
+    t = malloc(sizeof(struct apply_tokens));
+    t->length = strlen(word);
+    t->instring = strdup(word);
+    t->sigmatch = malloc(sizeof(struct sigmatch_array)*(t->length+1));
+    apply_fill_sigmatch(h, t->instring, t->length, t->sigmatch);
+    return(t);
+}
+
+/* Build a tokenization from symbol numbers of the net's alphabet, */
+/* e.g. from an external tokenizer.  The input string is made up   */
+/* of the symbols' strings.  Returns NULL for symbols not in sigma */
+/* (including the special symbols EPSILON, UNKNOWN and IDENTITY).  */
+
+struct apply_tokens *apply_tokens_from_symbols(struct apply_handle *h, int *symbols, int count) {
+    struct apply_tokens *t;
+    int i, len, sym;
+    for (i = 0, len = 0; i < count; i++) {
+	sym = *(symbols+i);
+	if (sym <= IDENTITY || sym >= h->sigma_size || (h->sigs+sym)->symbol == NULL) {
+	    return NULL;
+	}
+	len += (h->sigs+sym)->length;
+    }
+    t = malloc(sizeof(struct apply_tokens));
+    t->length = len;
+    t->instring = malloc(len+1);
+    t->sigmatch = malloc(sizeof(struct sigmatch_array)*(len+1));
+    for (i = 0, len = 0; i < count; i++) {
+	sym = *(symbols+i);
+	memcpy(t->instring+len, (h->sigs+sym)->symbol, (h->sigs+sym)->length);
+	(t->sigmatch+len)->signumber = sym;
+	(t->sigmatch+len)->consumes = (h->sigs+sym)->length;
+	len += (h->sigs+sym)->length;
+    }
+    *(t->instring+len) = '\0';
+    return(t);
+}
+
+void apply_tokens_free(struct apply_tokens *t) {
+    if (t == NULL)
+	return;
+    free(t->instring);
+    free(t->sigmatch);
+    free(t);
+}
+
+static char *apply_updown_tokens(struct apply_handle *h, struct apply_tokens *t) {
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+        return (NULL);
+    if (t == NULL) {
+	h->iterate_old = 1;
+	return(apply_net(h));
+    }
+    h->cache_active = 0;
+    h->iterate_old = 0;
+    h->instring = t->instring;
+    h->current_instring_length = t->length;
+    if (t->length >= h->sigmatch_array_size) {
+	free(h->sigmatch_array);
+	h->sigmatch_array = malloc(sizeof(struct sigmatch_array)*(t->length+1));
+	h->sigmatch_array_size = t->length+1;
+    }
+    memcpy(h->sigmatch_array, t->sigmatch, sizeof(struct sigmatch_array)*t->length);
+    apply_force_clear_stack(h);
+    return(apply_net(h));
+}
+
+char *apply_down_tokens(struct apply_handle *h, struct apply_tokens *t) {
+    h->mode = DOWN;
+    h->indexed = h->index_in ? 1 : 0;
+    h->binsearch = (h->last_net->arcs_sorted_in == 1) ? 1 : 0;
+    return(apply_updown_tokens(h, t));
+}
+
+char *apply_up_tokens(struct apply_handle *h, struct apply_tokens *t) {
+    h->mode = UP;
+    h->indexed = h->index_out ? 1 : 0;
+    h->binsearch = (h->last_net->arcs_sorted_out == 1) ? 1 : 0;
+    return(apply_updown_tokens(h, t));
 }
 
 void apply_add_flag(struct apply_handle *h, char *name) {
@@ -0,0 +1,256 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <string.h>
+#include "foma.h"
+
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#endif
+
+/* A bounded cache of complete apply results, keyed by the input string */
+/* and the apply direction.  Each entry stores all the results of one   */
+/* lookup as consecutive NUL-terminated strings.  Entries are kept on   */
+/* a doubly linked list in order of use and evicted from the least      */
+/* recently used end when the memory budget would be exceeded.  All     */
+/* access goes through one mutex so a cache can be shared by handles    */
+/* in different threads, as long as they all apply the same net with    */
+/* the same settings.                                                   */
+
+#define CACHE_INITIAL_BUCKETS 1024
+#define CACHE_MIN_BUCKETS 16
+
+struct apply_cache_entry {
+    unsigned int hash;
+    int mode;
+    int count;
+    size_t datalen;
+    char *key;
+    char *data;
+    struct apply_cache_entry *hnext;
+    struct apply_cache_entry *prev;
+    struct apply_cache_entry *next;
+};
+
+struct apply_cache {
+    struct apply_cache_entry **buckets;
+    unsigned int numbuckets;
+    unsigned int numentries;
+    struct apply_cache_entry *head;     /* Most recently used  */
+    struct apply_cache_entry *tail;     /* Least recently used */
+    size_t mem_used;
+    size_t mem_limit;
+    unsigned long long hits;
+    unsigned long long misses;
+#ifdef FOMA_PTHREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+static unsigned int cache_hashf(int mode, char *string) {
+    unsigned int hash;
+    hash = 2166136261U ^ (unsigned int) mode;
+    while (*string != '\0') {
+        hash = (hash ^ (unsigned char) *string++) * 16777619U;
+    }
+    return(hash);
+}
+
+static size_t cache_entry_size(struct apply_cache_entry *e) {
+    return(sizeof(struct apply_cache_entry) + strlen(e->key) + 1 + e->datalen);
+}
+
+static void cache_lock(struct apply_cache *c) {
+#ifdef FOMA_PTHREADS
+    pthread_mutex_lock(&c->lock);
+#endif
+}
+
+static void cache_unlock(struct apply_cache *c) {
+#ifdef FOMA_PTHREADS
+    pthread_mutex_unlock(&c->lock);
+#endif
+}
+
+static void cache_unlink(struct apply_cache *c, struct apply_cache_entry *e) {
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void cache_link_head(struct apply_cache *c, struct apply_cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head != NULL)
+        c->head->prev = e;
+    c->head = e;
+    if (c->tail == NULL)
+        c->tail = e;
+}
+
+static void cache_evict(struct apply_cache *c, struct apply_cache_entry *e) {
+    struct apply_cache_entry **ep;
+    for (ep = c->buckets + (e->hash & (c->numbuckets - 1)); *ep != e; ep = &((*ep)->hnext)) { }
+    *ep = e->hnext;
+    cache_unlink(c, e);
+    c->mem_used -= cache_entry_size(e);
+    c->numentries--;
+    free(e->key);
+    free(e->data);
+    free(e);
+}
+
+static void cache_grow(struct apply_cache *c) {
+    struct apply_cache_entry **newbuckets, *e, *enext;
+    unsigned int i, newsize;
+    newsize = c->numbuckets * 2;
+    newbuckets = calloc(newsize, sizeof(struct apply_cache_entry *));
+    for (i = 0; i < c->numbuckets; i++) {
+        for (e = *(c->buckets+i); e != NULL; e = enext) {
+            enext = e->hnext;
+            e->hnext = *(newbuckets + (e->hash & (newsize - 1)));
+            *(newbuckets + (e->hash & (newsize - 1))) = e;
+        }
+    }
+    free(c->buckets);
+    c->mem_used += (newsize - c->numbuckets) * sizeof(struct apply_cache_entry *);
+    c->buckets = newbuckets;
+    c->numbuckets = newsize;
+}
+
+struct apply_cache *apply_cache_init(size_t mem_limit) {
+    struct apply_cache *c;
+    c = calloc(1, sizeof(struct apply_cache));
+    /* The bucket array counts against the budget: keep it to a */
+    /* sixteenth of it, so that a small cache still has room    */
+    for (c->numbuckets = CACHE_INITIAL_BUCKETS; c->numbuckets > CACHE_MIN_BUCKETS && c->numbuckets * sizeof(struct apply_cache_entry *) > mem_limit / 16; c->numbuckets /= 2) { }
+    c->buckets = calloc(c->numbuckets, sizeof(struct apply_cache_entry *));
+    c->mem_limit = mem_limit;
+    c->mem_used = c->numbuckets * sizeof(struct apply_cache_entry *);
+#ifdef FOMA_PTHREADS
+    pthread_mutex_init(&c->lock, NULL);
+#endif
+    return(c);
+}
+
+void apply_cache_clear(struct apply_cache *c) {
+    struct apply_cache_entry *e, *enext;
+    if (c == NULL)
+        return;
+    for (e = c->head; e != NULL; e = enext) {
+        enext = e->next;
+        free(e->key);
+        free(e->data);
+        free(e);
+    }
+#ifdef FOMA_PTHREADS
+    pthread_mutex_destroy(&c->lock);
+#endif
+    free(c->buckets);
+    free(c);
+}
+
+void apply_cache_stats(struct apply_cache *c, unsigned long long *hits, unsigned long long *misses, size_t *mem_used) {
+    cache_lock(c);
+    if (hits != NULL)
+        *hits = c->hits;
+    if (misses != NULL)
+        *misses = c->misses;
+    if (mem_used != NULL)
+        *mem_used = c->mem_used;
+    cache_unlock(c);
+}
+
+/* Copy the results for (mode, key) into *buf (grown as needed) and */
+/* return their number, or -1 if not found.                         */
+
+int apply_cache_find(struct apply_cache *c, int mode, char *key, char **buf, size_t *bufsize) {
+    struct apply_cache_entry *e;
+    unsigned int hash;
+    int count;
+    hash = cache_hashf(mode, key);
+    cache_lock(c);
+    for (e = *(c->buckets + (hash & (c->numbuckets - 1))); e != NULL; e = e->hnext) {
+        if (e->hash == hash && e->mode == mode && strcmp(e->key, key) == 0)
+            break;
+    }
+    if (e == NULL) {
+        c->misses++;
+        cache_unlock(c);
+        return -1;
+    }
+    c->hits++;
+    if (e != c->head) {
+        cache_unlink(c, e);
+        cache_link_head(c, e);
+    }
+    if (e->datalen > *bufsize) {
+        *bufsize = e->datalen;
+        *buf = realloc(*buf, *bufsize);
+    }
+    if (e->datalen > 0)
+        memcpy(*buf, e->data, e->datalen);
+    count = e->count;
+    cache_unlock(c);
+    return(count);
+}
+
+void apply_cache_add(struct apply_cache *c, int mode, char *key, char *data, size_t datalen, int count) {
+    struct apply_cache_entry *e;
+    size_t size;
+    unsigned int hash;
+    size = sizeof(struct apply_cache_entry) + strlen(key) + 1 + datalen;
+    if (size > c->mem_limit)
+        return;
+    hash = cache_hashf(mode, key);
+    cache_lock(c);
+    /* Another thread may have added it meanwhile */
+    for (e = *(c->buckets + (hash & (c->numbuckets - 1))); e != NULL; e = e->hnext) {
+        if (e->hash == hash && e->mode == mode && strcmp(e->key, key) == 0) {
+            cache_unlock(c);
+            return;
+        }
+    }
+    while (c->tail != NULL && c->mem_used + size > c->mem_limit) {
+        cache_evict(c, c->tail);
+    }
+    e = malloc(sizeof(struct apply_cache_entry));
+    e->hash = hash;
+    e->mode = mode;
+    e->count = count;
+    e->datalen = datalen;
+    e->key = strdup(key);
+    e->data = NULL;
+    if (datalen > 0) {
+        e->data = malloc(datalen);
+        memcpy(e->data, data, datalen);
+    }
+    e->hnext = *(c->buckets + (hash & (c->numbuckets - 1)));
+    *(c->buckets + (hash & (c->numbuckets - 1))) = e;
+    cache_link_head(c, e);
+    c->mem_used += size;
+    c->numentries++;
+    if (c->numentries > c->numbuckets && (c->numbuckets * sizeof(struct apply_cache_entry *)) < c->mem_limit / 4)
+        cache_grow(c);
+    cache_unlock(c);
+}
@@ -32,6 +32,7 @@ struct fsm *fsm_coaccessible(struct fsm *net) {
 
 
   struct fsm_state *fsm;
+  struct int_stack *stack;
 
   fsm = net->states;
   new_arccount = 0;
@@ -66,23 +67,24 @@ struct fsm *fsm_coaccessible(struct fsm *net) {
 
   /* Push & mark finals */
 
+  stack = int_stack_init();
   markcount = 0;
   for (i=0; (fsm+i)->state_no != -1; i++) {
     if ((fsm+i)->final_state && (!*(coacc+((fsm+i)->state_no)))) {
-      int_stack_push((fsm+i)->state_no);
+      int_stack_push(stack, (fsm+i)->state_no);
       *(coacc+(fsm+i)->state_no) = 1;
       markcount++;
     }
   }
 
   terminate = 0;
-  while(!int_stack_isempty()) {
-    current_state = int_stack_pop();
+  while(!int_stack_isempty(stack)) {
+    current_state = int_stack_pop(stack);
     current_ptr = inverses+current_state;
     while(current_ptr != NULL && current_ptr->state != -1) {
       if (!*(coacc+(current_ptr->state))) {
 	*(coacc+(current_ptr->state)) = 1;
-	int_stack_push(current_ptr->state);
+	int_stack_push(stack, current_ptr->state);
 	markcount++;
       }
       current_ptr = current_ptr->next;
@@ -90,10 +92,10 @@ struct fsm *fsm_coaccessible(struct fsm *net) {
     if (markcount >= net->statecount) {
       /* printf("Already coacc\n");  */
       terminate = 1;
-      int_stack_clear();
       break;
     }
   }
+  int_stack_free(stack);
 
 
   if (terminate == 0) {
@@ -150,6 +152,10 @@ struct fsm *fsm_coaccessible(struct fsm *net) {
       net->states = fsm_empty();
       fsm_sigma_destroy(net->sigma);
       net->sigma = sigma_create();
+      /* State 0 is still there, as in fsm_empty_set() */
+      markcount = 1;
+      new_linecount = 2;
+      new_arccount = 0;
     }
     net->linecount = new_linecount;
     net->arccount = new_arccount;
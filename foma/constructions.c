@@ -27,13 +27,14 @@
 #define COMPLEMENT 0
 #define COMPLETE 1
 
-#define STACK_3_PUSH(a,b,c) int_stack_push(a); int_stack_push(b); int_stack_push(c);
-#define STACK_2_PUSH(a,b) int_stack_push(a); int_stack_push(b);
+#define STACK_3_PUSH(s,a,b,c) int_stack_push(s,a); int_stack_push(s,b); int_stack_push(s,c);
+#define STACK_2_PUSH(s,a,b) int_stack_push(s,a); int_stack_push(s,b);
 
 struct mergesigma {
   char *symbol;
   unsigned char presence; /* 1 = in net 1, 2 = in net 2, 3 = in both */
   int number;
+  int id;
   struct mergesigma *next;
 };
 
@@ -257,6 +258,7 @@ struct state_arr *init_state_pointers(struct fsm_state *fsm_state) {
   for (i=0; i<states; i++) {
     (state_arr+i)->final = 0;
     (state_arr+i)->start = 0;
+    (state_arr+i)->transitions = NULL;
   }
 
   for (i=0; (fsm_state+i)->state_no != -1; i++) {
@@ -269,6 +271,11 @@ struct state_arr *init_state_pointers(struct fsm_state *fsm_state) {
       sold = (fsm_state+i)->state_no;
     }
   }
+  /* States without any lines point at the final -1 line: no transitions */
+  for (sold=0; sold<states; sold++) {
+    if ((state_arr+sold)->transitions == NULL)
+      (state_arr+sold)->transitions = fsm_state+i;
+  }
   return(state_arr);
 }
 
@@ -405,6 +412,7 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
     struct state_arr *point_a, *point_b;
     struct fsm *new_net;
     struct triplethash *th;
+    struct int_stack *stack;
 
     net1 = fsm_minimize(net1);
     net2 = fsm_minimize(net2);
@@ -429,7 +437,8 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
     /* Intersect two networks by the running-in-parallel method */
     /* new state 0 = {0,0} */
 
-    STACK_2_PUSH(0,0);
+    stack = int_stack_init();
+    STACK_2_PUSH(stack, 0,0);
 
     th = triplet_hash_init();
     triplet_hash_insert(th, 0, 0, 0);
@@ -439,12 +448,12 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
     point_a = init_state_pointers(machine_a);
     point_b = init_state_pointers(machine_b);
 
-    while (!int_stack_isempty()) {
+    while (!int_stack_isempty(stack)) {
 
         /* Get a pair of states to examine */
 
-        a = int_stack_pop();
-        b = int_stack_pop();
+        a = int_stack_pop(stack);
+        b = int_stack_pop(stack);
 
 	current_state = triplet_hash_find(th, a, b, 0);
         current_start = (((point_a+a)->start == 1) && ((point_b+b)->start == 1)) ? 1 : 0;
@@ -477,7 +486,7 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
                 continue;
 
             if ((target_number = triplet_hash_find(th, machine_a->target, bptr->target, 0)) == -1) {
-                STACK_2_PUSH(bptr->target, machine_a->target);
+                STACK_2_PUSH(stack, bptr->target, machine_a->target);
                 target_number = triplet_hash_insert(th, machine_a->target, bptr->target, 0);
             }
 
@@ -497,9 +506,23 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
     free(point_b);
     free(array);
     triplet_hash_free(th);
+    int_stack_free(stack);
     return(fsm_coaccessible(new_net));
 }
 
+/* UNKNOWN and IDENTITY are joined under UNKNOWN in fsm_compose() */
+#define COMPOSE_JOIN_KEY(x) ((x) == IDENTITY ? UNKNOWN : (x))
+
+/* Is there no initial state other than 0? */
+static int fsm_compose_single_start(struct fsm *net) {
+    struct fsm_state *fsm;
+    for (fsm = net->states; fsm->state_no != -1; fsm++) {
+        if (fsm->start_state && fsm->state_no != 0)
+            return 0;
+    }
+    return 1;
+}
+
 struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
 
 
@@ -532,28 +555,32 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
     /* However, for generic cases, bistate seems to yield smaller transducers.          */
     /* The global variable g_compose_tristate is set to OFF by default                  */
 
-    struct outarray {
-        short int symin;
-        short int symout;
-        int target;
-        int mainloop;
-    } *outarray, *iptr, *currtail;
-
-    struct index {
-        struct outarray *tail;
-    } *index;
+    /* The arcs of net1 are sorted by output and those of net2 by input, so that the  */
+    /* matching arcs of a state pair are found by a merge join of the two arc lists.   */
+    /* UNKNOWN and IDENTITY sort next to each other and are joined as one label, as    */
+    /* they share some semantics.  The inputs are minimized first unless the variable  */
+    /* g_compose_minimize is OFF.                                                      */
 
-    extern int g_compose_tristate, g_flag_is_epsilon;
-    int a,b,i,mainloop,current_state, current_start, current_final, target_number, ain, bin, aout, bout, asearch, max2sigma;
-    struct fsm_state *machine_a, *machine_b;
+    extern int g_compose_tristate, g_flag_is_epsilon, g_compose_minimize;
+    int a,b,current_state, current_start, current_final, target_number, ain, bin, aout, bout, akey, bkey, max2sigma;
+    struct fsm_state *machine_a, *machine_b, *agroup, *bgroup, *aend, *bend;
     struct state_arr *point_a, *point_b;
     struct triplethash *th;
+    struct int_stack *stack;
     int mode;
     _Bool *is_flag = NULL;
 
 
-    net1 = fsm_minimize(net1);
-    net2 = fsm_minimize(net2);
+    if (g_compose_minimize) {
+        net1 = fsm_minimize(net1);
+        net2 = fsm_minimize(net2);
+    } else {
+        /* The product starts from (0,0): make sure 0 is the only initial state */
+        if (!fsm_compose_single_start(net1))
+            net1 = fsm_determinize(net1);
+        if (!fsm_compose_single_start(net2))
+            net2 = fsm_determinize(net2);
+    }
 
     if (fsm_isempty(net1) || fsm_isempty(net2)) {
 	fsm_destroy(net1);
@@ -617,29 +644,16 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
 
     fsm_update_flags(net1, YES, NO, UNK, YES, UNK, UNK);
 
+    /* Always sort: merging the sigmas may have renumbered the symbols */
+    fsm_sort_arcs(net1, 2);
+    fsm_sort_arcs(net2, 1);
+
     machine_a = net1->states;
     machine_b = net2->states;
 
-    max2sigma = sigma_max(net2->sigma);
-
-    /* Create an index for looking up input symbols in machine b quickly */
-    /* We store each machine_b->in symbol in outarray[symin][...] */
-    /* the array index[symin] points to the tail of the current list in outarray */
-    /* (we may have many entries for one input symbol as there may be many outputs */
-    /* The field mainloop tells us whether the entry is current as we want to loop */
-    /* UNKNOWN and IDENTITY are indexed as UNKNOWN because we need to find both */
-    /* as they share some semantics */
-
-    index = calloc(max2sigma+1, sizeof(struct index));
-    outarray = calloc((max2sigma+2)*(max2sigma+1), sizeof(struct outarray));
-
-    for (i=0; i <= max2sigma; i++) {
-        (index+i)->tail = outarray + ((max2sigma+2)*i);
-    }
-
-
     /* Mode, a, b */
-    STACK_3_PUSH(0,0,0);
+    stack = int_stack_init();
+    STACK_3_PUSH(stack, 0,0,0);
 
     th = triplet_hash_init();
     triplet_hash_insert(th, 0, 0, 0);
@@ -649,15 +663,13 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
     point_a = init_state_pointers(machine_a);
     point_b = init_state_pointers(machine_b);
 
-    mainloop = 0;
-
-    while (!int_stack_isempty()) {
+    while (!int_stack_isempty(stack)) {
 
         /* Get a pair of states to examine */
 
-        a = int_stack_pop();
-        b = int_stack_pop();
-        mode = int_stack_pop();
+        a = int_stack_pop(stack);
+        b = int_stack_pop(stack);
+        mode = int_stack_pop(stack);
 
 	current_state = triplet_hash_find(th, a,b,mode);
         current_start = (((point_a+a)->start == 1) && ((point_b+b)->start == 1) && (mode == 0)) ? 1 : 0;
@@ -665,89 +677,75 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
 
         fsm_state_set_current_state(current_state, current_final, current_start);
 
-        /* Create the index for machine b in this state */
-        for (mainloop++, machine_b = (point_b+b)->transitions; machine_b->state_no == b ; machine_b++) {
-            int bindex;
-            /* Index b */
-            bindex = (machine_b->in == IDENTITY) ? UNKNOWN : machine_b->in;
-            if (bindex < 0 || machine_b->target < 0)
+        /* Merge join the arcs of a (by output) with those of b (by input) */
+        machine_a = (point_a+a)->transitions;
+        machine_b = (point_b+b)->transitions;
+        while (machine_a->state_no == a && machine_b->state_no == b) {
+            if (machine_a->out < 0 || machine_a->target < 0) {
+                machine_a++;
                 continue;
-
-            iptr = (index+bindex)->tail;
-            if (iptr->mainloop != mainloop) {
-                iptr = (index+bindex)->tail = outarray+(bindex*(max2sigma+2));
-            } else {
-                iptr++;
             }
-            iptr->symin = machine_b->in;
-            iptr->symout = machine_b->out;
-            iptr->mainloop = mainloop;
-            iptr->target = machine_b->target;
-            (index+bindex)->tail = iptr;
-        }
-
-        for (machine_a = (point_a+a)->transitions ; machine_a->state_no == a ; machine_a++) {
+            if (machine_b->in < 0 || machine_b->target < 0) {
+                machine_b++;
+                continue;
+            }
+            akey = COMPOSE_JOIN_KEY(machine_a->out);
+            bkey = COMPOSE_JOIN_KEY(machine_b->in);
+            if (akey < bkey) {
+                machine_a++;
+                continue;
+            }
+            if (akey > bkey) {
+                machine_b++;
+                continue;
+            }
+            for (aend = machine_a; aend->state_no == a && COMPOSE_JOIN_KEY(aend->out) == akey; aend++) { }
+            for (bend = machine_b; bend->state_no == b && COMPOSE_JOIN_KEY(bend->in) == bkey; bend++) { }
 
-            /* If we have the same transition from (a,b)-> some state */
-            /* If we have x:y y:z trans to some state */
-            aout = machine_a->out;
-            ain = machine_a->in;
-            /* IDENTITY is indexed under UNKNOWN (see above) */
-            asearch = (aout == IDENTITY) ? UNKNOWN : aout;
-            if (aout < 0) continue;
-            iptr = outarray+(asearch*(max2sigma+2));
-            currtail = (index+asearch)->tail + 1;
-            for ( ; iptr != currtail && iptr->mainloop == mainloop ; iptr++) {
-
-                ain = machine_a->in;
-                aout = machine_a->out;
-                bin = iptr->symin;
-                bout = iptr->symout;
-
-                if (aout == IDENTITY && bin == UNKNOWN) {
-                    ain = aout = UNKNOWN;
-                }
-                else if (aout == UNKNOWN && bin == IDENTITY) {
-                    bin = bout = UNKNOWN;
-                }
+            for (agroup = machine_a; agroup != aend; agroup++) {
+                for (bgroup = machine_b; bgroup != bend; bgroup++) {
 
-                if (!g_compose_tristate) {
-                    if (bin == aout && bin != -1 && (bin != EPSILON || mode == 0)) {
-                        /* mode -> 0 */
-                        if ((target_number = triplet_hash_find(th, machine_a->target, iptr->target, 0)) == -1) {
-                            STACK_3_PUSH(0, iptr->target, machine_a->target);
-                            target_number = triplet_hash_insert(th, machine_a->target, iptr->target, 0);
-                        }
+                    /* If we have x:y y:z trans to some state */
+                    ain = agroup->in;
+                    aout = agroup->out;
+                    bin = bgroup->in;
+                    bout = bgroup->out;
 
-                        fsm_state_add_arc(current_state, ain, bout, target_number, current_final, current_start);
+                    if (aout == IDENTITY && bin == UNKNOWN) {
+                        ain = aout = UNKNOWN;
+                    }
+                    else if (aout == UNKNOWN && bin == IDENTITY) {
+                        bin = bout = UNKNOWN;
                     }
-                }
 
-                else if (g_compose_tristate) {
-                    if (bin == aout && bin != -1 && ((bin != EPSILON || mode == 0))) {
+                    if (bin == aout && bin != -1 && (bin != EPSILON || mode == 0)) {
                         /* mode -> 0 */
-                        if ((target_number = triplet_hash_find(th, machine_a->target, iptr->target, 0)) == -1) {
-                            STACK_3_PUSH(0, iptr->target, machine_a->target);
-                            target_number = triplet_hash_insert(th, machine_a->target, iptr->target, 0);
+                        if ((target_number = triplet_hash_find(th, agroup->target, bgroup->target, 0)) == -1) {
+                            STACK_3_PUSH(stack, 0, bgroup->target, agroup->target);
+                            target_number = triplet_hash_insert(th, agroup->target, bgroup->target, 0);
                         }
 
                         fsm_state_add_arc(current_state, ain, bout, target_number, current_final, current_start);
                     }
                 }
-
             }
+            machine_a = aend;
+            machine_b = bend;
         }
 
         /* Treat epsilon outputs on machine a (may include flags) */
         for (machine_a = (point_a+a)->transitions ; machine_a->state_no == a ; machine_a++) {
             aout = machine_a->out;
+            /* The arcs are sorted, so the A:0 arcs come first */
+            if (aout > EPSILON && g_flag_is_epsilon == 0)
+                break;
             if (aout != EPSILON && g_flag_is_epsilon == 0)
                 continue;
             ain = machine_a->in;
 
             if (g_flag_is_epsilon && aout != -1 && mode == 0 && *(is_flag+aout)) {
                 if ((target_number = triplet_hash_find(th, machine_a->target, b, 0)) == -1) {
-                    STACK_3_PUSH(0, b, machine_a->target);
+                    STACK_3_PUSH(stack, 0, b, machine_a->target);
 		    target_number = triplet_hash_insert(th, machine_a->target, b, 0);
                 }
                 fsm_state_add_arc(current_state, ain, aout, target_number, current_final, current_start);
@@ -758,7 +756,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
                 if (aout == EPSILON && mode == 0) {
                     /* mode -> 0 */
                     if ((target_number = triplet_hash_find(th, machine_a->target, b, 0)) == -1) {
-                        STACK_3_PUSH(0, b, machine_a->target);
+                        STACK_3_PUSH(stack, 0, b, machine_a->target);
                         target_number = triplet_hash_insert(th, machine_a->target, b, 0);
                     }
 
@@ -770,7 +768,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
                 if (aout == EPSILON && (mode != 2)) {
                     /* mode -> 1 */
                     if ((target_number = triplet_hash_find(th, machine_a->target, b, 1)) == -1) {
-                        STACK_3_PUSH(1, b, machine_a->target);
+                        STACK_3_PUSH(stack, 1, b, machine_a->target);
                         target_number = triplet_hash_insert(th, machine_a->target, b, 1);
                     }
 
@@ -783,6 +781,8 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
         /* Treat epsilon inputs on machine b (may include flags) */
         for (machine_b = (point_b+b)->transitions; machine_b->state_no == b ; machine_b++) {
             bin = machine_b->in;
+            if (bin > EPSILON && g_flag_is_epsilon == 0)
+                break;
             if (bin != EPSILON && g_flag_is_epsilon == 0)
                 continue;
 
@@ -790,7 +790,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
 
             if (g_flag_is_epsilon && bin != -1 && *(is_flag+bin)) {
                 if ((target_number = triplet_hash_find(th, a, machine_b->target, 1)) == -1) {
-                    STACK_3_PUSH(1, machine_b->target,a);
+                    STACK_3_PUSH(stack, 1, machine_b->target,a);
                     target_number = triplet_hash_insert(th, a, machine_b->target, 1);
                 }
                 fsm_state_add_arc(current_state, bin, bout, target_number, current_final, current_start);
@@ -801,7 +801,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
                 if (bin == EPSILON) {
                     /* mode -> 1 */
                     if ((target_number = triplet_hash_find(th, a, machine_b->target, 1)) == -1) {
-                        STACK_3_PUSH(1, machine_b->target,a);
+                        STACK_3_PUSH(stack, 1, machine_b->target,a);
                         target_number = triplet_hash_insert(th, a, machine_b->target, 1);
                     }
 
@@ -814,7 +814,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
                 if (bin == EPSILON && mode != 1) {
                     /* mode -> 1 */
                     if ((target_number = triplet_hash_find(th, a, machine_b->target, 2)) == -1) {
-                        STACK_3_PUSH(2, machine_b->target, a);
+                        STACK_3_PUSH(stack, 2, machine_b->target, a);
                         target_number = triplet_hash_insert(th, a, machine_b->target, 2);
                     }
 
@@ -830,16 +830,324 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
     fsm_state_close(net1);
     free(point_a);
     free(point_b);
-    free(index);
-    free(outarray);
 
     if (g_flag_is_epsilon)
         free(is_flag);
     triplet_hash_free(th);
+    int_stack_free(stack);
     net1 = fsm_topsort(fsm_coaccessible(net1));
     return(fsm_coaccessible(net1));
 }
 
+/* An open addressing table (with linear probing) of int tuples of a fixed width,  */
+/* numbered in order of insertion.  The tuples themselves are kept in one array,    */
+/* the tuple with key k at tuples + k*width.  Rehashed at occupancy 0.5 as above.   */
+
+struct tuplehash {
+    int *tuples;
+    int *table;
+    int width;
+    unsigned int tablesize;
+    int occupancy;
+    int tuples_size;
+};
+
+static struct tuplehash *tuple_hash_init(int width) {
+    struct tuplehash *th;
+    unsigned int i;
+    th = malloc(sizeof(struct tuplehash));
+    th->width = width;
+    th->tablesize = 128;
+    th->occupancy = 0;
+    th->tuples_size = 64;
+    th->tuples = malloc(sizeof(int) * width * th->tuples_size);
+    th->table = malloc(sizeof(int) * th->tablesize);
+    for (i = 0; i < th->tablesize; i++)
+        *(th->table+i) = -1;
+    return(th);
+}
+
+static void tuple_hash_free(struct tuplehash *th) {
+    free(th->tuples);
+    free(th->table);
+    free(th);
+}
+
+static unsigned int tuple_hash_hashf(int *tuple, int width) {
+    unsigned int hash;
+    int i;
+    for (i = 0, hash = 2166136261U; i < width; i++)
+        hash = (hash ^ (unsigned int)tuple[i]) * 16777619U;
+    return(hash);
+}
+
+/* Returns the key of tuple, inserting it if new (*isnew is then set) */
+static int tuple_hash_find_insert(struct tuplehash *th, int *tuple, int *isnew) {
+    unsigned int hash, i;
+    int key, *old;
+    hash = tuple_hash_hashf(tuple, th->width) & (th->tablesize - 1);
+    for (;;) {
+        key = *(th->table+hash);
+        if (key == -1)
+            break;
+        if (memcmp(th->tuples + (size_t)key * th->width, tuple, sizeof(int) * th->width) == 0) {
+            *isnew = 0;
+            return(key);
+        }
+        hash = (hash + 1) & (th->tablesize - 1);
+    }
+    *isnew = 1;
+    key = th->occupancy++;
+    if (key == th->tuples_size) {
+        th->tuples_size *= 2;
+        th->tuples = realloc(th->tuples, sizeof(int) * th->width * th->tuples_size);
+    }
+    memcpy(th->tuples + (size_t)key * th->width, tuple, sizeof(int) * th->width);
+    *(th->table+hash) = key;
+    if ((unsigned int)th->occupancy > th->tablesize / 2) {
+        old = th->table;
+        th->table = malloc(sizeof(int) * th->tablesize * 2);
+        for (i = 0; i < th->tablesize * 2; i++)
+            *(th->table+i) = -1;
+        for (i = 0; i < th->tablesize; i++) {
+            if (*(old+i) == -1)
+                continue;
+            hash = tuple_hash_hashf(th->tuples + (size_t)*(old+i) * th->width, th->width) & (th->tablesize * 2 - 1);
+            while (*(th->table+hash) != -1)
+                hash = (hash + 1) & (th->tablesize * 2 - 1);
+            *(th->table+hash) = *(old+i);
+        }
+        th->tablesize *= 2;
+        free(old);
+    }
+    return(key);
+}
+
+/* Arcs of a partial product in fsm_compose_n(): in, out, then the target tuple */
+
+struct compose_arcs {
+    int *recs;
+    int reclen;
+    int count;
+    int size;
+};
+
+static int *compose_arcs_add(struct compose_arcs *ca, int in, int out) {
+    int *rec;
+    if (ca->count == ca->size) {
+        ca->size *= 2;
+        ca->recs = realloc(ca->recs, sizeof(int) * ca->reclen * ca->size);
+    }
+    rec = ca->recs + (size_t)ca->count * ca->reclen;
+    ca->count++;
+    rec[0] = in;
+    rec[1] = out;
+    return(rec+2);
+}
+
+static int compose_arcs_cmp(const void *a, const void *b) {
+    return(COMPOSE_JOIN_KEY(((const int *)a)[1]) - COMPOSE_JOIN_KEY(((const int *)b)[1]));
+}
+
+struct fsm *fsm_compose_n(struct fsm **nets, int n) {
+
+    /* Composes nets[0] .o. nets[1] .o. ... .o. nets[n-1] by exploring the product of */
+    /* all n machines at once, so that no intermediate result is built or minimized.   */
+    /* A state of the product is the tuple q0 m1 q1 m2 q2 ... m(n-1) q(n-1), where qi  */
+    /* is a state of machine i and mi is the bistate mode (see fsm_compose()) between  */
+    /* machines 0..i-1, taken as one machine, and machine i.  The arcs of a state are  */
+    /* found machine by machine: the arcs of 0..i-1 are joined with those of machine i */
+    /* exactly as fsm_compose() joins two machines, so the relation is the same as     */
+    /* that of composing pairwise from the left.  If compose-minimize is ON, the        */
+    /* arguments and the result are minimized.                                          */
+
+    extern int g_compose_tristate, g_flag_is_epsilon, g_compose_minimize;
+    struct state_arr **points;
+    struct tuplehash *th;
+    struct int_stack *stack;
+    struct compose_arcs level[2], *prev, *next;
+    struct fsm_state *machine_b, *bend, *bgroup;
+    struct fsm *net;
+    int i, j, k, width, current_state, current_final, target_number, isnew, mode, qb, ain, aout, bin, bout, akey, bkey, *tuple, *rec, *lrec, *lend, *lgroup, *dst;
+
+    /* An empty cascade is the identity relation, as fsm_concat_n(net, 0) is the empty string */
+    if (n <= 0)
+        return(fsm_universal());
+    if (n == 1)
+        return(nets[0]);
+    /* The tristate filter and flag-is-epsilon are only done pairwise */
+    if (n == 2 || g_compose_tristate || g_flag_is_epsilon) {
+        net = nets[0];
+        for (i = 1; i < n; i++)
+            net = fsm_compose(net, nets[i]);
+        return(net);
+    }
+
+    for (i = 0; i < n; i++) {
+        if (g_compose_minimize)
+            nets[i] = fsm_minimize(nets[i]);
+        else if (!fsm_compose_single_start(nets[i]))
+            nets[i] = fsm_determinize(nets[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (fsm_isempty(nets[i])) {
+            for (i = 0; i < n; i++)
+                fsm_destroy(nets[i]);
+            return(fsm_empty_set());
+        }
+    }
+
+    /* After the first pass nets[0] has every symbol, after the second every net */
+    for (i = 1; i < n; i++)
+        fsm_merge_sigma(nets[0], nets[i]);
+    for (i = 1; i < n-1; i++)
+        fsm_merge_sigma(nets[0], nets[i]);
+
+    fsm_update_flags(nets[0], YES, NO, UNK, YES, UNK, UNK);
+
+    points = malloc(sizeof(struct state_arr *) * n);
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            fsm_sort_arcs(nets[i], 1);
+        *(points+i) = init_state_pointers(nets[i]->states);
+    }
+
+    width = 2 * n - 1;
+    th = tuple_hash_init(width);
+    tuple = calloc(width, sizeof(int));
+    tuple_hash_find_insert(th, tuple, &isnew);
+    stack = int_stack_init();
+    int_stack_push(stack, 0);
+    for (i = 0; i < 2; i++) {
+        level[i].reclen = width + 2;
+        level[i].size = 64;
+        level[i].recs = malloc(sizeof(int) * level[i].reclen * level[i].size);
+    }
+
+    fsm_state_init(sigma_max(nets[0]->sigma));
+
+    while (!int_stack_isempty(stack)) {
+        current_state = int_stack_pop(stack);
+        memcpy(tuple, th->tuples + (size_t)current_state * width, sizeof(int) * width);
+
+        for (i = 0, current_final = 1; i < n; i++) {
+            if (!(*(points+i)+tuple[2*i])->final)
+                current_final = 0;
+        }
+        fsm_state_set_current_state(current_state, current_final, current_state == 0);
+
+        /* The arcs of machine 0 */
+        prev = &level[0];
+        prev->count = 0;
+        for (machine_b = (*points)[tuple[0]].transitions; machine_b->state_no == tuple[0]; machine_b++) {
+            if (machine_b->target < 0)
+                continue;
+            dst = compose_arcs_add(prev, machine_b->in, machine_b->out);
+            dst[0] = machine_b->target;
+        }
+
+        /* Join machines 0..i-1 with machine i; the tuples grow by mi qi */
+        for (i = 1; i < n; i++) {
+            next = prev == &level[0] ? &level[1] : &level[0];
+            next->count = 0;
+            mode = tuple[2*i-1];
+            qb = tuple[2*i];
+            qsort(prev->recs, prev->count, sizeof(int) * prev->reclen, compose_arcs_cmp);
+            lrec = prev->recs;
+            lend = prev->recs + (size_t)prev->count * prev->reclen;
+            machine_b = (*(points+i))[qb].transitions;
+            while (lrec != lend && machine_b->state_no == qb) {
+                if (machine_b->in < 0 || machine_b->target < 0) {
+                    machine_b++;
+                    continue;
+                }
+                akey = COMPOSE_JOIN_KEY(lrec[1]);
+                bkey = COMPOSE_JOIN_KEY(machine_b->in);
+                if (akey < bkey) {
+                    lrec += prev->reclen;
+                    continue;
+                }
+                if (akey > bkey) {
+                    machine_b++;
+                    continue;
+                }
+                for (lgroup = lrec; lgroup != lend && COMPOSE_JOIN_KEY(lgroup[1]) == akey; lgroup += prev->reclen) { }
+                for (bend = machine_b; bend->state_no == qb && COMPOSE_JOIN_KEY(bend->in) == bkey; bend++) { }
+                for (rec = lrec; rec != lgroup; rec += prev->reclen) {
+                    for (bgroup = machine_b; bgroup != bend; bgroup++) {
+                        ain = rec[0];
+                        aout = rec[1];
+                        bin = bgroup->in;
+                        bout = bgroup->out;
+                        if (aout == IDENTITY && bin == UNKNOWN) {
+                            ain = aout = UNKNOWN;
+                        }
+                        else if (aout == UNKNOWN && bin == IDENTITY) {
+                            bin = bout = UNKNOWN;
+                        }
+                        if (bin == aout && bin != -1 && (bin != EPSILON || mode == 0)) {
+                            /* mode -> 0 */
+                            dst = compose_arcs_add(next, ain, bout);
+                            memcpy(dst, rec+2, sizeof(int) * (2*i-1));
+                            dst[2*i-1] = 0;
+                            dst[2*i] = bgroup->target;
+                        }
+                    }
+                }
+                lrec = lgroup;
+                machine_b = bend;
+            }
+            /* A:0 arcs of machines 0..i-1 (these sorted first) */
+            if (mode == 0) {
+                for (rec = prev->recs; rec != lend && rec[1] == EPSILON; rec += prev->reclen) {
+                    dst = compose_arcs_add(next, rec[0], EPSILON);
+                    memcpy(dst, rec+2, sizeof(int) * (2*i-1));
+                    dst[2*i-1] = 0;
+                    dst[2*i] = qb;
+                }
+            }
+            /* 0:B arcs of machine i, the others stay put */
+            for (machine_b = (*(points+i))[qb].transitions; machine_b->state_no == qb && machine_b->in <= EPSILON; machine_b++) {
+                if (machine_b->in != EPSILON || machine_b->target < 0)
+                    continue;
+                /* mode -> 1 */
+                dst = compose_arcs_add(next, EPSILON, machine_b->out);
+                memcpy(dst, tuple, sizeof(int) * (2*i-1));
+                dst[2*i-1] = 1;
+                dst[2*i] = machine_b->target;
+            }
+            prev = next;
+        }
+
+        for (j = 0, rec = prev->recs; j < prev->count; j++, rec += prev->reclen) {
+            target_number = tuple_hash_find_insert(th, rec+2, &isnew);
+            if (isnew)
+                int_stack_push(stack, target_number);
+            fsm_state_add_arc(current_state, rec[0], rec[1], target_number, current_final, current_state == 0);
+        }
+        fsm_state_end_state();
+    }
+
+    net = nets[0];
+    free(net->states);
+    fsm_state_close(net);
+    for (k = 1; k < n; k++)
+        fsm_destroy(nets[k]);
+    for (k = 0; k < n; k++)
+        free(*(points+k));
+    free(points);
+    free(level[0].recs);
+    free(level[1].recs);
+    free(tuple);
+    tuple_hash_free(th);
+    int_stack_free(stack);
+    net = fsm_topsort(fsm_coaccessible(net));
+    net = fsm_coaccessible(net);
+    if (g_compose_minimize)
+        net = fsm_minimize(net);
+    return(net);
+}
+
 struct mergesigma *add_to_mergesigma(struct mergesigma *msigma, struct sigma *sigma, short presence) {
   int number = 0;
 
@@ -860,6 +1168,7 @@ struct mergesigma *add_to_mergesigma(struct mergesigma *msigma, struct sigma *si
     msigma->number = number+1;
   }
   msigma->symbol = sigma->symbol;
+  msigma->id = sigma->id;
   msigma->presence = presence;
   return(msigma);
 }
@@ -878,6 +1187,7 @@ struct sigma *copy_mergesigma(struct mergesigma *mergesigma) {
 	}
 	sigma->next = NULL;
 	sigma->number = mergesigma->number;
+	sigma->id = mergesigma->id;
 
 	sigma->symbol = NULL;
 	if (mergesigma->symbol != NULL)
@@ -892,7 +1202,7 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
   struct sigma *sigma_1, *sigma_2, *new_sigma_1 = NULL, *new_sigma_2 = NULL;
   struct mergesigma *mergesigma, *mergesigma2, *start_mergesigma;
   struct fsm_state *fsm_state, *new_1_state, *new_2_state;
-  int i, j, end_1 = 0, end_2 = 0, sigmasizes, *mapping_1, *mapping_2, equal = 1, unknown_1 = 0, unknown_2 = 0, net_unk = 0, net_adds = 0, net_lines;
+  int i, j, end_1 = 0, end_2 = 0, sigmasizes, *mapping_1, *mapping_2, equal = 1, unknown_1 = 0, unknown_2 = 0, net_unk = 0, net_adds = 0, net_lines, cmp, remap_1 = 0, remap_2 = 0;
 
   if (!fsm_options.skip_word_boundary_marker) {
     i = sigma_find(".#.", net1->sigma);
@@ -907,6 +1217,17 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
     }
   }
 
+  /* Nothing to do if the sigmas already agree symbol for symbol and are */
+  /* numbered consecutively: the merge would renumber every arc to itself */
+  for (i = 3, sigma_1 = net1->sigma, sigma_2 = net2->sigma; sigma_1 != NULL && sigma_2 != NULL; sigma_1 = sigma_1->next, sigma_2 = sigma_2->next) {
+      if (sigma_1->number != sigma_2->number || sigma_symbol_id(sigma_1) != sigma_symbol_id(sigma_2))
+          break;
+      if (sigma_1->number > IDENTITY && sigma_1->number != i++)
+          break;
+  }
+  if (sigma_1 == NULL && sigma_2 == NULL)
+      return;
+
   sigma_1 = net1->sigma;
   sigma_2 = net2->sigma;
 
@@ -919,6 +1240,7 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
 
   mergesigma = malloc(sizeof(struct mergesigma));
   mergesigma->number = -1;
+  mergesigma->id = -1;
   mergesigma->symbol = NULL;
   mergesigma->next = NULL;
   start_mergesigma = mergesigma;
@@ -935,6 +1257,7 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
       /* Treating only 1 now */
       mergesigma = add_to_mergesigma(mergesigma, sigma_1, 1);
       *(mapping_1+(sigma_1->number)) = mergesigma->number;
+      remap_1 |= sigma_1->number != mergesigma->number;
       sigma_1 = sigma_1->next;
       equal = 0;
       continue;
@@ -943,6 +1266,7 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
       /* Treating only 2 now */
       mergesigma = add_to_mergesigma(mergesigma, sigma_2, 2);
       *(mapping_2+(sigma_2->number)) = mergesigma->number;
+      remap_2 |= sigma_2->number != mergesigma->number;
       sigma_2 = sigma_2->next;
       equal = 0;
       continue;
@@ -980,24 +1304,30 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
 	continue;
       }
       /* Both contain non-special chars */
-      if (strcmp(sigma_1->symbol, sigma_2->symbol) == 0) {
+      /* Equal interned ids are equal symbols; only unequal ones need strcmp() for the order */
+      cmp = sigma_symbol_id(sigma_1) == sigma_symbol_id(sigma_2) ? 0 : strcmp(sigma_1->symbol, sigma_2->symbol);
+      if (cmp == 0) {
         mergesigma = add_to_mergesigma(mergesigma, sigma_1, 3);
 	/* Add symbol numbers to mapping */
 	*(mapping_1+(sigma_1->number)) = mergesigma->number;
 	*(mapping_2+(sigma_2->number)) = mergesigma->number;
+	remap_1 |= sigma_1->number != mergesigma->number;
+	remap_2 |= sigma_2->number != mergesigma->number;
 
 	sigma_1 = sigma_1->next;
 	sigma_2 = sigma_2->next;
       }
-      else if (strcmp(sigma_1->symbol, sigma_2->symbol) < 0) {
+      else if (cmp < 0) {
 	mergesigma = add_to_mergesigma(mergesigma, sigma_1, 1);
 	*(mapping_1+(sigma_1->number)) = mergesigma->number;
+	remap_1 |= sigma_1->number != mergesigma->number;
 	sigma_1 = sigma_1->next;
 	equal = 0;
       }
       else {
 	mergesigma = add_to_mergesigma(mergesigma, sigma_2, 2);
 	*(mapping_2+(sigma_2->number)) = mergesigma->number;
+	remap_2 |= sigma_2->number != mergesigma->number;
 	sigma_2 = sigma_2->next;
 	equal = 0;
       }
@@ -1006,16 +1336,17 @@ void fsm_merge_sigma(struct fsm *net1, struct fsm *net2) {
   }
 
   /* Go over both net1 and net2 and replace arc numbers with new mappings */
+  /* unless the mapping leaves every symbol number of the net unchanged   */
 
   fsm_state = net1->states;
-  for (i=0; (fsm_state+i)->state_no != -1; i++) {
+  for (i=0; remap_1 && (fsm_state+i)->state_no != -1; i++) {
     if ((fsm_state+i)->in > 2)
       (fsm_state+i)->in = *(mapping_1+(fsm_state+i)->in);
     if ((fsm_state+i)->out > 2)
       (fsm_state+i)->out = *(mapping_1+(fsm_state+i)->out);
   }
   fsm_state = net2->states;
-  for (i=0; (fsm_state+i)->state_no != -1; i++) {
+  for (i=0; remap_2 && (fsm_state+i)->state_no != -1; i++) {
     if ((fsm_state+i)->in > 2)
       (fsm_state+i)->in = *(mapping_2+(fsm_state+i)->in);
     if ((fsm_state+i)->out > 2)
@@ -1757,6 +2088,7 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
   struct fsm_state *machine_a, *machine_b, *fsm;
   struct state_arr *point_a, *point_b;
   struct triplethash *th;
+  struct int_stack *stack;
 
   /* Perform a cross product by running two machines in parallel */
   /* The approach here allows a state to stay, creating a a:0 or 0:b transition */
@@ -1790,7 +2122,8 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
 
   /* new state 0 = {0,0} */
 
-  STACK_2_PUSH(0,0);
+  stack = int_stack_init();
+  STACK_2_PUSH(stack, 0,0);
 
   th = triplet_hash_init();
   triplet_hash_insert(th, 0, 0, 0);
@@ -1800,12 +2133,12 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
   point_a = init_state_pointers(machine_a);
   point_b = init_state_pointers(machine_b);
 
-  while (!int_stack_isempty()) {
+  while (!int_stack_isempty(stack)) {
 
    /* Get a pair of states to examine */
 
-    a = int_stack_pop();
-    b = int_stack_pop();
+    a = int_stack_pop(stack);
+    b = int_stack_pop(stack);
 
    /* printf("Treating pair: {%i,%i}\n",a,b); */
 
@@ -1830,7 +2163,7 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
 	/* Main check */
 	if (!((machine_a->target == -1) || (machine_b->target == -1))) {
 	    if ((target_number = triplet_hash_find(th, machine_a->target, machine_b->target, 0)) == -1) {
-              STACK_2_PUSH(machine_b->target, machine_a->target);
+              STACK_2_PUSH(stack, machine_b->target, machine_a->target);
               target_number = triplet_hash_insert(th, machine_a->target, machine_b->target, 0);
 	  }
 	  symbol1 = machine_a->in;
@@ -1850,7 +2183,7 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
 
 	  /* Add 0:b i.e. stay in state A */
 	    if ((target_number = triplet_hash_find(th, machine_a->state_no, machine_b->target, 0)) == -1) {
-		STACK_2_PUSH(machine_b->target, machine_a->state_no);
+		STACK_2_PUSH(stack, machine_b->target, machine_a->state_no);
 		target_number = triplet_hash_insert(th, machine_a->state_no, machine_b->target, 0);
 	    }
 	  /* @:0 becomes ?:0 */
@@ -1862,7 +2195,7 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
 
 	  /* Add a:0 i.e. stay in state B */
 	    if ((target_number = triplet_hash_find(th, machine_a->target, machine_b->state_no, 0)) == -1) {
-              STACK_2_PUSH(machine_b->state_no, machine_a->target);
+              STACK_2_PUSH(stack, machine_b->state_no, machine_a->target);
               target_number = triplet_hash_insert(th, machine_a->target, machine_b->state_no, 0);
 	  }
 	  /* @:0 becomes ?:0 */
@@ -1898,6 +2231,7 @@ struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2) {
   free(point_b);
   fsm_destroy(net2);
   triplet_hash_free(th);
+  int_stack_free(stack);
   return(fsm_coaccessible(net1));
 }
 
@@ -1914,6 +2248,7 @@ struct fsm *fsm_unflatten(struct fsm *net, char *epsilon_sym, char *repeat_sym)
     struct fsm_state *even_state, *odd_state;
     struct state_arr *point_a;
     struct triplethash *th;
+    struct int_stack *stack;
 
     fsm_minimize(net);
     fsm_count(net);
@@ -1925,7 +2260,8 @@ struct fsm *fsm_unflatten(struct fsm *net, char *epsilon_sym, char *repeat_sym)
 
     /* new state 0 = {0,0} */
 
-    STACK_2_PUSH(0,0);
+    stack = int_stack_init();
+    STACK_2_PUSH(stack, 0,0);
 
     th = triplet_hash_init();
     triplet_hash_insert(th, 0, 0, 0);
@@ -1934,12 +2270,12 @@ struct fsm *fsm_unflatten(struct fsm *net, char *epsilon_sym, char *repeat_sym)
 
     point_a = init_state_pointers(even_state);
 
-    while (!int_stack_isempty()) {
+    while (!int_stack_isempty(stack)) {
 
 	/* Get a pair of states to examine */
 
-	a = int_stack_pop();
-	a = int_stack_pop();
+	a = int_stack_pop(stack);
+	a = int_stack_pop(stack);
 
 	/* printf("Treating pair: {%i,%i}\n",a,b); */
 
@@ -1960,7 +2296,7 @@ struct fsm *fsm_unflatten(struct fsm *net, char *epsilon_sym, char *repeat_sym)
 		    continue;
 		}
 		if ((target_number = triplet_hash_find(th, odd_state->target, odd_state->target, 0)) == -1) {
-		    STACK_2_PUSH(odd_state->target, odd_state->target);
+		    STACK_2_PUSH(stack, odd_state->target, odd_state->target);
 		    target_number = triplet_hash_insert(th, odd_state->target, odd_state->target, 0);
 		}
 		in = even_state->in;
@@ -1986,6 +2322,7 @@ struct fsm *fsm_unflatten(struct fsm *net, char *epsilon_sym, char *repeat_sym)
     fsm_state_close(net);
     free(point_a);
     triplet_hash_free(th);
+    int_stack_free(stack);
     return(net);
 }
 
@@ -1995,6 +2332,7 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
   struct fsm_state *machine_a, *machine_b;
   struct state_arr *point_a, *point_b;
   struct triplethash *th;
+  struct int_stack *stack;
 
   /* Shuffle A and B by making alternatively A move and B stay at each or */
   /* vice versa at each step */
@@ -2012,7 +2350,8 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
 
   /* new state 0 = {0,0} */
 
-  STACK_2_PUSH(0,0);
+  stack = int_stack_init();
+  STACK_2_PUSH(stack, 0,0);
 
   th = triplet_hash_init();
   triplet_hash_insert(th, 0, 0, 0);
@@ -2022,12 +2361,12 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
   point_a = init_state_pointers(machine_a);
   point_b = init_state_pointers(machine_b);
 
-  while (!int_stack_isempty()) {
+  while (!int_stack_isempty(stack)) {
 
    /* Get a pair of states to examine */
 
-    a = int_stack_pop();
-    b = int_stack_pop();
+    a = int_stack_pop(stack);
+    b = int_stack_pop(stack);
 
    /* printf("Treating pair: {%i,%i}\n",a,b); */
 
@@ -2043,7 +2382,7 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
 	  continue;
 	}
 	if ((target_number = triplet_hash_find(th, machine_a->target, b, 0)) == -1) {
-          STACK_2_PUSH(b, machine_a->target);
+          STACK_2_PUSH(stack, b, machine_a->target);
 	  target_number = triplet_hash_insert(th, machine_a->target, b, 0);
 	}
 
@@ -2058,7 +2397,7 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
 	}
 
 	if ((target_number = triplet_hash_find(th, a, machine_b->target, 0)) == -1) {
-              STACK_2_PUSH(machine_b->target, a);
+              STACK_2_PUSH(stack, machine_b->target, a);
               target_number = triplet_hash_insert(th, a, machine_b->target, 0);
 	  }
           fsm_state_add_arc(current_state, machine_b->in, machine_b->out, target_number, current_final, current_start);
@@ -2074,6 +2413,7 @@ struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2) {
   free(point_b);
   fsm_destroy(net2);
   triplet_hash_free(th);
+  int_stack_free(stack);
   return(net1);
 }
 
@@ -2083,6 +2423,7 @@ int fsm_equivalent(struct fsm *net1, struct fsm *net2) {
     struct fsm_state *machine_a, *machine_b;
     struct state_arr *point_a, *point_b;
     struct triplethash *th;
+    struct int_stack *stack;
 
     fsm_merge_sigma(net1, net2);
 
@@ -2094,7 +2435,8 @@ int fsm_equivalent(struct fsm *net1, struct fsm *net2) {
 
     equivalent = 0;
     /* new state 0 = {0,0} */
-    STACK_2_PUSH(0,0);
+    stack = int_stack_init();
+    STACK_2_PUSH(stack, 0,0);
 
     th = triplet_hash_init();
     triplet_hash_insert(th, 0, 0, 0);
@@ -2102,12 +2444,12 @@ int fsm_equivalent(struct fsm *net1, struct fsm *net2) {
     point_a = init_state_pointers(machine_a);
     point_b = init_state_pointers(machine_b);
 
-    while (!int_stack_isempty()) {
+    while (!int_stack_isempty(stack)) {
 
 	/* Get a pair of states to examine */
 
-	a = int_stack_pop();
-	b = int_stack_pop();
+	a = int_stack_pop(stack);
+	b = int_stack_pop(stack);
 
 	if ((point_a+a)->final != (point_b+b)->final) {
 	    goto not_equivalent;
@@ -2125,7 +2467,7 @@ int fsm_equivalent(struct fsm *net1, struct fsm *net2) {
 		if (machine_a->in == machine_b->in && machine_a->out == machine_b->out) {
 		    matching_arc = 1;
 		    if ((triplet_hash_find(th, machine_a->target, machine_b->target, 0)) == -1) {
-			STACK_2_PUSH(machine_b->target, machine_a->target);
+			STACK_2_PUSH(stack, machine_b->target, machine_a->target);
 			triplet_hash_insert(th, machine_a->target, machine_b->target, 0);
 		    }
 		    break;
@@ -2158,6 +2500,7 @@ int fsm_equivalent(struct fsm *net1, struct fsm *net2) {
     free(point_a);
     free(point_b);
     triplet_hash_free(th);
+    int_stack_free(stack);
     return(equivalent);
 }
 
@@ -2167,6 +2510,7 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
     struct fsm_state *machine_a, *machine_b;
     struct state_arr *point_a, *point_b;
     struct triplethash *th;
+    struct int_stack *stack;
     statecount = 0;
 
     net1 = fsm_minimize(net1);
@@ -2182,8 +2526,8 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
 
     /* new state 0 = {1,1} */
 
-    int_stack_clear();
-    STACK_2_PUSH(1,1);
+    stack = int_stack_init();
+    STACK_2_PUSH(stack, 1,1);
 
     th = triplet_hash_init();
     triplet_hash_insert(th, 1, 1, 0);
@@ -2193,12 +2537,12 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
 
     fsm_state_init(sigma_max(net1->sigma));
 
-  while (!int_stack_isempty()) {
+  while (!int_stack_isempty(stack)) {
       statecount++;
       /* Get a pair of states to examine */
 
-      a = int_stack_pop();
-      b = int_stack_pop();
+      a = int_stack_pop(stack);
+      b = int_stack_pop(stack);
 
       current_state = triplet_hash_find(th, a, b, 0);
       a--;
@@ -2222,7 +2566,7 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
           if (b == -1) {
               /* b is dead */
               if ((target_number = triplet_hash_find(th, (machine_a->target)+1, 0, 0)) == -1) {
-                  STACK_2_PUSH(0, (machine_a->target)+1);
+                  STACK_2_PUSH(stack, 0, (machine_a->target)+1);
                   target_number = triplet_hash_insert(th, (machine_a->target)+1, 0, 0);
               }
           } else {
@@ -2237,13 +2581,13 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
               }
               if (b_has_trans) {
                   if ((target_number = triplet_hash_find(th, (machine_a->target)+1, btarget+1, 0)) == -1) {
-                      STACK_2_PUSH(btarget+1, (machine_a->target)+1);
+                      STACK_2_PUSH(stack, btarget+1, (machine_a->target)+1);
 		      target_number = triplet_hash_insert(th, (machine_a->target)+1, (machine_b->target)+1, 0);
                   }
               } else {
                   /* b is dead */
                   if ((target_number = triplet_hash_find(th, (machine_a->target)+1, 0, 0)) == -1) {
-                      STACK_2_PUSH(0, (machine_a->target)+1);
+                      STACK_2_PUSH(stack, 0, (machine_a->target)+1);
 		      target_number = triplet_hash_insert(th, (machine_a->target)+1, 0, 0);
                   }
               }
@@ -2259,6 +2603,7 @@ struct fsm *fsm_minus(struct fsm *net1, struct fsm *net2) {
   free(point_b);
   fsm_destroy(net2);
   triplet_hash_free(th);
+  int_stack_free(stack);
   return(fsm_minimize(net1));
 }
 
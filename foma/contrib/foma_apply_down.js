@@ -3,6 +3,8 @@
 // on input-side epsilon-loops.
 // Use the foma2js.perl script to convert foma binaries to a Javascript array which
 // is needed as the first argument of foma_apply_down.
+// The foma-lookup target of the wasm build (see lookup.js) runs the real
+// apply code on binary nets instead.
 
 function foma_apply_down(Net, inString) {
     Rep = new Object;
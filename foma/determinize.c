@@ -27,36 +27,45 @@
 #define SUBSET_DETERMINIZE 2
 #define SUBSET_TEST_STAR_FREE 3
 
-#define NHASH_LOAD_LIMIT 2 /* load limit for nhash table size */
+#define NHASH_LOAD_LIMIT 2 /* the hash table is kept at least NHASH_LOAD_LIMIT times the number of sets */
 
 static int fsm_linecount, num_states, num_symbols, epsilon_symbol, *single_sigma_array, *double_sigma_array, limit, num_start_states, op;
 
 static _Bool *finals, deterministic, numss;
 
+/* Epsilon closures are computed once, on the condensation of the   */
+/* epsilon graph: the states of an epsilon cycle share one closure,  */
+/* stored as a sorted array.  If all the closures together would be  */
+/* larger than CLOSURE_LIMIT ints, only the condensation is kept and  */
+/* e_closure() walks it.                                              */
+
+#define CLOSURE_LIMIT(states) ((size_t)(states) * 16 + 1048576)
+
 struct e_closure_memo {
-    int state;
-    int mark;
-    struct e_closure_memo *target;
-    struct e_closure_memo *next;
+    int count;        /* number of SCCs */
+    int *scc;         /* SCC of each state */
+    int *member_off;  /* states of each SCC */
+    int *members;
+    int *succ_off;    /* SCCs one epsilon arc away */
+    int *succ;
+    int *closure_off; /* closure of each SCC, NULL if over the limit */
+    int *closures;
 };
 
-static unsigned int primes[26] = {61,127,251,509,1021,2039,4093,8191,16381,32749,65521,131071,262139,524287,1048573,2097143,4194301,8388593,16777213,33554393,67108859,134217689,268435399,536870909,1073741789,2147483647};
-
 static struct e_closure_memo *e_closure_memo;
 
 int T_last_unmarked, T_limit;
 
-struct nhash_list {
-    int setnum;
-    unsigned int size;
-    unsigned int set_offset;
-    struct nhash_list *next;
-};
+/* The sets are stored one after the other in set_table, each state */
+/* number as the varint of its (zigzag-coded) difference to the one  */
+/* before.  The order of the states in a set is kept, as the         */
+/* numbering of the states in epsilon removal depends on it.         */
 
 struct T_memo {
     unsigned char finalstart;
     unsigned int size;
-    unsigned int set_offset;
+    size_t set_offset;
+    uint64_t hash;
 };
 
 struct trans_list {
@@ -72,9 +81,15 @@ struct trans_array {
 
 static struct T_memo *T_ptr;
 
-static int nhash_tablesize, nhash_load, current_setnum, *e_table, *marktable, *temp_move, mainloop, maxsigma, *set_table, set_table_size, star_free_mark;
-static unsigned int set_table_offset;
-static struct nhash_list *table;
+static int nhash_tablesize, nhash_load, current_setnum, *e_table, *marktable, *temp_move, *current_set, mainloop, maxsigma, star_free_mark;
+static unsigned char *set_table;
+static size_t set_table_size, set_table_offset;
+/* Open addressing table of set numbers, -1 = empty */
+static int *table;
+
+/* Unmarked sets, and the work stack of e_closure() */
+static struct int_stack *agenda;
+static struct int_stack *closure_stack;
 
 extern int add_fsm_arc(struct fsm_state *fsm, int offset, int state_no, int in, int out, int target, int final_state, int start_state);
 
@@ -88,11 +103,12 @@ static void single_symbol_to_symbol_pair(int symbol, int *symbol_in, int *symbol
 static int symbol_pair_to_single_symbol(int in, int out);
 static void sigma_to_pairs(struct fsm *net);
 static int nhash_find_insert(int *set, int setsize);
-INLINE static int hashf(int *set, int setsize);
-static int nhash_insert(int hashval, int *set, int setsize);
+INLINE static uint64_t hashf(int *set, int setsize);
+static int nhash_insert(uint64_t hashval, int *set, int setsize);
 static void nhash_rebuild_table ();
 static void nhash_init (int initial_size);
-static void nhash_free(struct nhash_list *nptr, int size);
+static void nhash_free();
+static void decode_set(size_t offset, int setsize, int *set);
 static void e_closure_free();
 static void init_trans_array(struct fsm *net);
 static struct fsm *fsm_subset(struct fsm *net, int operation);
@@ -119,15 +135,17 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
     deterministic = 1;
     init(net);
     nhash_init((num_states < 12) ? 6 : num_states/2);
+    agenda = int_stack_init();
+    closure_stack = int_stack_init();
 
     T = initial_e_closure(net);
 
-    int_stack_clear();
+    int_stack_clear(agenda);
 
     if (deterministic == 1 && epsilon_symbol == -1 && num_start_states == 1 && numss == 0) {
         net->is_deterministic = YES;
         net->is_epsilon_free = YES;
-        nhash_free(table, nhash_tablesize);
+        nhash_free();
         free(T_ptr);
         free(e_table);
         free(trans_list_determinize);
@@ -136,13 +154,16 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         free(single_sigma_array);
         free(finals);
         free(temp_move);
+        free(current_set);
         free(set_table);
+        int_stack_free(agenda);
+        int_stack_free(closure_stack);
         return(net);
     }
 
     if (operation == SUBSET_EPSILON_REMOVE && epsilon_symbol == -1) {
         net->is_epsilon_free = YES;
-        nhash_free(table, nhash_tablesize);
+        nhash_free();
         free(T_ptr);
         free(e_table);
         free(trans_list_determinize);
@@ -151,7 +172,10 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         free(single_sigma_array);
         free(finals);
         free(temp_move);
+        free(current_set);
         free(set_table);
+        int_stack_free(agenda);
+        int_stack_free(closure_stack);
         return(net);
     }
 
@@ -174,7 +198,8 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
 
         /* Prepare set */
         setsize = (T_ptr+T)->size;
-        theset = set_table+(T_ptr+T)->set_offset;
+        theset = current_set;
+        decode_set((T_ptr+T)->set_offset, setsize, theset);
         minsym = INT_MAX;
         has_trans = 0;
         for (i = 0; i < setsize; i++) {
@@ -197,7 +222,6 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         /* While set not empty */
 
         for (next_minsym = INT_MAX; minsym != INT_MAX ; minsym = next_minsym, next_minsym = INT_MAX) {
-            theset = set_table+(T_ptr+T)->set_offset;
 
             for (i = 0, j = 0 ; i < setsize; i++) {
 
@@ -259,13 +283,16 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
     } while ((T = next_unmarked()) != -1);
 
     /* wrapup() */
-    nhash_free(table, nhash_tablesize);
+    nhash_free();
     free(set_table);
     free(T_ptr);
     free(temp_move);
+    free(current_set);
     free(e_table);
     free(trans_list_determinize);
     free(trans_array_determinize);
+    int_stack_free(agenda);
+    int_stack_free(closure_stack);
 
     if (epsilon_symbol != -1)
         e_closure_free();
@@ -291,6 +318,8 @@ static void init(struct fsm *net) {
 
     /* Table for listing current results of move & e-closure */
     temp_move = malloc((net->statecount + 1) *sizeof(int));
+    /* The set being expanded, decoded */
+    current_set = malloc((net->statecount + 1) *sizeof(int));
 
     /* We malloc this much memory to begin with for the new fsm */
     /* Then grow it by the double as needed */
@@ -314,8 +343,8 @@ static void init(struct fsm *net) {
     /* T_ptr->set_offset and size                 */
     /* are used to retrieve the set               */
 
-    set_table_size = next_power_of_two(num_states);
-    set_table = malloc(set_table_size*sizeof(int));
+    set_table_size = next_power_of_two(num_states) * 2;
+    set_table = malloc(set_table_size);
     set_table_offset = 0;
 
     init_trans_array(net);
@@ -381,8 +410,8 @@ static void init_trans_array(struct fsm *net) {
 
 INLINE static int e_closure(int states) {
 
-    int i, set_size;
-    struct e_closure_memo *ptr;
+    int i, j, c, d, state, set_size, *closure, closure_size;
+    struct e_closure_memo *m;
 
     /* e_closure extends the list of states which are reachable */
     /* and appends these to e_table                             */
@@ -396,39 +425,43 @@ INLINE static int e_closure(int states) {
     mainloop--;
 
     set_size = states;
+    m = e_closure_memo;
 
     for (i = 0; i < states; i++) {
-
-        /* State number we want to do e-closure on */
-        ptr = e_closure_memo + *(temp_move+i);
-        if (ptr->target == NULL)
+        c = *(m->scc+*(temp_move+i));
+        /* Marktable marks the SCCs already added */
+        if (*(marktable+c) == mainloop)
             continue;
-        ptr_stack_push(ptr);
-
-        while (!(ptr_stack_isempty())) {
-            ptr = ptr_stack_pop();
-            /* Don't follow if already seen */
-            if (*(marktable+ptr->state) == mainloop)
-                continue;
-
-            ptr->mark = mainloop;
-            *(marktable+ptr->state) = mainloop;
-            /* Add to tail of list */
-            if (*(e_table+(ptr->state)) != mainloop) {
-                *(temp_move+set_size) = ptr->state;
-                *(e_table+(ptr->state)) = mainloop;
-                set_size++;
+        *(marktable+c) = mainloop;
+        if (m->closure_off != NULL) {
+            closure = m->closures + *(m->closure_off+c);
+            closure_size = *(m->closure_off+c+1) - *(m->closure_off+c);
+            for (j = 0; j < closure_size; j++) {
+                state = *(closure+j);
+                if (*(e_table+state) != mainloop) {
+                    *(temp_move+set_size) = state;
+                    *(e_table+state) = mainloop;
+                    set_size++;
+                }
             }
-
-            if (ptr->target == NULL)
-                continue;
-            /* Traverse chain */
-
-            for (; ptr != NULL ; ptr = ptr->next) {
-                if (ptr->target->mark != mainloop) {
-                    /* Push */
-                    ptr->target->mark = mainloop;
-                    ptr_stack_push(ptr->target);
+            continue;
+        }
+        int_stack_push(closure_stack, c);
+        while (!int_stack_isempty(closure_stack)) {
+            c = int_stack_pop(closure_stack);
+            for (j = *(m->member_off+c); j < *(m->member_off+c+1); j++) {
+                state = *(m->members+j);
+                if (*(e_table+state) != mainloop) {
+                    *(temp_move+set_size) = state;
+                    *(e_table+state) = mainloop;
+                    set_size++;
+                }
+            }
+            for (j = *(m->succ_off+c); j < *(m->succ_off+c+1); j++) {
+                d = *(m->succ+j);
+                if (*(marktable+d) != mainloop) {
+                    *(marktable+d) = mainloop;
+                    int_stack_push(closure_stack, d);
                 }
             }
         }
@@ -447,7 +480,7 @@ INLINE static int set_lookup (int *lookup_table, int size) {
 
 }
 
-void add_T_ptr(int setnum, int setsize, unsigned int theset, int fs) {
+void add_T_ptr(int setnum, int setsize, size_t theset, uint64_t hash, int fs) {
 
   int i;
   if (setnum >= T_limit) {
@@ -460,8 +493,9 @@ void add_T_ptr(int setnum, int setsize, unsigned int theset, int fs) {
 
   (T_ptr + setnum)->size = setsize;
   (T_ptr + setnum)->set_offset = theset;
+  (T_ptr + setnum)->hash = hash;
   (T_ptr + setnum)->finalstart = fs;
-  int_stack_push(setnum);
+  int_stack_push(agenda, setnum);
 
 }
 
@@ -499,67 +533,204 @@ static int initial_e_closure(struct fsm *net) {
     return(e_closure(j));
 }
 
-static void memoize_e_closure(struct fsm_state *fsm) {
+static int int_cmp(const void *a, const void *b) {
+    return(*(const int *)a - *(const int *)b);
+}
 
-    int i, state, laststate, *redcheck;
-    struct e_closure_memo *ptr;
+/* Adds the SCC made of the states above sccstack_top to the condensation, */
+/* together with its successors and, while under the limit, its closure    */
 
-    e_closure_memo = calloc(num_states,sizeof(struct e_closure_memo));
-    marktable = calloc(num_states,sizeof(int));
-    /* Table for avoiding redundant epsilon arcs in closure */
-    redcheck = malloc(num_states*sizeof(int));
+static void e_closure_add_scc(int *sccstack, int sccstack_top, int sccstack_bottom, int *eps_off, int *eps_tgt, int *stamp, size_t *succ_size, size_t *closures_size) {
+    struct e_closure_memo *m;
+    int c, d, i, j, k, state, first, total;
 
-    for (i=0; i < num_states; i++) {
-        ptr = e_closure_memo+i;
-        ptr->state = i;
-        ptr->target = NULL;
-        *(redcheck+i) = -1;
+    m = e_closure_memo;
+    c = m->count++;
+    first = *(m->member_off+c);
+    for (i = sccstack_bottom, k = first; i < sccstack_top; i++, k++) {
+        *(m->scc+*(sccstack+i)) = c;
+        *(m->members+k) = *(sccstack+i);
+    }
+    *(m->member_off+c+1) = k;
+
+    /* Successor SCCs, all of which have been added before */
+    *(stamp+c) = c;
+    for (i = first; i < k; i++) {
+        state = *(m->members+i);
+        for (j = *(eps_off+state); j < *(eps_off+state+1); j++) {
+            d = *(m->scc+*(eps_tgt+j));
+            if (*(stamp+d) == c)
+                continue;
+            *(stamp+d) = c;
+            if (*(m->succ_off+c+1) == (int)*succ_size) {
+                *succ_size *= 2;
+                m->succ = realloc(m->succ, *succ_size * sizeof(int));
+            }
+            *(m->succ+*(m->succ_off+c+1)) = d;
+            (*(m->succ_off+c+1))++;
+        }
+    }
+    *(m->succ_off+c+2) = *(m->succ_off+c+1);
+
+    if (m->closure_off == NULL)
+        return;
+    total = k - first;
+    for (i = *(m->succ_off+c); i < *(m->succ_off+c+1); i++) {
+        d = *(m->succ+i);
+        total += *(m->closure_off+d+1) - *(m->closure_off+d);
+    }
+    if ((size_t)*(m->closure_off+c) + total > CLOSURE_LIMIT(num_states)) {
+        free(m->closure_off);
+        free(m->closures);
+        m->closure_off = NULL;
+        m->closures = NULL;
+        return;
+    }
+    if ((size_t)*(m->closure_off+c) + total > *closures_size) {
+        while ((size_t)*(m->closure_off+c) + total > *closures_size)
+            *closures_size *= 2;
+        m->closures = realloc(m->closures, *closures_size * sizeof(int));
     }
+    /* The union of the successors' closures, each state once */
+    k = *(m->closure_off+c);
+    for (i = first; i < *(m->member_off+c+1); i++) {
+        state = *(m->members+i);
+        *(marktable+state) = -c-1;
+        *(m->closures+k++) = state;
+    }
+    for (i = *(m->succ_off+c); i < *(m->succ_off+c+1); i++) {
+        d = *(m->succ+i);
+        for (j = *(m->closure_off+d); j < *(m->closure_off+d+1); j++) {
+            state = *(m->closures+j);
+            if (*(marktable+state) != -c-1) {
+                *(marktable+state) = -c-1;
+                *(m->closures+k++) = state;
+            }
+        }
+    }
+    qsort(m->closures+*(m->closure_off+c), k - *(m->closure_off+c), sizeof(int), int_cmp);
+    *(m->closure_off+c+1) = k;
+}
 
-    laststate = -1;
+static void memoize_e_closure(struct fsm_state *fsm) {
 
-    for (i=0; ;i++) {
+    int i, j, v, w, e, numeps, *eps_off, *fill, *eps_tgt, *redcheck, *dfsindex, *low, *sccstack, sccstack_top, *callstack, *calledge, calltop, dfscount, *stamp;
+    size_t succ_size, closures_size;
+    struct e_closure_memo *m;
 
-        state = (fsm+i)->state_no;
+    /* The epsilon graph, without self-loops and repeated arcs */
+    eps_off = calloc(num_states+1, sizeof(int));
+    redcheck = malloc(num_states*sizeof(int));
+    for (i = 0; i < num_states; i++)
+        *(redcheck+i) = -1;
+    for (i = 0, numeps = 0; (fsm+i)->state_no != -1; i++) {
+        if ((fsm+i)->target == -1 || (fsm+i)->in != EPSILON || (fsm+i)->out != EPSILON || (fsm+i)->target == (fsm+i)->state_no)
+            continue;
+        if (*(redcheck+(fsm+i)->target) == (fsm+i)->state_no)
+            continue;
+        *(redcheck+(fsm+i)->target) = (fsm+i)->state_no;
+        (*(eps_off+(fsm+i)->state_no+1))++;
+        numeps++;
+    }
+    if (numeps > 0)
+        deterministic = 0;
+    fill = malloc(num_states*sizeof(int));
+    for (i = 0; i < num_states; i++) {
+        *(eps_off+i+1) += *(eps_off+i);
+        *(fill+i) = *(eps_off+i);
+        *(redcheck+i) = -1;
+    }
+    eps_tgt = malloc((numeps+1)*sizeof(int));
+    for (i = 0; (fsm+i)->state_no != -1; i++) {
+        if ((fsm+i)->target == -1 || (fsm+i)->in != EPSILON || (fsm+i)->out != EPSILON || (fsm+i)->target == (fsm+i)->state_no)
+            continue;
+        if (*(redcheck+(fsm+i)->target) == (fsm+i)->state_no)
+            continue;
+        *(redcheck+(fsm+i)->target) = (fsm+i)->state_no;
+        *(eps_tgt+(*(fill+(fsm+i)->state_no))++) = (fsm+i)->target;
+    }
+    free(fill);
+    free(redcheck);
 
-        if (state != laststate) {
-            if (!int_stack_isempty()) {
-                deterministic = 0;
-                ptr = e_closure_memo+laststate;
-                ptr->target = e_closure_memo+int_stack_pop();
-                while (!int_stack_isempty()) {
-                    ptr->next = malloc(sizeof(struct e_closure_memo));
-                    ptr->next->state = laststate;
-                    ptr->next->target = e_closure_memo+int_stack_pop();
-                    ptr->next->next = NULL;
-                    ptr = ptr->next;
-                }
-            }
-        }
-        if (state == -1) {
-            break;
-        }
-        if ((fsm+i)->target == -1) {
+    e_closure_memo = m = malloc(sizeof(struct e_closure_memo));
+    marktable = calloc(num_states, sizeof(int));
+    m->count = 0;
+    m->scc = malloc(num_states*sizeof(int));
+    m->member_off = calloc(num_states+1, sizeof(int));
+    m->members = malloc(num_states*sizeof(int));
+    m->succ_off = calloc(num_states+2, sizeof(int));
+    succ_size = numeps + 1;
+    m->succ = malloc(succ_size*sizeof(int));
+    m->closure_off = calloc(num_states+1, sizeof(int));
+    closures_size = next_power_of_two(num_states);
+    m->closures = malloc(closures_size*sizeof(int));
+
+    /* Tarjan's algorithm, without recursion: SCCs come out successors first */
+    dfsindex = malloc(num_states*sizeof(int));
+    low = malloc(num_states*sizeof(int));
+    sccstack = malloc(num_states*sizeof(int));
+    callstack = malloc(num_states*sizeof(int));
+    calledge = malloc(num_states*sizeof(int));
+    stamp = malloc(num_states*sizeof(int));
+    for (i = 0; i < num_states; i++) {
+        *(dfsindex+i) = -1;
+        *(m->scc+i) = -1;
+        *(stamp+i) = -1;
+    }
+    sccstack_top = 0;
+    dfscount = 0;
+    for (i = 0; i < num_states; i++) {
+        if (*(dfsindex+i) != -1)
             continue;
-        }
-        /* Check if we have a redundant epsilon arc */
-        if ((fsm+i)->in == EPSILON && (fsm+i)->out == EPSILON) {
-            if (*(redcheck+((fsm+i)->target)) != (fsm+i)->state_no) {
-                if ((fsm+i)->target != (fsm+i)->state_no) {
-                    int_stack_push((fsm+i)->target);
-                    *(redcheck+((fsm+i)->target)) = (fsm+i)->state_no;
+        calltop = 0;
+        *(callstack+calltop) = i;
+        *(calledge+calltop) = *(eps_off+i);
+        *(dfsindex+i) = *(low+i) = dfscount++;
+        *(sccstack+sccstack_top++) = i;
+        while (calltop >= 0) {
+            v = *(callstack+calltop);
+            e = *(calledge+calltop);
+            if (e < *(eps_off+v+1)) {
+                (*(calledge+calltop))++;
+                w = *(eps_tgt+e);
+                if (*(dfsindex+w) == -1) {
+                    calltop++;
+                    *(callstack+calltop) = w;
+                    *(calledge+calltop) = *(eps_off+w);
+                    *(dfsindex+w) = *(low+w) = dfscount++;
+                    *(sccstack+sccstack_top++) = w;
+                } else if (*(m->scc+w) == -1 && *(dfsindex+w) < *(low+v)) {
+                    *(low+v) = *(dfsindex+w);
                 }
+                continue;
+            }
+            calltop--;
+            if (calltop >= 0 && *(low+v) < *(low+*(callstack+calltop)))
+                *(low+*(callstack+calltop)) = *(low+v);
+            if (*(low+v) == *(dfsindex+v)) {
+                for (j = sccstack_top - 1; *(sccstack+j) != v; j--)
+                    ;
+                e_closure_add_scc(sccstack, sccstack_top, j, eps_off, eps_tgt, stamp, &succ_size, &closures_size);
+                sccstack_top = j;
             }
-            laststate = state;
         }
     }
-    free(redcheck);
+    free(dfsindex);
+    free(low);
+    free(sccstack);
+    free(callstack);
+    free(calledge);
+    free(stamp);
+    free(eps_off);
+    free(eps_tgt);
+    for (i = 0; i < num_states; i++)
+        *(marktable+i) = 0;
 }
 
 static int next_unmarked(void) {
-    if ((int_stack_isempty()))
+    if ((int_stack_isempty(agenda)))
         return -1;
-    return(int_stack_pop());
+    return(int_stack_pop(agenda));
 
     if ((T_limit <= T_last_unmarked + 1) || (T_ptr+T_last_unmarked+1)->size == 0) {
         return -1;
@@ -643,185 +814,172 @@ static void sigma_to_pairs(struct fsm *net) {
 /* with permutations hashing to the same value */
 /* necessary for subset construction */
 
-static int nhash_find_insert(int *set, int setsize) {
-    int j, found, *currlist;
-    struct nhash_list *tableptr;
-    unsigned int hashval;
+/* A set is hashed as the sum of strong 64-bit hashes of its states */
 
-    hashval = hashf(set, setsize);
-    if ((table+hashval)->size == 0) {
-        return(nhash_insert(hashval, set, setsize));
-    } else {
-        for (tableptr=(table+hashval); tableptr != NULL; tableptr = tableptr->next) {
-            if ((tableptr)->size != setsize) {
-                continue;
-            } else {
-                /* Compare the list at hashval position */
-                /* to the current set by looking at etable */
-                /* entries */
-                for (j=0, found = 1, currlist= set_table+tableptr->set_offset; j < setsize; j++) {
-                    if (*(e_table+(*(currlist+j))) != (mainloop-1)) {
-                        found = 0;
-                        break;
-                    }
-                }
-                if (op == SUBSET_TEST_STAR_FREE && found == 1) {
-                    for (j=0, currlist= set_table+tableptr->set_offset; j < setsize; j++) {
-                        if (*(set+j) != *(currlist+j)) {
-                            /* Set mark */
-                            star_free_mark = 1;
-                        }
-                    }
-                }
-                if (found == 1) {
-                    return(tableptr->setnum);
-                }
-            }
+INLINE static uint64_t hash_state(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return(x ^ (x >> 31));
+}
+
+INLINE static uint64_t hashf(int *set, int setsize) {
+    int i;
+    uint64_t hashval;
+    for (i = 0, hashval = 0; i < setsize; i++) {
+        hashval += hash_state(*(set+i));
+    }
+    return(hash_state(hashval + setsize));
+}
+
+static void decode_set(size_t offset, int setsize, int *set) {
+    unsigned char *p;
+    unsigned int z;
+    int i, shift, prev;
+    p = set_table+offset;
+    for (i = 0, prev = 0; i < setsize; i++) {
+        for (z = 0, shift = 0; *p & 0x80; p++, shift += 7) {
+            z |= (unsigned int) (*p & 0x7f) << shift;
         }
+        z |= (unsigned int) *p++ << shift;
+        prev += (int) (z >> 1) ^ -(int) (z & 1);
+        *(set+i) = prev;
+    }
+}
 
-        if (nhash_load / NHASH_LOAD_LIMIT > nhash_tablesize) {
-            nhash_rebuild_table();
-            hashval = hashf(set, setsize);
+/* Is the stored set setnum the set in e_table (marked mainloop-1)? */
+
+static int set_matches(int setnum, int *set, int setsize) {
+    unsigned char *p;
+    unsigned int z;
+    int i, shift, prev, reordered;
+    p = set_table+(T_ptr+setnum)->set_offset;
+    for (i = 0, prev = 0, reordered = 0; i < setsize; i++) {
+        for (z = 0, shift = 0; *p & 0x80; p++, shift += 7) {
+            z |= (unsigned int) (*p & 0x7f) << shift;
+        }
+        z |= (unsigned int) *p++ << shift;
+        prev += (int) (z >> 1) ^ -(int) (z & 1);
+        if (*(e_table+prev) != (mainloop-1)) {
+            return 0;
         }
-        return(nhash_insert(hashval, set, setsize));
+        if (*(set+i) != prev) {
+            reordered = 1;
+        }
+    }
+    if (op == SUBSET_TEST_STAR_FREE && reordered) {
+        /* Set mark */
+        star_free_mark = 1;
     }
+    return 1;
 }
 
-INLINE static int hashf(int *set, int setsize) {
-  int i;
-  unsigned int hashval, sum = 0;
-  hashval = 6703271;
-  for (i = 0; i < setsize; i++) {
-      hashval = (unsigned int) (*(set+i) + 1103 * setsize) * hashval;
-      sum += *(set+i) + i;
-  }
-  hashval = hashval + sum * 31;
-  hashval = (hashval % nhash_tablesize);
-  return hashval;
+static int nhash_find_insert(int *set, int setsize) {
+    int setnum;
+    unsigned int mask, slot;
+    uint64_t hashval;
+
+    hashval = hashf(set, setsize);
+    mask = nhash_tablesize - 1;
+    for (slot = (unsigned int) hashval & mask; (setnum = *(table+slot)) != -1; slot = (slot + 1) & mask) {
+        if ((T_ptr+setnum)->hash == hashval && (T_ptr+setnum)->size == setsize && set_matches(setnum, set, setsize)) {
+            return(setnum);
+        }
+    }
+    return(nhash_insert(hashval, set, setsize));
 }
 
-static unsigned int move_set(int *set, int setsize) {
-    unsigned int old_offset;
-    if (set_table_offset + setsize >= set_table_size) {
-        while (set_table_offset + setsize >= set_table_size) {
+static size_t move_set(int *set, int setsize) {
+    size_t old_offset;
+    unsigned char *p;
+    unsigned int z;
+    int i, prev, diff;
+    /* At most 5 bytes per state */
+    if (set_table_offset + (size_t) setsize * 5 >= set_table_size) {
+        while (set_table_offset + (size_t) setsize * 5 >= set_table_size) {
             set_table_size *= 2;
         }
-        set_table = realloc(set_table, set_table_size * sizeof(int));
+        set_table = realloc(set_table, set_table_size);
+    }
+    p = set_table+set_table_offset;
+    for (i = 0, prev = 0; i < setsize; i++) {
+        diff = *(set+i) - prev;
+        z = ((unsigned int) diff << 1) ^ (unsigned int) (diff >> 31);
+        for ( ; z >= 0x80; z >>= 7) {
+            *p++ = (unsigned char) (z | 0x80);
+        }
+        *p++ = (unsigned char) z;
+        prev = *(set+i);
     }
-    memcpy(set_table+set_table_offset, set, setsize * sizeof(int));
     old_offset = set_table_offset;
-    set_table_offset += setsize;
+    set_table_offset = p - set_table;
     return(old_offset);
 }
 
-static int nhash_insert(int hashval, int *set, int setsize) {
-  struct nhash_list *tableptr;
-  int i, fs = 0;
-
-  current_setnum++;
-  tableptr = table+hashval;
+static int nhash_insert(uint64_t hashval, int *set, int setsize) {
+    int i, fs = 0;
+    unsigned int mask, slot;
 
-  nhash_load++;
-  for (i = 0; i < setsize; i++) {
-      if (finals[*(set+i)])
-          fs = 1;
-  }
-  if (tableptr->size == 0) {
-
-      tableptr->set_offset = move_set(set, setsize);
-      tableptr->size = setsize;
-      tableptr->setnum = current_setnum;
-
-      add_T_ptr(current_setnum, setsize, tableptr->set_offset, fs);
-      return(current_setnum);
-  }
-
-  tableptr = malloc(sizeof(struct nhash_list));
-  tableptr->next = (table+hashval)->next;
-  (table+hashval)->next = tableptr;
-  tableptr->setnum = current_setnum;
-  tableptr->size = setsize;
-  tableptr->set_offset = move_set(set, setsize);
+    current_setnum++;
+    for (i = 0; i < setsize; i++) {
+        if (finals[*(set+i)])
+            fs = 1;
+    }
+    add_T_ptr(current_setnum, setsize, move_set(set, setsize), hashval, fs);
 
-  add_T_ptr(current_setnum, setsize, tableptr->set_offset, fs);
-  return(current_setnum);
+    if (++nhash_load * NHASH_LOAD_LIMIT > nhash_tablesize) {
+        nhash_rebuild_table();
+    }
+    mask = nhash_tablesize - 1;
+    for (slot = (unsigned int) hashval & mask; *(table+slot) != -1; slot = (slot + 1) & mask) { }
+    *(table+slot) = current_setnum;
+    return(current_setnum);
 }
 
-static void nhash_rebuild_table () {
-    int i, oldsize;
-    struct nhash_list *oldtable, *tableptr, *ntableptr, *newptr;
-    unsigned int hashval;
+/* Double the table; the set just added by nhash_insert is not in it yet */
 
-    oldtable = table;
-    oldsize = nhash_tablesize;
-
-    nhash_load = 0;
-    for (i=0; primes[i] < nhash_tablesize; i++) { }
-    nhash_tablesize = primes[(i+1)];
-
-    table = calloc(nhash_tablesize,sizeof(struct nhash_list));
-    for (i=0; i < oldsize;i++) {
-        if ((oldtable+i)->size == 0) {
-            continue;
-        }
-        tableptr = oldtable+i;
-        for ( ; tableptr != NULL; (tableptr = tableptr->next)) {
-            /* rehash */
-            hashval = hashf(set_table+tableptr->set_offset,tableptr->size);
-            ntableptr = table+hashval;
-            if (ntableptr->size == 0) {
-                nhash_load++;
-                ntableptr->size = tableptr->size;
-                ntableptr->set_offset = tableptr->set_offset;
-                ntableptr->setnum = tableptr->setnum;
-                ntableptr->next = NULL;
-            } else {
-                newptr = malloc(sizeof(struct nhash_list));
-                newptr->next = ntableptr->next;
-                ntableptr->next = newptr;
-                newptr->setnum = tableptr->setnum;
-                newptr->size = tableptr->size;
-                newptr->set_offset = tableptr->set_offset;
-            }
-        }
+static void nhash_rebuild_table () {
+    int i, setnum;
+    unsigned int mask, slot;
+
+    free(table);
+    nhash_tablesize *= 2;
+    table = malloc(nhash_tablesize * sizeof(int));
+    for (i = 0; i < nhash_tablesize; i++) {
+        *(table+i) = -1;
+    }
+    mask = nhash_tablesize - 1;
+    for (setnum = 0; setnum < current_setnum; setnum++) {
+        for (slot = (unsigned int) (T_ptr+setnum)->hash & mask; *(table+slot) != -1; slot = (slot + 1) & mask) { }
+        *(table+slot) = setnum;
     }
-    nhash_free(oldtable, oldsize);
 }
 
 static void nhash_init (int initial_size) {
 
   int i;
 
-  for (i=0; primes[i] < initial_size; i++) { }
   nhash_load = 0;
-  nhash_tablesize = primes[i];
-  table = calloc(nhash_tablesize , sizeof(struct nhash_list));
+  nhash_tablesize = next_power_of_two(initial_size * NHASH_LOAD_LIMIT);
+  table = malloc(nhash_tablesize * sizeof(int));
+  for (i = 0; i < nhash_tablesize; i++) {
+      *(table+i) = -1;
+  }
   current_setnum = -1;
 }
+
 static void e_closure_free() {
-    int i;
-    struct e_closure_memo *eptr, *eprev;
     free(marktable);
-    for (i=0;i < num_states; i++) {
-        eptr = (e_closure_memo+i)->next;
-        for (eprev = NULL; eptr != NULL; ) {
-            eprev = eptr;
-            eptr = eptr->next;
-            free(eprev);
-        }
-
-    }
+    free(e_closure_memo->scc);
+    free(e_closure_memo->member_off);
+    free(e_closure_memo->members);
+    free(e_closure_memo->succ_off);
+    free(e_closure_memo->succ);
+    free(e_closure_memo->closure_off);
+    free(e_closure_memo->closures);
     free(e_closure_memo);
 }
 
-static void nhash_free(struct nhash_list *nptr, int size) {
-    struct nhash_list *nptr2, *nnext;
-    int i;
-    for (i=0; i < size; i++) {
-        for (nptr2 = (nptr+i)->next; nptr2 != NULL; nptr2 = nnext) {
-            nnext = nptr2->next;
-            free(nptr2);
-        }
-    }
-    free(nptr);
+static void nhash_free() {
+    free(table);
 }
@@ -410,6 +410,7 @@ struct sigma *fsm_construct_convert_sigma(struct fsm_construct_handle *handle) {
             newsigma = malloc(sizeof(struct sigma));
             newsigma->number = i;
             newsigma->symbol = (sl+i)->symbol;
+            newsigma->id = -1;
             newsigma->next = NULL;
             if (oldsigma != NULL) {
                 oldsigma->next = newsigma;
@@ -422,15 +423,52 @@ struct sigma *fsm_construct_convert_sigma(struct fsm_construct_handle *handle) {
     return(sigma);
 }
 
+/* Free a construct handle; the symbol strings too unless they */
+/* were handed over to a net's sigma                           */
+static void fsm_construct_free(struct fsm_construct_handle *handle, int free_symbols) {
+    int i;
+    struct fsm_trans_list *trans, *transnext;
+    struct fsm_sigma_hash *sigmahash, *sigmahashnext;
+
+    /* Free transitions */
+    for (i=0; i < handle->fsm_state_list_size; i++) {
+        trans = (((handle->fsm_state_list)+i)->fsm_trans_list);
+        while (trans != NULL) {
+            transnext = trans->next;
+            free(trans);
+            trans = transnext;
+        }
+    }
+    /* Free hash table */
+    for (i=0; i < SIGMA_HASH_SIZE; i++) {
+        sigmahash = (((handle->fsm_sigma_hash)+i)->next);
+        while (sigmahash != NULL) {
+            sigmahashnext = sigmahash->next;
+            free(sigmahash);
+            sigmahash = sigmahashnext;
+        }
+    }
+    if (free_symbols) {
+        for (i=0; i <= handle->maxsigma; i++) {
+            free(((handle->fsm_sigma_list)+i)->symbol);
+        }
+    }
+    free(handle->fsm_sigma_list);
+    free(handle->fsm_sigma_hash);
+    free(handle->fsm_state_list);
+    free(handle->name);
+    free(handle);
+}
+
 struct fsm *fsm_construct_done(struct fsm_construct_handle *handle) {
     int i, emptyfsm;
     struct fsm *net;
     struct fsm_state_list *sl;
-    struct fsm_trans_list *trans, *transnext;
-    struct fsm_sigma_hash *sigmahash, *sigmahashnext;
+    struct fsm_trans_list *trans;
 
     sl = handle->fsm_state_list;
     if (handle->maxstate == -1 || handle->numfinals == 0 || handle->hasinitial == 0) {
+        fsm_construct_free(handle, 1);
         return(fsm_empty_set());
     }
     fsm_state_init((handle->maxsigma)+1);
@@ -454,33 +492,10 @@ struct fsm *fsm_construct_done(struct fsm_construct_handle *handle) {
     net->sigma = fsm_construct_convert_sigma(handle);
     if (handle->name != NULL) {        
         strncpy(net->name, handle->name, 40);
-        free(handle->name);
     } else {
         sprintf(net->name, "%X",rand());
     }
-
-    /* Free transitions */
-    for (i=0; i < handle->fsm_state_list_size; i++) {
-        trans = (((handle->fsm_state_list)+i)->fsm_trans_list);
-        while (trans != NULL) {
-            transnext = trans->next;
-            free(trans);
-            trans = transnext;
-        }
-    }
-    /* Free hash table */
-    for (i=0; i < SIGMA_HASH_SIZE; i++) {
-        sigmahash = (((handle->fsm_sigma_hash)+i)->next);
-        while (sigmahash != NULL) {
-            sigmahashnext = sigmahash->next;
-            free(sigmahash);
-            sigmahash = sigmahashnext;
-        }
-    }
-    free(handle->fsm_sigma_list);
-    free(handle->fsm_sigma_hash);
-    free(handle->fsm_state_list);
-    free(handle);
+    fsm_construct_free(handle, 0);
     sigma_sort(net);
     if (emptyfsm) {
 	fsm_destroy(net);
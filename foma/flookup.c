@@ -17,6 +17,7 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include <stdio.h>
 #include <limits.h>
 #include <getopt.h>
@@ -31,7 +32,7 @@
 #define UDP_MAX 65535
 #define FLOOKUP_PORT 6062
 
-static char *usagestring = "Usage: flookup [-h] [-a] [-i] [-s \"separator\"] [-w \"wordseparator\"] [-v] [-x] [-b] [-I <#|#k|#m|f>] [-S] [-P] [-A] <binary foma file>\n";
+static char *usagestring = "Usage: flookup [-h] [-a] [-i] [-s \"separator\"] [-w \"wordseparator\"] [-v] [-x] [-b] [-I <#|#k|#m|f>] [-c <#k|#m>] [-L <#k|#m>] [-l <arcs,results,ms>] [-S] [-P] [-A] [-t] <binary foma file>\n";
 
 static char *helpstring =
 "Applies words from stdin to a foma transducer/automaton read from a file and prints results to stdout.\n"
@@ -41,7 +42,12 @@ static char *helpstring =
 "-h\t\tprint help\n"
 "-a\t\ttry alternatives (in order of nets loaded, default is to pass words through each)\n"
 "-b\t\tunbuffered output (flushes output after each input word, for use in bidirectional piping)\n"
+"-c size\t\tcache the results of repeated input words, using at most size memory (-c #k or -c #m)\n"
 "-i\t\tinverse application (apply down instead of up)\n"
+"-L size\t\tdeterminize the net lazily while applying, using at most size memory (-L #k or -L #m)\n"
+"\t\t(for highly nondeterministic nets, where it avoids fruitless backtracking)\n"
+"-l limits\tstop the search of a word after trying arcs,results,ms (arcs, results found, milliseconds;\n"
+"\t\t0 is no limit, e.g. -l 1000000,0,100); a word cut short gets an extra line with +!\n"
 "-I indextype\tindex arcs with indextype (one of -I f -I #k -I #m or -I #)\n"
 "\t\t(usually slower than the default except for states > 1,000 arcs)\n"
 "\t\t  -I # will index all states containing # arcs or more\n"
@@ -52,6 +58,8 @@ static char *helpstring =
 "-S\t\trun flookup as UDP server (default addr INADDR_ANY port 6062)\n"
 "-A\t\t  specify address of server\n"
 "-P\t\t  specify port of server (default 6062)\n"
+"-t\t\tprint search statistics of each word and their totals to stderr\n"
+"\t\t(needs a library built with FOMA_APPLY_STATS)\n"
 "-s \"separator\"\tchange input/output separator symbol (default is TAB)\n"
 "-w \"separator\"\tchange words separator symbol (default is LF)\n"
 "-v\t\tprint version number\n"
@@ -60,6 +68,7 @@ static char *helpstring =
 struct lookup_chain {
     struct fsm *net;
     struct apply_handle *ah;
+    struct apply_cache *cache;
     struct lookup_chain *next;
     struct lookup_chain *prev;
 };
@@ -73,16 +82,27 @@ static socklen_t          addrlen;
 
 static char buffer[2048];
 static int  echo = 1, apply_alternates = 0, numnets = 0, direction = DIR_UP, results, buffered_output = 1, index_arcs = 0, index_flag_states = 0, index_cutoff = 0, index_mem_limit = INT_MAX, mode_server = 0, port_number = FLOOKUP_PORT, udpsize;
+static size_t cache_mem_limit = 0, lazy_mem_limit = 0;
+static unsigned long long limit_arcs = 0;
+static int limit_results = 0, limit_msec = 0, truncated;
 static char *separator = "\t", *wordseparator = "\n", *server_address = NULL, *line, *serverstring = NULL;
 static FILE *INFILE;
 static struct lookup_chain *chain_head, *chain_tail, *chain_new, *chain_pos;
-static fsm_read_binary_handle fsrh;
 
 static char *(*applyer)(struct apply_handle *h, char *word) = &apply_up;  /* Default apply direction = up */
+static int (*applyer_callback)(struct apply_handle *h, char *word, apply_result_callback callback, void *data) = &apply_up_callback;
+static char *(*applyer_tokens)(struct apply_handle *h, struct apply_tokens *t) = &apply_up_tokens;
+static int shared_alphabet = 1, print_stats = 0;
+static struct apply_stats stats_total;
 static void handle_line(char *s);
 static void app_print(char *result);
+static int app_print_symbols(void *data, struct apply_symbol_view *symbols, int count);
+static int same_alphabet(struct sigma *a, struct sigma *b);
 static char *get_next_line();
 static void server_init();
+static void word_stats(char *word);
+static char *apply_limited(struct apply_handle *h, char *word);
+static void stats_print(char *label, struct apply_stats *s);
 
 void app_print(char *result) {
 
@@ -114,14 +134,29 @@ void app_print(char *result) {
     }
 }
 
+/* Print a result straight from the symbols of the path, used when */
+/* there is only one net and no need to pass strings along a chain */
+
+int app_print_symbols(void *data, struct apply_symbol_view *symbols, int count) {
+    int i;
+    if (echo == 1) {
+	fprintf(stdout, "%s%s",line, separator);
+    }
+    for (i = 0; i < count; i++) {
+	fwrite((symbols+i)->string, 1, (symbols+i)->length, stdout);
+    }
+    fputc('\n', stdout);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    int opt, sortarcs = 1;
+    int opt, sortarcs = 1, i;
     char *infilename;
-    struct fsm *net;
+    struct fsm *net, **nets;
 
     setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
 
-    while ((opt = getopt(argc, argv, "abhHiI:qs:SA:P:w:vx")) != -1) {
+    while ((opt = getopt(argc, argv, "abc:hHiI:l:L:qs:SA:P:tw:vx")) != -1) {
         switch(opt) {
         case 'a':
 	    apply_alternates = 1;
@@ -129,12 +164,36 @@ int main(int argc, char *argv[]) {
         case 'b':
 	    buffered_output = 0;
 	    break;
+        case 'c':
+	    cache_mem_limit = strtoul(optarg, NULL, 10);
+	    if (strchr(optarg, 'k') != NULL || strchr(optarg, 'K') != NULL) {
+		cache_mem_limit *= 1024;
+	    } else if (strchr(optarg, 'm') != NULL || strchr(optarg, 'M') != NULL) {
+		cache_mem_limit *= 1024*1024;
+	    }
+	    break;
+        case 'L':
+	    lazy_mem_limit = strtoul(optarg, NULL, 10);
+	    if (strchr(optarg, 'k') != NULL || strchr(optarg, 'K') != NULL) {
+		lazy_mem_limit *= 1024;
+	    } else if (strchr(optarg, 'm') != NULL || strchr(optarg, 'M') != NULL) {
+		lazy_mem_limit *= 1024*1024;
+	    }
+	    break;
+        case 'l':
+	    if (sscanf(optarg, "%llu,%i,%i", &limit_arcs, &limit_results, &limit_msec) != 3) {
+		fprintf(stderr, "%s", usagestring);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
         case 'h':
 	    printf("%s%s\n", usagestring,helpstring);
             exit(0);
         case 'i':
 	    direction = DIR_DOWN;
 	    applyer = &apply_down;
+	    applyer_callback = &apply_down_callback;
+	    applyer_tokens = &apply_down_tokens;
 	    break;
         case 'q':
 	    sortarcs = 0;
@@ -168,6 +227,9 @@ int main(int argc, char *argv[]) {
 	case 'P':
 	    port_number = atoi(optarg);
 	    break;
+	case 't':
+	    print_stats = 1;
+	    break;
 	case 'w':
 	    wordseparator = strdup(optarg);
 	    break;
@@ -189,14 +251,14 @@ int main(int argc, char *argv[]) {
 
     infilename = argv[optind];
 
-    if ((fsrh = fsm_read_binary_file_multiple_init(infilename)) == NULL) {
+    if ((nets = fsm_read_binary_file_all(infilename, &numnets)) == NULL) {
         perror("File error");
 	exit(EXIT_FAILURE);
     }
     chain_head = chain_tail = NULL;
 
-    while ((net = fsm_read_binary_file_multiple(fsrh)) != NULL) {
-	numnets++;
+    for (i = 0; i < numnets; i++) {
+	net = *(nets+i);
 	chain_new = malloc(sizeof(struct lookup_chain));
 	if (direction == DIR_DOWN && net->arcs_sorted_in != 1 && sortarcs) {
 	    fsm_sort_arcs(net, 1);
@@ -206,6 +268,11 @@ int main(int argc, char *argv[]) {
 	}
 	chain_new->net = net;
 	chain_new->ah = apply_init(net);
+	chain_new->cache = NULL;
+	if (lazy_mem_limit > 0) {
+	    apply_set_lazy(chain_new->ah, lazy_mem_limit);
+	}
+	apply_set_limits(chain_new->ah, limit_arcs, limit_results, limit_msec);
 	if (direction == DIR_DOWN && index_arcs) {
 	    apply_index(chain_new->ah, APPLY_INDEX_INPUT, index_cutoff, index_mem_limit, index_flag_states);
 	}
@@ -215,6 +282,9 @@ int main(int argc, char *argv[]) {
 
 	chain_new->next = NULL;
 	chain_new->prev = NULL;
+	if (chain_head != NULL && !same_alphabet(chain_head->net->sigma, net->sigma)) {
+	    shared_alphabet = 0;
+	}
 	if (chain_tail == NULL) {
 	    chain_tail = chain_head = chain_new;
 	} else if (direction == DIR_DOWN || apply_alternates == 1) {
@@ -227,12 +297,26 @@ int main(int argc, char *argv[]) {
 	    chain_head = chain_new;
 	}
     }
+    free(nets);
 
     if (numnets < 1) {
 	fprintf(stderr, "%s: %s\n", "File error", infilename);
 	exit(EXIT_FAILURE);
     }
 
+    if (print_stats && !apply_get_stats(chain_head->ah, &stats_total)) {
+	fprintf(stderr, "flookup: library built without FOMA_APPLY_STATS, ignoring -t\n");
+	print_stats = 0;
+    }
+
+    /* Split the cache budget evenly between the nets */
+    if (cache_mem_limit > 0) {
+	for (chain_pos = chain_head; chain_pos != NULL; chain_pos = chain_pos->next) {
+	    chain_pos->cache = apply_cache_init(cache_mem_limit / numnets);
+	    apply_set_cache(chain_pos->ah, chain_pos->cache);
+	}
+    }
+
     if (mode_server) {
 	server_init();
 	serverstring = calloc(UDP_MAX+1, sizeof(char));
@@ -248,12 +332,18 @@ int main(int argc, char *argv[]) {
 	    line[strcspn(line, "\n\r")] = '\0';
 	    fflush(stdout);
 	    results = 0;
+	    truncated = 0;
 	    udpsize = 0;
 	    serverstring[0] = '\0';
 	    handle_line(line);
-	    if (results == 0) {
+	    if (truncated) {
+		app_print("+!");
+	    } else if (results == 0) {
 		app_print(NULL);
 	    }
+	    if (print_stats) {
+		word_stats(line);
+	    }
 	    if (serverstring[0] != '\0') {
 		numbytes = sendto(listen_sd, serverstring, strlen(serverstring), 0, (struct sockaddr *)&clientaddr, addrlen);
 		if (numbytes < 0) {
@@ -267,22 +357,34 @@ int main(int argc, char *argv[]) {
 	INFILE = stdin;
 	while (get_next_line() != NULL) {
 	    results = 0;
+	    truncated = 0;
 	    handle_line(line);
-	    if (results == 0) {
+	    if (truncated) {
+		app_print("+!");
+	    } else if (results == 0) {
 		app_print(NULL);
 	    }
+	    if (print_stats) {
+		word_stats(line);
+	    }
 	    fprintf(stdout, "%s", wordseparator);
 	    if (!buffered_output) {
 		fflush(stdout);
 	    }
 	}
     }
+    if (print_stats) {
+	stats_print("TOTAL", &stats_total);
+    }
    /* Cleanup */
     for (chain_pos = chain_head; chain_pos != NULL; chain_pos = chain_head) {
 	chain_head = chain_pos->next;
 	if (chain_pos->ah != NULL) {
 	    apply_clear(chain_pos->ah);
 	}
+	if (chain_pos->cache != NULL) {
+	    apply_cache_clear(chain_pos->cache);
+	}
 	if (chain_pos->net != NULL) {
 	    fsm_destroy(chain_pos->net);
 	}
@@ -295,6 +397,43 @@ int main(int argc, char *argv[]) {
     exit(0);
 }
 
+/* Sum the search counters of all nets for the word just applied, */
+/* print them and add them to the totals                           */
+
+void word_stats(char *word) {
+    struct apply_stats s, sum;
+    memset(&sum, 0, sizeof(struct apply_stats));
+    for (chain_pos = chain_head; chain_pos != NULL; chain_pos = chain_pos->next) {
+	apply_get_stats(chain_pos->ah, &s);
+	apply_reset_stats(chain_pos->ah);
+	sum.searches += s.searches;
+	sum.arcs_tried += s.arcs_tried;
+	sum.arcs_followed += s.arcs_followed;
+	sum.backtracks += s.backtracks;
+	sum.flag_fails += s.flag_fails;
+	sum.index_hits += s.index_hits;
+	sum.binsearches += s.binsearches;
+	sum.linear_scans += s.linear_scans;
+	sum.results += s.results;
+	sum.max_depth = s.max_depth > sum.max_depth ? s.max_depth : sum.max_depth;
+    }
+    stats_print(word, &sum);
+    stats_total.searches += sum.searches;
+    stats_total.arcs_tried += sum.arcs_tried;
+    stats_total.arcs_followed += sum.arcs_followed;
+    stats_total.backtracks += sum.backtracks;
+    stats_total.flag_fails += sum.flag_fails;
+    stats_total.index_hits += sum.index_hits;
+    stats_total.binsearches += sum.binsearches;
+    stats_total.linear_scans += sum.linear_scans;
+    stats_total.results += sum.results;
+    stats_total.max_depth = sum.max_depth > stats_total.max_depth ? sum.max_depth : stats_total.max_depth;
+}
+
+void stats_print(char *label, struct apply_stats *s) {
+    fprintf(stderr, "%s%ssearches=%llu arcs=%llu followed=%llu backtracks=%llu flagfails=%llu indexhits=%llu binsearches=%llu linear=%llu results=%llu maxdepth=%i\n", label, separator, s->searches, s->arcs_tried, s->arcs_followed, s->backtracks, s->flag_fails, s->index_hits, s->binsearches, s->linear_scans, s->results, s->max_depth);
+}
+
 char *get_next_line() {
     char *r;
     if ((r = fgets(line, LINE_LIMIT, INFILE)) != NULL) {
@@ -303,16 +442,47 @@ char *get_next_line() {
     return r;
 }
 
+/* Nets with identical alphabets tokenize their input identically */
+
+int same_alphabet(struct sigma *a, struct sigma *b) {
+    for ( ; a != NULL && b != NULL; a = a->next, b = b->next) {
+	if (a->number != b->number)
+	    return 0;
+	if (a->symbol != b->symbol && (a->symbol == NULL || b->symbol == NULL || strcmp(a->symbol, b->symbol) != 0))
+	    return 0;
+    }
+    return(a == NULL && b == NULL);
+}
+
+/* Apply, noting if a search limit cut the search short */
+
+char *apply_limited(struct apply_handle *h, char *word) {
+    char *result;
+    if ((result = applyer(h, word)) == NULL && apply_truncated(h)) {
+	truncated = 1;
+    }
+    return(result);
+}
+
 void handle_line(char *s) {
     char *result, *tempstr;
-    /* Apply alternative */
-    if (apply_alternates == 1) {
+    struct apply_tokens *tokens;
+    /* Single net: print results without building strings */
+    if (chain_head == chain_tail && !mode_server && chain_head->cache == NULL) {
+	results += applyer_callback(chain_head->ah, s, &app_print_symbols, NULL);
+	truncated = apply_truncated(chain_head->ah);
+    } else if (apply_alternates == 1) {
+	/* All alternates see the same input, so tokenize it only once if we can */
+	tokens = shared_alphabet && chain_head->cache == NULL ? apply_tokenize(chain_head->ah, s) : NULL;
 	for (chain_pos = chain_head, tempstr = s;   ; chain_pos = chain_pos->next) {
-	    result = applyer(chain_pos->ah, tempstr);
+	    result = tokens != NULL ? applyer_tokens(chain_pos->ah, tokens) : apply_limited(chain_pos->ah, tempstr);
+	    if (result == NULL && apply_truncated(chain_pos->ah)) {
+		truncated = 1;
+	    }
 	    if (result != NULL) {
 		results++;
 		app_print(result);
-		while ((result = applyer(chain_pos->ah, NULL)) != NULL) {
+		while ((result = apply_limited(chain_pos->ah, NULL)) != NULL) {
 		    results++;
 		    app_print(result);
 		}
@@ -322,11 +492,12 @@ void handle_line(char *s) {
 		break;
 	    }
 	}
+	apply_tokens_free(tokens);
     } else {
 
 	/* Get result from chain */
 	for (chain_pos = chain_head, tempstr = s;  ; chain_pos = chain_pos->next) {
-	    result = applyer(chain_pos->ah, tempstr);
+	    result = apply_limited(chain_pos->ah, tempstr);
 	    if (result != NULL && chain_pos != chain_tail) {
 		tempstr = result;
 		continue;
@@ -335,12 +506,12 @@ void handle_line(char *s) {
 		do {
 		    results++;
 		    app_print(result);
-		} while ((result = applyer(chain_pos->ah, NULL)) != NULL);
+		} while ((result = apply_limited(chain_pos->ah, NULL)) != NULL);
 	    }
 	    if (result == NULL) {
 		/* Move up */
 		for (chain_pos = chain_pos->prev; chain_pos != NULL; chain_pos = chain_pos->prev) {
-		    result = applyer(chain_pos->ah, NULL);
+		    result = apply_limited(chain_pos->ah, NULL);
 		    if (result != NULL) {
 			tempstr = result;
 			break;
@@ -0,0 +1,333 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "fomalib.h"
+
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#endif
+
+#define LINE_LIMIT 262144
+
+static char *usagestring = "Usage: fomabench [-h] [-i] [-m] [-n] [-I <#|#k|#m|f>] [-c <#k|#m>] [-l limit] [-r repeat] [-t threads] [-T medthreads] [-q] [-v] <binary foma file> <word list>\n";
+
+static char *helpstring =
+"Applies every word of a word list to the first net in a foma binary file and reports lookup throughput and latency as a single line of JSON on stdout.\n\n"
+"Options:\n\n"
+"-h\t\tprint help\n"
+"-i\t\tinverse application (apply down instead of up)\n"
+"-m\t\tapply minimum edit distance (apply_med) instead of apply up/down\n"
+"-n\t\tdon't obey flag diacritics\n"
+"-I indextype\tindex arcs with indextype (as in flookup: -I f -I #k -I #m or -I #)\n"
+"-c size\t\tcache results of repeated words, using at most size memory (-c #k or -c #m)\n"
+"-l limit\tmaximum number of apply_med results per word (default 5)\n"
+"-r repeat\tpasses over the word list (default 1)\n"
+"-t threads\tsplit the word list over this many threads, each with its own handle (default 1, 0 = one per CPU)\n"
+"-T medthreads\tthreads used inside each apply_med search (default 1)\n"
+"-q\t\tdon't sort arcs before applying\n"
+"-v\t\tprint version number\n\n"
+"The report contains words/sec, p50/p99/max per-word latency in microseconds,\n"
+"analyses per word and peak resident set size in kB.";
+
+struct bench_thread {
+    struct fsm *net;
+    struct apply_cache *cache;
+    struct apply_handle *index_from;
+    char **words;
+    int numwords;
+    double *latency;
+    unsigned long long results;
+};
+
+static int direction_down = 0, use_med = 0, obey_flags = 1, index_arcs = 0, index_flag_states = 0, index_cutoff = 0, index_mem_limit = INT_MAX, med_limit = 5, med_threads = 1, repeat = 1;
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int bench_num_cpus() {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return(n > 0 ? (int) n : 1);
+#else
+    return 1;
+#endif
+}
+
+/* Print s as a JSON string */
+static void json_print_string(char *s) {
+    putchar('"');
+    for ( ; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if ((unsigned char) *s < 0x20)
+	    printf("\\u%04x", (unsigned char) *s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return(x < y ? -1 : x > y);
+}
+
+static void *bench_run(void *arg) {
+    struct bench_thread *bt = arg;
+    struct apply_handle *h = NULL;
+    struct apply_med_handle *medh = NULL;
+    char *result;
+    double start;
+    int i, r;
+
+    if (use_med) {
+	medh = apply_med_init(bt->net);
+	apply_med_set_med_limit(medh, med_limit);
+	apply_med_set_threads(medh, med_threads);
+    } else {
+	h = apply_init(bt->net);
+	apply_set_obey_flags(h, obey_flags);
+	if (bt->index_from != NULL) {
+	    apply_index_share(h, bt->index_from);
+	}
+	if (bt->cache != NULL) {
+	    apply_set_cache(h, bt->cache);
+	}
+    }
+    for (r = 0; r < repeat; r++) {
+	for (i = 0; i < bt->numwords; i++) {
+	    start = bench_now();
+	    if (use_med) {
+		for (result = apply_med(medh, bt->words[i]); result != NULL; result = apply_med(medh, NULL))
+		    bt->results++;
+	    } else if (direction_down) {
+		for (result = apply_down(h, bt->words[i]); result != NULL; result = apply_down(h, NULL))
+		    bt->results++;
+	    } else {
+		for (result = apply_up(h, bt->words[i]); result != NULL; result = apply_up(h, NULL))
+		    bt->results++;
+	    }
+	    bt->latency[r * bt->numwords + i] = bench_now() - start;
+	}
+    }
+    if (medh != NULL)
+	apply_med_clear(medh);
+    if (h != NULL)
+	apply_clear(h);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int opt, sortarcs = 1, numthreads = 1, numwords = 0, wordsize = 1024, i, j, chunk;
+    long long numsamples, pos;
+    size_t cache_mem_limit = 0;
+    char *line, **words;
+    double start, elapsed, *latency;
+    unsigned long long results = 0;
+    struct fsm *net;
+    struct apply_cache *cache = NULL;
+    struct apply_handle *indexh = NULL;
+    struct bench_thread *bt;
+    struct rusage usage;
+    FILE *WORDFILE;
+#ifdef FOMA_PTHREADS
+    pthread_t *tids;
+#endif
+
+    while ((opt = getopt(argc, argv, "c:hiI:l:mnqr:t:T:v")) != -1) {
+        switch(opt) {
+        case 'c':
+	    cache_mem_limit = strtoul(optarg, NULL, 10);
+	    if (strchr(optarg, 'k') != NULL || strchr(optarg, 'K') != NULL) {
+		cache_mem_limit *= 1024;
+	    } else if (strchr(optarg, 'm') != NULL || strchr(optarg, 'M') != NULL) {
+		cache_mem_limit *= 1024*1024;
+	    }
+	    break;
+        case 'h':
+	    printf("%s%s\n", usagestring,helpstring);
+            exit(0);
+        case 'i':
+	    direction_down = 1;
+	    break;
+	case 'I':
+	    if (strcmp(optarg, "f") == 0) {
+		index_flag_states = 1;
+		index_arcs = 1;
+	    } else if (strchr(optarg, 'k') != NULL || strchr(optarg, 'K') != NULL) {
+		index_mem_limit = 1024*atoi(optarg);
+		index_arcs = 1;
+	    } else if (strchr(optarg, 'm') != NULL || strchr(optarg, 'M') != NULL) {
+		index_mem_limit = 1024*1024*atoi(optarg);
+		index_arcs = 1;
+	    } else if (isdigit(*optarg)) {
+		index_arcs = 1;
+		index_cutoff = atoi(optarg);
+	    }
+	    break;
+	case 'l':
+	    med_limit = atoi(optarg);
+	    break;
+	case 'm':
+	    use_med = 1;
+	    break;
+	case 'n':
+	    obey_flags = 0;
+	    break;
+        case 'q':
+	    sortarcs = 0;
+	    break;
+	case 'r':
+	    repeat = atoi(optarg) > 0 ? atoi(optarg) : 1;
+	    break;
+	case 't':
+	    numthreads = atoi(optarg);
+	    break;
+	case 'T':
+	    med_threads = atoi(optarg);
+	    break;
+        case 'v':
+	    printf("fomabench 1.0 (foma library version %s)\n", fsm_get_library_version_string());
+	    exit(0);
+	default:
+            fprintf(stderr, "%s", usagestring);
+            exit(EXIT_FAILURE);
+	}
+    }
+    if (optind + 2 != argc) {
+	fprintf(stderr, "%s", usagestring);
+	exit(EXIT_FAILURE);
+    }
+    if (numthreads <= 0)
+	numthreads = bench_num_cpus();
+#ifndef FOMA_PTHREADS
+    numthreads = 1;
+#endif
+
+    if ((net = fsm_read_binary_file(argv[optind])) == NULL) {
+        perror("File error");
+	exit(EXIT_FAILURE);
+    }
+    if (!use_med && sortarcs) {
+	if (direction_down && net->arcs_sorted_in != 1)
+	    fsm_sort_arcs(net, 1);
+	if (!direction_down && net->arcs_sorted_out != 1)
+	    fsm_sort_arcs(net, 2);
+    }
+
+    if ((WORDFILE = fopen(argv[optind+1], "r")) == NULL) {
+	perror("File error");
+	exit(EXIT_FAILURE);
+    }
+    line = malloc(LINE_LIMIT);
+    words = malloc(sizeof(char *) * wordsize);
+    while (fgets(line, LINE_LIMIT, WORDFILE) != NULL) {
+	line[strcspn(line, "\n\r")] = '\0';
+	if (numwords == wordsize) {
+	    wordsize *= 2;
+	    words = realloc(words, sizeof(char *) * wordsize);
+	}
+	words[numwords++] = strdup(line);
+    }
+    fclose(WORDFILE);
+    free(line);
+    if (numwords == 0) {
+	fprintf(stderr, "No words in %s\n", argv[optind+1]);
+	exit(EXIT_FAILURE);
+    }
+    if (numthreads > numwords)
+	numthreads = numwords;
+
+    if (cache_mem_limit > 0 && !use_med)
+	cache = apply_cache_init(cache_mem_limit);
+    /* One index, shared by the handles of all threads */
+    if (index_arcs && !use_med) {
+	indexh = apply_init(net);
+	apply_index(indexh, direction_down ? APPLY_INDEX_INPUT : APPLY_INDEX_OUTPUT, index_cutoff, index_mem_limit, index_flag_states);
+    }
+
+    /* Each thread gets a contiguous slice of the word list and its own handle */
+    numsamples = (long long) numwords * repeat;
+    latency = malloc(sizeof(double) * numsamples);
+    bt = calloc(numthreads, sizeof(struct bench_thread));
+    chunk = (numwords + numthreads - 1) / numthreads;
+    for (i = 0, pos = 0, j = 0; i < numthreads; i++) {
+	(bt+i)->net = net;
+	(bt+i)->cache = cache;
+	(bt+i)->index_from = indexh;
+	(bt+i)->words = words + j;
+	(bt+i)->numwords = j + chunk > numwords ? numwords - j : chunk;
+	(bt+i)->latency = latency + pos;
+	j += (bt+i)->numwords;
+	pos += (long long) (bt+i)->numwords * repeat;
+    }
+
+    start = bench_now();
+#ifdef FOMA_PTHREADS
+    tids = malloc(sizeof(pthread_t) * numthreads);
+    for (i = 1; i < numthreads; i++)
+	pthread_create(tids+i, NULL, bench_run, bt+i);
+    bench_run(bt);
+    for (i = 1; i < numthreads; i++)
+	pthread_join(tids[i], NULL);
+    free(tids);
+#else
+    bench_run(bt);
+#endif
+    elapsed = bench_now() - start;
+
+    for (i = 0; i < numthreads; i++)
+	results += (bt+i)->results;
+    qsort(latency, numsamples, sizeof(double), compare_double);
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"file\": ");
+    json_print_string(argv[optind]);
+    printf(", \"words\": %lld, \"mode\": \"%s\", \"index\": %d, \"obey_flags\": %d, \"threads\": %d, \"med_threads\": %d, \"seconds\": %.6f, \"words_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"analyses_per_word\": %.3f, \"peak_rss_kb\": %ld}\n",
+	   numsamples, use_med ? "med" : direction_down ? "down" : "up", index_arcs, obey_flags, numthreads, med_threads, elapsed,
+	   numsamples / elapsed,
+	   latency[numsamples / 2] * 1e6,
+	   latency[(long long) (numsamples * 0.99) < numsamples ? (long long) (numsamples * 0.99) : numsamples - 1] * 1e6,
+	   latency[numsamples - 1] * 1e6,
+	   (double) results / numsamples,
+	   usage.ru_maxrss);
+
+    for (i = 0; i < numwords; i++)
+	free(words[i]);
+    free(words);
+    free(latency);
+    free(bt);
+    if (cache != NULL)
+	apply_cache_clear(cache);
+    if (indexh != NULL)
+	apply_clear(indexh);
+    fsm_destroy(net);
+    exit(0);
+}
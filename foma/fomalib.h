@@ -93,6 +93,7 @@ extern "C" {
 
 #define APPLY_INDEX_INPUT 1
 #define APPLY_INDEX_OUTPUT 2
+#define APPLY_INDEX_BOTH 3
 
 #define FSM_NAME_LEN 40
 
@@ -141,9 +142,22 @@ struct fsm {
 };
 
 /* Minimum edit distance structure */
+/* The confusion matrix is sparse: default costs plus an open-addressed */
+/* hash of the (in, out) pairs whose cost differs from the default      */
+
+struct cmatrix_cell {
+    int in;                     /* -1 marks an empty slot */
+    int out;
+    int cost;
+};
 
 struct medlookup {
-    int *confusion_matrix;      /* Confusion matrix */
+    int substitute_cost;
+    int insert_cost;
+    int delete_cost;
+    int numcells;
+    int tablesize;
+    struct cmatrix_cell *cells;
 };
 
 /** Array of states */
@@ -189,6 +203,31 @@ struct sigma {
     int number;
     char *symbol;
     struct sigma *next;
+    int id;             /* Interned id of symbol, -1 until looked up */
+};
+
+/** One symbol of a result passed to an apply callback */
+struct apply_symbol_view {
+    int symbol;           /* Symbol number in sigma                       */
+    const char *string;   /* Points into the alphabet or the input string */
+    int length;           /* Length of string in bytes (not terminated)   */
+};
+
+/* Called once per result with its symbols; return nonzero to stop */
+typedef int (*apply_result_callback)(void *data, struct apply_symbol_view *symbols, int count);
+
+/** Search counters of an apply handle (kept with FOMA_APPLY_STATS only) */
+struct apply_stats {
+    unsigned long long searches;       /* Words applied (or enumerations begun) */
+    unsigned long long arcs_tried;     /* Arcs matched against the input        */
+    unsigned long long arcs_followed;  /* Arcs taken, i.e. pushes on the stack  */
+    unsigned long long backtracks;     /* Pops off the stack                    */
+    unsigned long long flag_fails;     /* Flag diacritics that blocked an arc   */
+    unsigned long long index_hits;     /* States entered through an arc index   */
+    unsigned long long binsearches;    /* Binary searches of a state's arcs     */
+    unsigned long long linear_scans;   /* ... of which done as a linear scan    */
+    unsigned long long results;        /* Results returned or passed on         */
+    int max_depth;                     /* Deepest the search stack got          */
 };
 
 #include "fomalibconf.h"
@@ -243,6 +282,7 @@ FEXPORT struct fsm *fsm_priority_union_upper(struct fsm *net1, struct fsm *net2)
 FEXPORT struct fsm *fsm_priority_union_lower(struct fsm *net1, struct fsm *net2);
 FEXPORT struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2);
 FEXPORT struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2);
+FEXPORT struct fsm *fsm_compose_n(struct fsm **nets, int n);
 FEXPORT struct fsm *fsm_lenient_compose(struct fsm *net1, struct fsm *net2);
 FEXPORT struct fsm *fsm_cross_product(struct fsm *net1, struct fsm *net2);
 FEXPORT struct fsm *fsm_shuffle(struct fsm *net1, struct fsm *net2);
@@ -346,10 +386,16 @@ FEXPORT struct fsm *fsm_read_prolog(char *filename);
 FEXPORT char *file_to_mem(char *name);
 FEXPORT struct fsm *fsm_read_binary_file(char *filename);
 FEXPORT struct fsm *fsm_read_binary_file_multiple(fsm_read_binary_handle fsrh);
+/* Read the first net of the contents of a binary file, gzipped or not */
+FEXPORT struct fsm *fsm_read_binary_mem(char *data, size_t len);
 FEXPORT fsm_read_binary_handle fsm_read_binary_file_multiple_init(char *filename);
+/* Read all nets of a file, parsing them in parallel; returns a NULL-terminated array */
+FEXPORT struct fsm **fsm_read_binary_file_all(char *filename, int *numnets);
 FEXPORT struct fsm *fsm_read_text_file(char *filename);
 FEXPORT struct fsm *fsm_read_spaced_text_file(char *filename);
 FEXPORT int fsm_write_binary_file(struct fsm *net, char *filename);
+/* Write several nets to one file, formatting and compressing them in parallel */
+FEXPORT int fsm_write_binary_file_all(char *filename, struct fsm **nets, int numnets);
 FEXPORT int load_defined(struct defined_networks *def, char *filename);
 FEXPORT int save_defined(struct defined_networks *def, char *filename);
 FEXPORT int save_stack_att();
@@ -368,6 +414,8 @@ FEXPORT void apply_med_clear(struct apply_med_handle *h);
 FEXPORT void apply_med_set_heap_max(struct apply_med_handle *medh, int max);
 FEXPORT void apply_med_set_med_limit(struct apply_med_handle *medh, int max);
 FEXPORT void apply_med_set_med_cutoff(struct apply_med_handle *medh, int max);
+/* Split the search over several threads (0 = one per CPU) */
+FEXPORT void apply_med_set_threads(struct apply_med_handle *medh, int threads);
 FEXPORT int apply_med_get_cost(struct apply_med_handle *medh);
 FEXPORT void apply_med_set_align_symbol(struct apply_med_handle *medh, char *align);
 FEXPORT char *apply_med_get_instring(struct apply_med_handle *medh);
@@ -376,15 +424,54 @@ FEXPORT char *apply_med_get_outstring(struct apply_med_handle *medh);
 FEXPORT char *apply_down(struct apply_handle *h, char *word);
 FEXPORT char *apply_up(struct apply_handle *h, char *word);
 FEXPORT char *apply_med(struct apply_med_handle *medh, char *word);
+/* Deliver all results to callback instead of returning strings; */
+/* returns the number of results delivered                       */
+FEXPORT int apply_down_callback(struct apply_handle *h, char *word, apply_result_callback callback, void *data);
+FEXPORT int apply_up_callback(struct apply_handle *h, char *word, apply_result_callback callback, void *data);
+/* Apply a list of words in one call: all results go into one buffer,    */
+/* each terminated by '\0', word by word; counts[i] receives the number  */
+/* of results of words[i], and *len the length of the buffer, which is   */
+/* owned by the handle and valid until the next batch call              */
+FEXPORT char *apply_down_batch(struct apply_handle *h, char **words, int nwords, int *counts, size_t *len);
+FEXPORT char *apply_up_batch(struct apply_handle *h, char **words, int nwords, int *counts, size_t *len);
+/* Tokenize once, apply many times (to nets sharing the same alphabet) */
+FEXPORT struct apply_tokens *apply_tokenize(struct apply_handle *h, char *word);
+FEXPORT struct apply_tokens *apply_tokens_from_symbols(struct apply_handle *h, int *symbols, int count);
+FEXPORT void apply_tokens_free(struct apply_tokens *t);
+FEXPORT char *apply_down_tokens(struct apply_handle *h, struct apply_tokens *t);
+FEXPORT char *apply_up_tokens(struct apply_handle *h, struct apply_tokens *t);
 FEXPORT char *apply_upper_words(struct apply_handle *h);
 FEXPORT char *apply_lower_words(struct apply_handle *h);
 FEXPORT char *apply_words(struct apply_handle *h);
 FEXPORT char *apply_random_lower(struct apply_handle *h);
 FEXPORT char *apply_random_upper(struct apply_handle *h);
 FEXPORT char *apply_random_words(struct apply_handle *h);
+/* Draw accepting paths uniformly at random: every path is equally   */
+/* likely; paths of cyclic nets are bounded by maxlen arcs (default */
+/* 20).  Each handle has its own generator, seeded with the time     */
+/* unless apply_set_seed() is called, which makes runs reproducible */
+FEXPORT char *apply_sample_words(struct apply_handle *h);
+FEXPORT char *apply_sample_upper(struct apply_handle *h);
+FEXPORT char *apply_sample_lower(struct apply_handle *h);
+FEXPORT void apply_set_seed(struct apply_handle *h, unsigned long long seed);
+FEXPORT void apply_set_sample_maxlen(struct apply_handle *h, int maxlen);
+/* Write every word of an acyclic net to out, one per line, as          */
+/* apply_words() (type 0), apply_upper_words() (1) or apply_lower_words() */
+/* (2) would; the work is split over nthreads threads (0 = one per CPU), */
+/* which keeps the order only with one thread.  Returns the number of    */
+/* words written, or -1 if the net is cyclic                             */
+FEXPORT long long apply_write_words(struct apply_handle *h, FILE *out, int type, int nthreads);
 /* Reset the iterator to start anew with enumerating functions */
 FEXPORT void apply_reset_enumerator(struct apply_handle *h);
+/* Index the arcs of the input side, the output side, or both */
+/* (APPLY_INDEX_INPUT|APPLY_INDEX_OUTPUT) of states with at     */
+/* least densitycutoff arcs, densest first, within mem_limit    */
+/* bytes; flags_only indexes only the states with flags         */
 FEXPORT void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only);
+/* Make h use the indexes of from, a handle on the same net, */
+/* instead of its own; returns 0 if the nets differ.  The    */
+/* handles may then be used and cleared in different threads */
+FEXPORT int apply_index_share(struct apply_handle *h, struct apply_handle *from);
 FEXPORT void apply_set_show_flags(struct apply_handle *h, int value);
 FEXPORT void apply_set_obey_flags(struct apply_handle *h, int value);
 FEXPORT void apply_set_print_space(struct apply_handle *h, int value);
@@ -392,6 +479,31 @@ FEXPORT void apply_set_print_pairs(struct apply_handle *h, int value);
 FEXPORT void apply_set_space_symbol(struct apply_handle *h, char *space);
 FEXPORT void apply_set_separator(struct apply_handle *h, char *symbol);
 FEXPORT void apply_set_epsilon(struct apply_handle *h, char *symbol);
+/* Copy the search counters of h, summed since apply_init() or the last */
+/* apply_reset_stats(), to stats; returns 0 (and zeroes stats) if the    */
+/* library was built without FOMA_APPLY_STATS                            */
+FEXPORT int apply_get_stats(struct apply_handle *h, struct apply_stats *stats);
+FEXPORT void apply_reset_stats(struct apply_handle *h);
+/* Bound the search of each word given to apply_up/apply_down (and their */
+/* callback and token forms) to max_arcs arcs tried, max_results results */
+/* and max_msec milliseconds, 0 meaning no limit.  A search that hits a  */
+/* limit ends as if there were no more results, and apply_truncated()    */
+/* then returns 1 until the next word is applied                         */
+FEXPORT void apply_set_limits(struct apply_handle *h, unsigned long long max_arcs, int max_results, int max_msec);
+FEXPORT int apply_truncated(struct apply_handle *h);
+
+/* Bounded LRU cache of apply_up/apply_down results; may be shared by */
+/* handles (also in different threads) applying the same net          */
+FEXPORT struct apply_cache *apply_cache_init(size_t mem_limit);
+FEXPORT void apply_cache_clear(struct apply_cache *cache);
+FEXPORT void apply_cache_stats(struct apply_cache *cache, unsigned long long *hits, unsigned long long *misses, size_t *mem_used);
+FEXPORT void apply_set_cache(struct apply_handle *h, struct apply_cache *cache);
+
+/* Run the input of apply_up/apply_down through a lazily built, cached */
+/* subset construction of the net first, which rejects unmatched words */
+/* at once and keeps the search out of dead ends; meant for highly     */
+/* nondeterministic nets.  mem_limit bounds the cache, 0 turns it off  */
+FEXPORT void apply_set_lazy(struct apply_handle *h, size_t mem_limit);
     
 /* Minimum edit distance & spelling correction */
 FEXPORT void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net);
@@ -521,6 +633,41 @@ FEXPORT int fsm_get_next_state_arc(struct fsm_read_handle *handle);
 /* Frees memory associated with a read handle */
 FEXPORT void fsm_read_done(struct fsm_read_handle *handle);
 
+/**************************/
+/* Word <-> index mapping */
+/**************************/
+
+/* A minimal perfect hash over the words of an acyclic net that is     */
+/* deterministic on its input side: the words are numbered 0..size-1   */
+/* in lexicographic order, compared symbol by symbol                   */
+
+struct fsm_word_index {
+    int start;
+    int *first;                 /* [state], arcs of state are first[state]..first[state+1]-1 */
+    int *sym;                   /* [arc] */
+    int *target;                /* [arc] */
+    long long *before;          /* [arc], words of state that sort before arc's */
+    long long *count;           /* [state], words of the right language of state */
+    unsigned char *final;       /* [state] */
+    char **symbols;             /* [symbol number] */
+    int nsymbols;
+    int *alphabet;              /* Symbol numbers sorted by string, to split input with */
+    int nalphabet;
+    char *word;
+    int wordsize;
+};
+
+/* Returns NULL if the net is cyclic, has epsilon, ? or @ arcs, is not */
+/* deterministic on the input side, or has too many words to count    */
+FEXPORT struct fsm_word_index *fsm_word_index_init(struct fsm *net);
+FEXPORT long long fsm_word_index_size(struct fsm_word_index *wi);
+/* Index of word, or -1 if the net does not accept it; word is split */
+/* into symbols by longest match over the alphabet, as in apply      */
+FEXPORT long long fsm_word_to_index(struct fsm_word_index *wi, char *word);
+/* Word at index, or NULL if out of range; valid until the next call */
+FEXPORT char *fsm_index_to_word(struct fsm_word_index *wi, long long index);
+FEXPORT void fsm_word_index_clear(struct fsm_word_index *wi);
+
 #ifdef  __cplusplus
 }
 #endif
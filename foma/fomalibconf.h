@@ -95,7 +95,7 @@ struct apply_med_handle {
     int med_cutoff;
     int med_max_heap_size;
     int nodes_expanded;
-    int *cm;
+    struct medlookup *cm;
     char *word;
     char *instring;
     int instring_length;
@@ -109,6 +109,30 @@ struct apply_med_handle {
     struct fsm *net;
     struct fsm_state *curr_ptr;
     _Bool hascm;
+    int *path;
+    int path_size;
+    /* Parallel search: the master handle deals out the successors of the */
+    /* root node to its workers, which share its read-only tables        */
+    int threads;
+    int partitions;
+    int partition;
+    int root_children;
+    struct apply_med_handle **workers;
+    struct apply_med_handle *parent;
+    struct med_result {
+	char *instring;
+	char *outstring;
+	int cost;
+    } *results;
+    int numresults;
+    int results_size;
+    int currresult;
+};
+
+struct apply_tokens {
+    char *instring;
+    int length;
+    struct sigmatch_array *sigmatch;
 };
 
 struct apply_handle {
@@ -170,10 +194,14 @@ struct apply_handle {
     struct fsm *last_net;
     struct fsm_state *gstates;
     struct sigma *gsigma;
-    struct apply_state_index {
-	int fsmptr;
-	struct apply_state_index *next;
-    } **index_in, **index_out, *iptr;
+    struct apply_index {
+	int refcount;
+	int *state_slots;       /* [state], offset of its slots, -1 if not indexed */
+	int *slots;             /* [offset+symbol], start of the symbol's chain in arcs */
+	int *arcs;              /* Lines; a chain ends in -1 or in -(p+2) to go on at p */
+	int arcs_size;
+    } *index_in, *index_out;
+    int iptr;
 
     struct flag_list {
 	char *name;
@@ -190,7 +218,7 @@ struct apply_handle {
 
     struct searchstack {
 	int offset;
-	struct apply_state_index *iptr;
+	int iptr;
 	int state_has_index;
 	int opos;
 	int ipos;
@@ -199,6 +227,43 @@ struct apply_handle {
 	char *flagvalue;
 	int flagneg;
     } *searchstack ;
+
+    apply_result_callback callback;
+    void *callback_data;
+    int callback_results;
+    struct apply_symbol_view *views;
+    int views_size;
+
+    struct apply_cache *cache;
+    char *cache_buf;
+    size_t cache_bufsize;
+    size_t cache_pos;
+    int cache_count;
+    int cache_active;
+
+    struct apply_lazy *lazy;
+    int lazy_active;
+
+    char *batch_buf;
+    size_t batch_bufsize;
+
+    unsigned long long rng;
+    struct apply_sampler *sampler;
+    int sample_maxlen;
+    int *sample_path;
+    int sample_path_size;
+
+    struct apply_stats stats;
+
+    unsigned long long max_arcs;
+    int max_results;
+    int max_msec;
+    int limited;                    /* Limits hold for the current search */
+    int truncated;                  /* The current search hit a limit     */
+    unsigned long long limit_arcs;
+    int limit_results;
+    unsigned int limit_steps;
+    long long limit_start;
 };
 
 
@@ -236,21 +301,34 @@ int sort_cmp(const void *a, const void *b);
 int find_arccount(struct fsm_state *fsm);
 
 /* Internal int stack */
-int int_stack_isempty();
-int int_stack_isfull();
-void int_stack_clear();
-int int_stack_find (int entry);
-void int_stack_push(int c);
-int int_stack_pop();
-int int_stack_status();
-int int_stack_size();
+struct int_stack {
+    int *a;
+    int top;
+    int size;
+};
+
+struct int_stack *int_stack_init();
+void int_stack_free(struct int_stack *s);
+int int_stack_isempty(struct int_stack *s);
+void int_stack_clear(struct int_stack *s);
+int int_stack_find(struct int_stack *s, int entry);
+void int_stack_push(struct int_stack *s, int c);
+int int_stack_pop(struct int_stack *s);
+int int_stack_size(struct int_stack *s);
 
 /* Internal ptr stack */
-int ptr_stack_isempty();
-void ptr_stack_clear();
-void *ptr_stack_pop();
-int ptr_stack_isfull();
-void ptr_stack_push(void *ptr);
+struct ptr_stack {
+    void **a;
+    int top;
+    int size;
+};
+
+struct ptr_stack *ptr_stack_init();
+void ptr_stack_free(struct ptr_stack *s);
+int ptr_stack_isempty(struct ptr_stack *s);
+void ptr_stack_clear(struct ptr_stack *s);
+void ptr_stack_push(struct ptr_stack *s, void *ptr);
+void *ptr_stack_pop(struct ptr_stack *s);
 
 /* Sigma functions */
 FEXPORT int sigma_add (char *symbol, struct sigma *sigma);
@@ -260,6 +338,10 @@ FEXPORT struct sigma *sigma_remove(char *symbol, struct sigma *sigma);
 FEXPORT struct sigma *sigma_remove_num(int num, struct sigma *sigma);
 
 int sigma_find (char *symbol, struct sigma *sigma);
+int sigma_intern(char *symbol);
+int sigma_intern_lookup(char *symbol);
+char *sigma_intern_string(int id);
+int sigma_symbol_id(struct sigma *sigma);
 int sigma_find_number (int number, struct sigma *sigma);
 int sigma_substitute(char *orig, char *sub, struct sigma *sigma);
 FEXPORT char *sigma_string(int number, struct sigma *sigma);
@@ -297,4 +379,27 @@ void strip_newline(char *s);
 char *streqrep(char *s, char *oldstring, char *newstring);
 char *xxstrndup(const char *s, size_t n);
 int next_power_of_two(int v);
-unsigned int round_up_to_power_of_two(unsigned int v);
+
+/* Apply result cache */
+int apply_cache_find(struct apply_cache *c, int mode, char *key, char **buf, size_t *bufsize);
+void apply_cache_add(struct apply_cache *c, int mode, char *key, char *data, size_t datalen, int count);
+
+/* Lazy determinization for apply */
+int apply_lazy_prepare(struct apply_handle *h, int inout);
+int apply_lazy_live(struct apply_handle *h, int state, int pos);
+void apply_lazy_free(struct apply_lazy *l);
+
+/* Random numbers and path sampling for apply */
+unsigned int apply_random_next(struct apply_handle *h);
+int apply_sample_path(struct apply_handle *h);
+int apply_topsort_states(struct apply_handle *h, int states, int *order);
+void apply_sampler_free(struct apply_sampler *s);
+
+/* Sparse confusion matrix */
+int cmatrix_cost(struct medlookup *ml, int in, int out);
+void cmatrix_put(struct medlookup *ml, int in, int out, int cost);
+void cmatrix_import_dense(struct fsm *net, int *cm);
+
+/* Threads */
+int foma_num_cpus(void);
+void foma_parallel_run(void *(*func)(void *), void *args, size_t argsize, int nargs, int nthreads);
@@ -43,8 +43,12 @@ extern int g_minimize_hopcroft;
 extern int g_list_limit;
 extern int g_list_random_limit;
 extern int g_compose_tristate;
+extern int g_compose_minimize;
 extern int g_med_limit ;
 extern int g_med_cutoff ;
+extern int g_med_threads ;
+extern int g_write_threads ;
+extern int g_compression_level ;
 extern int g_lexc_align ;
 extern char *g_att_epsilon;
 
@@ -82,8 +86,12 @@ struct g_v {
     {&g_verbose,          "verbose",          FVAR_BOOL},
     {&g_minimize_hopcroft,"hopcroft-min",     FVAR_BOOL},
     {&g_compose_tristate, "compose-tristate", FVAR_BOOL},
+    {&g_compose_minimize, "compose-minimize", FVAR_BOOL},
     {&g_med_limit,        "med-limit",        FVAR_INT},
     {&g_med_cutoff,       "med-cutoff",       FVAR_INT},
+    {&g_med_threads,      "med-threads",      FVAR_INT},
+    {&g_write_threads,    "write-threads",    FVAR_INT},
+    {&g_compression_level, "compression-level", FVAR_INT},
     {&g_lexc_align,       "lexc-align",       FVAR_BOOL},
     {&g_att_epsilon,      "att-epsilon",      FVAR_STRING},
     {NULL, NULL, 0}
@@ -109,7 +117,7 @@ struct global_help {
     {"close sigma","removes unknown symbols from FSM","" },
     {"compact sigma","removes redundant symbols from FSM","" },
     {"complete net","completes the FSM","" },
-    {"compose net","composes networks on stack",""},
+    {"compose net","composes networks on stack","The whole stack is composed as one cascade, top network first\n"},
     {"concatenate","concatenates networks on stack","" },
     {"crossproduct net","cross-product of top two FSMs on stack","See ×\n" },
     {"define <name> <r.e.>","define a network","Example: \ndefine A x -> y;\n  and\nA = x -> y;\n\nare equivalent\n"},
@@ -198,6 +206,7 @@ struct global_help {
     {"view net","display top network (if supported)",""},
     {"zero-plus net","Kleene star on top fsm","See *\n"},
     {"variable compose-tristate","use the tristate composition algorithm","Default value: OFF\n"},
+    {"variable compose-minimize","minimize both arguments before composing them","Default value: ON\n"},
     {"variable show-flags","show flag diacritics in `apply'","Default value: ON\n"},
     {"variable obey-flags","obey flag diacritics in `apply'","Default value: ON\n"},
     {"variable minimal","minimize resulting FSMs","Default value: ON\n"},
@@ -210,6 +219,9 @@ struct global_help {
     {"variable hopcroft-min","ON = Hopcroft minimization, OFF = Brzozowski minimization","Default value: ON\n"},
     {"variable med-limit","the limit on number of matches in apply med","Default value: 3\n"},
     {"variable med-cutoff","the cost limit for terminating a search in apply med","Default value: 3\n"},
+    {"variable med-threads","the number of threads apply med splits its search over (0 = one per CPU)","Default value: 1\n"},
+    {"variable write-threads","the number of threads write words, write upper-words and write lower-words split their work over (0 = one per CPU); with more than one, the words are not written in order","Default value: 1\n"},
+    {"variable compression-level","zlib level for saved binary files (1-9, -1 = zlib default, 0 = uncompressed)","Default value: -1\n"},
     {"variable att-epsilon","the EPSILON symbol when reading/writing AT&T files","Default value: @0@\n"},
     {"variable lexc-align","Forces X:0 X:X of 0:X alignment of lexicon entry symbols","Default value: OFF\n"},
     {"write prolog (> filename)","writes top network to prolog format file/stdout","Short form: wpl"},
@@ -358,6 +370,7 @@ void iface_apply_med(char *word) {
     apply_med_set_heap_max(amedh,4194304+1);
     apply_med_set_med_limit(amedh,g_med_limit);
     apply_med_set_med_cutoff(amedh,g_med_cutoff);
+    apply_med_set_threads(amedh,g_med_threads);
 
     result = apply_med(amedh, word);
     if (result == NULL) {
@@ -508,13 +521,15 @@ void iface_complete() {
 
 
 void iface_compose() {
-    struct fsm *one, *two;
+    struct fsm **nets;
+    int i, n;
     if (iface_stack_check(2)) {
-        while (stack_size()>1) {
-	    one = stack_pop();
-	    two = stack_pop();
-	    stack_add(fsm_topsort(fsm_minimize(fsm_compose(one,two))));
-	}
+        n = stack_size();
+        nets = malloc(sizeof(struct fsm *) * n);
+        for (i = 0; i < n; i++)
+            nets[i] = stack_pop();
+        stack_add(fsm_topsort(fsm_minimize(fsm_compose_n(nets, n))));
+        free(nets);
     }
 }
 
@@ -615,16 +630,17 @@ void iface_load_defined(char *filename) {
 }
 
 void iface_load_stack(char *filename) {
-    struct fsm *net;
-    fsm_read_binary_handle fsrh;
+    struct fsm **nets;
+    int i, numnets;
 
-    if ((fsrh = fsm_read_binary_file_multiple_init(filename)) == NULL) {
+    if ((nets = fsm_read_binary_file_all(filename, &numnets)) == NULL) {
 	fprintf(stderr, "%s: ", filename);
         perror("File error");
         return;
     }
-    while ((net = fsm_read_binary_file_multiple(fsrh)) != NULL)
-        stack_add(net);
+    for (i = 0; i < numnets; i++)
+        stack_add(*(nets+i));
+    free(nets);
     return;
 }
 
@@ -719,7 +735,7 @@ void iface_print_net(char *netname, char *filename) {
 void iface_print_cmatrix_att(char *filename) {
     FILE *outfile;
     if (iface_stack_check(1)) {
-        if (stack_find_top()->fsm->medlookup == NULL || stack_find_top()->fsm->medlookup->confusion_matrix == NULL) {
+        if (stack_find_top()->fsm->medlookup == NULL) {
             printf("No confusion matrix defined.\n");
         } else {
             if (filename == NULL) {
@@ -735,7 +751,7 @@ void iface_print_cmatrix_att(char *filename) {
 
 void iface_print_cmatrix() {
     if (iface_stack_check(1)) {
-        if (stack_find_top()->fsm->medlookup == NULL || stack_find_top()->fsm->medlookup->confusion_matrix == NULL) {
+        if (stack_find_top()->fsm->medlookup == NULL) {
             printf("No confusion matrix defined.\n");
         } else {
             cmatrix_print(stack_find_top()->fsm);
@@ -1024,19 +1040,20 @@ void iface_save_defined(char *filename) {
 }
 
 void iface_save_stack(char *filename) {
-    gzFile outfile;
     struct stack_entry *stack_ptr;
+    struct fsm **nets;
+    int numnets;
 
     if (iface_stack_check(1)) {
-      if ((outfile = gzopen(filename, "wb")) == NULL) {
-            printf("Error opening file %s for writing.\n", filename);
-            return;
+        nets = malloc(sizeof(struct fsm *) * stack_size());
+        for (numnets = 0, stack_ptr = stack_find_bottom(); stack_ptr->next != NULL; stack_ptr = stack_ptr->next) {
+            *(nets+numnets++) = stack_ptr->fsm;
         }
         printf("Writing to file %s.\n", filename);
-        for (stack_ptr = stack_find_bottom(); stack_ptr->next != NULL; stack_ptr = stack_ptr->next) {
-            foma_net_print(stack_ptr->fsm, outfile);
+        if (fsm_write_binary_file_all(filename, nets, numnets) != 0) {
+            printf("Error writing file %s.\n", filename);
         }
-        gzclose(outfile);
+        free(nets);
         return;
     }
 }
@@ -1229,16 +1246,8 @@ void iface_view() {
 void iface_words_file(char *filename, int type) {
     /* type 0 (words), 1 (upper-words), 2 (lower-words) */
     FILE *outfile;
-    char *result;
-    static char *(*applyer)(struct apply_handle *h) = &apply_words;
     struct apply_handle *ah;
 
-    if (type == 1) {
-	applyer = &apply_upper_words;
-    }
-    if (type == 2) {
-	applyer = &apply_lower_words;
-    }
     if (iface_stack_check(1)) {
 	if (stack_find_top()->fsm->pathcount == PATHCOUNT_CYCLIC) {
 	    printf("FSM is cyclic: can't write all words to file.\n");
@@ -1251,13 +1260,9 @@ void iface_words_file(char *filename, int type) {
 	}
         ah = stack_get_ah();
 	iface_apply_set_params(ah);
-        for (;;) {
-            result = applyer(ah);
-            if (result == NULL)
-                break;
-            fprintf(outfile,"%s\n",result);
-        }
-        apply_reset_enumerator(ah);
+	if (apply_write_words(ah, outfile, type, g_write_threads) == -1) {
+	    printf("FSM is cyclic: can't write all words to file.\n");
+	}
 	fclose(outfile);
     }
 }
@@ -19,78 +19,90 @@
 #include <stdlib.h>
 #include "foma.h"
 
-#define MAX_STACK 2097152
-#define MAX_PTR_STACK 2097152
-
-static int a[MAX_STACK];
-static int top = -1;
-
-static void *ptr_stack[MAX_PTR_STACK];
-static int ptr_stack_top = -1;
-
-int ptr_stack_isempty() {
-    return ptr_stack_top == -1;
+/* Growable work stacks: each operation allocates its own, so there is */
+/* no size limit and no shared state between concurrent operations.    */
+/* Storage grows by doubling, starting from one chunk.                  */
+
+#define STACK_CHUNK 1024
+
+struct int_stack *int_stack_init() {
+    struct int_stack *s;
+    s = malloc(sizeof(struct int_stack));
+    s->size = STACK_CHUNK;
+    s->a = malloc(sizeof(int) * s->size);
+    s->top = -1;
+    return(s);
 }
 
-void ptr_stack_clear() {
-    ptr_stack_top = -1;
+void int_stack_free(struct int_stack *s) {
+    free(s->a);
+    free(s);
 }
 
-void *ptr_stack_pop() {
-    return ptr_stack[ptr_stack_top--];
+int int_stack_isempty(struct int_stack *s) {
+    return s->top == -1;
 }
 
-int ptr_stack_isfull() {
-    return (ptr_stack_top == (MAX_PTR_STACK - 1));
+void int_stack_clear(struct int_stack *s) {
+    s->top = -1;
 }
 
-void ptr_stack_push(void *ptr) {
-    if (ptr_stack_isfull()) {
-        fprintf(stderr, "Pointer stack full!\n");
-        exit(1);
+int int_stack_find(struct int_stack *s, int entry) {
+    int i;
+    for (i = 0; i <= s->top; i++) {
+        if (entry == s->a[i]) {
+            return 1;
+        }
     }
-    ptr_stack[++ptr_stack_top] = ptr;
+    return 0;
 }
 
+int int_stack_size(struct int_stack *s) {
+    return (s->top + 1);
+}
 
-int int_stack_isempty() {
-  return top == -1;
+void int_stack_push(struct int_stack *s, int c) {
+    if (s->top == s->size - 1) {
+        s->size *= 2;
+        s->a = realloc(s->a, sizeof(int) * s->size);
+    }
+    s->a[++s->top] = c;
 }
 
-void int_stack_clear() {
-  top = -1;
+int int_stack_pop(struct int_stack *s) {
+    return s->a[s->top--];
 }
 
-int int_stack_find (int entry) {
-  int i;
-  if (int_stack_isempty()) {
-    return 0;
-  }
-  for(i = 0; i <= top ; i++) {
-    if (entry == a[i]) {
-      return 1;
-    }
-  }
-  return 0;
+struct ptr_stack *ptr_stack_init() {
+    struct ptr_stack *s;
+    s = malloc(sizeof(struct ptr_stack));
+    s->size = STACK_CHUNK;
+    s->a = malloc(sizeof(void *) * s->size);
+    s->top = -1;
+    return(s);
 }
 
-int int_stack_size () {
-  return (top + 1);
+void ptr_stack_free(struct ptr_stack *s) {
+    free(s->a);
+    free(s);
 }
 
-void int_stack_push(int c) {
-  if (int_stack_isfull()) {
-    fprintf(stderr, "Stack full!\n");
-    exit(1);
-  }
-  a[++top] = c;
+int ptr_stack_isempty(struct ptr_stack *s) {
+    return s->top == -1;
 }
 
+void ptr_stack_clear(struct ptr_stack *s) {
+    s->top = -1;
+}
 
-int int_stack_pop() {
-  return a[top--];
+void ptr_stack_push(struct ptr_stack *s, void *ptr) {
+    if (s->top == s->size - 1) {
+        s->size *= 2;
+        s->a = realloc(s->a, sizeof(void *) * s->size);
+    }
+    s->a[++s->top] = ptr;
 }
 
-int int_stack_isfull() {
-  return (top == (MAX_STACK - 1));
+void *ptr_stack_pop(struct ptr_stack *s) {
+    return s->a[s->top--];
 }
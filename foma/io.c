@@ -43,20 +43,59 @@ struct binaryline {
 };
 
 extern char *g_att_epsilon;
+extern int g_compression_level;
+
+/* Binary files are read as a stream through a fixed-size buffer, */
+/* so memory use does not depend on the (uncompressed) file size  */
+
+#define IO_CHUNK_SIZE 65536
 
 struct io_buf_handle {
+    gzFile gzfile;
     char *io_buf;
     char *io_buf_ptr;
+    char *io_buf_end;
+    char *next_ptr;             /* Where to go on after a pushed-back buffer */
+    char *next_end;
 };
 
 struct io_buf_handle *io_init();
 void io_free(struct io_buf_handle *iobh);
 static int io_gets(struct io_buf_handle *iobh, char *target);
-static size_t io_get_gz_file_size(char *filename);
-static size_t io_get_file_size(char *filename);
-static size_t io_get_regular_file_size(char *filename);
-size_t io_gz_file_to_mem (struct io_buf_handle *iobh, char *filename);
+static int io_fill(struct io_buf_handle *iobh);
+int io_gz_file_open(struct io_buf_handle *iobh, char *filename);
+/* Nets are formatted into a buffer that is deflated whenever it fills */
+/* up.  Each net is deflated on its own into a raw stream that ends    */
+/* byte-aligned (Z_FULL_FLUSH), and such streams can simply be joined:  */
+/* a file is one gzip member whose CRC is combined from those of the   */
+/* nets, as older readers expect.  Nets are handled a batch of one per */
+/* thread at a time, so only that many are held in memory at once.    */
+
+#define IO_OUT_FLUSH_SIZE 1048576
+
+struct io_out_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+    z_stream *zs;               /* If not NULL, deflate into zout when full */
+    struct io_out_buf *zout;
+    uLong crc;                  /* CRC and length of the data deflated */
+    size_t total;
+};
+
+struct io_write_job {
+    struct fsm *net;
+    int level;
+    int last;
+    struct io_out_buf data;
+    uLong crc;
+    size_t total;
+};
+
 int foma_net_print(struct fsm *net, gzFile outfile);
+static void io_net_to_buf(struct fsm *net, struct io_out_buf *out);
+static int io_write_nets(FILE *outfile, struct fsm **nets, int numnets, int level);
+static void io_out_reserve(struct io_out_buf *out, size_t len);
 struct fsm *io_net_read(struct io_buf_handle *iobh, char **net_name);
 static INLINE int explode_line (char *buf, int *values);
 
@@ -383,12 +422,20 @@ struct fsm *fsm_read_prolog (char *filename) {
 struct io_buf_handle *io_init() {
     struct io_buf_handle *iobh;
     iobh = malloc(sizeof(struct io_buf_handle));
+    (iobh->gzfile) = NULL;
     (iobh->io_buf) = NULL;
     (iobh->io_buf_ptr) = NULL;
+    (iobh->io_buf_end) = NULL;
+    (iobh->next_ptr) = NULL;
+    (iobh->next_end) = NULL;
     return(iobh);
 }
 
 void io_free(struct io_buf_handle *iobh) {
+    if (iobh->gzfile != NULL) {
+        gzclose(iobh->gzfile);
+        (iobh->gzfile) = NULL;
+    }
     if (iobh->io_buf != NULL) {
         free(iobh->io_buf);
         (iobh->io_buf) = NULL;
@@ -507,13 +554,19 @@ struct fsm *fsm_read_text_file(char *filename) {
 }
 
 int fsm_write_binary_file(struct fsm *net, char *filename) {
-    gzFile outfile;
-    if ((outfile = gzopen(filename,"wb")) == NULL) {
+    return(fsm_write_binary_file_all(filename, &net, 1));
+}
+
+int fsm_write_binary_file_all(char *filename, struct fsm **nets, int numnets) {
+    FILE *outfile;
+    int ret;
+    if ((outfile = fopen(filename, "wb")) == NULL) {
 	return(1);
     }
-    foma_net_print(net, outfile);
-    gzclose(outfile);
-    return(0);
+    ret = io_write_nets(outfile, nets, numnets, g_compression_level);
+    if (fclose(outfile) != 0)
+        ret = 1;
+    return(ret);
 }
 
 struct fsm *fsm_read_binary_file_multiple(fsm_read_binary_handle fsrh) {
@@ -537,7 +590,7 @@ fsm_read_binary_handle fsm_read_binary_file_multiple_init(char *filename) {
     fsm_read_binary_handle fsm_read_handle;
 
     iobh = io_init();
-    if (io_gz_file_to_mem(iobh, filename) == 0) {
+    if (io_gz_file_open(iobh, filename) == 0) {
 	io_free(iobh);
 	return NULL;
     }
@@ -550,55 +603,256 @@ struct fsm *fsm_read_binary_file(char *filename) {
     struct fsm *net;
     struct io_buf_handle *iobh;
     iobh = io_init();
-    if (io_gz_file_to_mem(iobh, filename) == 0) {
+    if (io_gz_file_open(iobh, filename) == 0) {
 	io_free(iobh);
         return NULL;
     }
+    net_name = NULL;
     net = io_net_read(iobh, &net_name);
+    free(net_name);
     io_free(iobh);
     return(net);
 }
 
+/* Reads the first net of a binary file whose contents, gzipped or */
+/* not, are already in memory, as when the file comes over the net  */
+struct fsm *fsm_read_binary_mem(char *data, size_t len) {
+    struct io_buf_handle iobh;
+    struct fsm *net;
+    z_stream zs;
+    char *buf, *net_name;
+    size_t size;
+    int ret;
+
+    buf = NULL;
+    if (len >= 2 && (unsigned char) data[0] == 0x1f && (unsigned char) data[1] == 0x8b) {
+        memset(&zs, 0, sizeof(z_stream));
+        if (inflateInit2(&zs, 15 + 32) != Z_OK)
+            return NULL;
+        size = len * 4 + IO_CHUNK_SIZE;
+        buf = malloc(size);
+        zs.next_in = (unsigned char *) data;
+        zs.avail_in = len;
+        do {
+            if (zs.total_out == size) {
+                size *= 2;
+                buf = realloc(buf, size);
+            }
+            zs.next_out = (unsigned char *) buf + zs.total_out;
+            zs.avail_out = size - zs.total_out;
+            ret = inflate(&zs, Z_NO_FLUSH);
+        } while (ret == Z_OK);
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END) {
+            free(buf);
+            return NULL;
+        }
+        data = buf;
+        len = zs.total_out;
+    }
+    memset(&iobh, 0, sizeof(struct io_buf_handle));
+    iobh.io_buf_ptr = data;
+    iobh.io_buf_end = data + len;
+    net_name = NULL;
+    net = io_net_read(&iobh, &net_name);
+    free(net_name);
+    free(buf);
+    return(net);
+}
+
+/* Reading all the nets of a file at once: the file is streamed and  */
+/* cut into sections at each ##foma-net header.  A batch of sections, */
+/* one per thread, is read ahead and parsed in parallel, each through */
+/* its own in-memory handle.  A section that outgrows IO_SECTION_MAX  */
+/* is parsed straight from the stream instead, with what was read of  */
+/* it pushed back, so read-ahead stays bounded and a huge net is read */
+/* in as little memory as by the sequential reader.                   */
+
+#define IO_SECTION_MAX 16777216
+
+struct io_net_job {
+    struct io_out_buf text;
+    struct fsm *net;
+    char *name;
+};
+
+static void *io_net_read_job(void *arg) {
+    struct io_net_job *job;
+    struct io_buf_handle iobh;
+    job = arg;
+    memset(&iobh, 0, sizeof(struct io_buf_handle));
+    iobh.io_buf_ptr = job->text.buf;
+    iobh.io_buf_end = job->text.buf + job->text.len;
+    job->name = NULL;
+    job->net = io_net_read(&iobh, &job->name);
+    return NULL;
+}
+
+/* Read the next section into text, starting with the header line left */
+/* in line if *pending.  Returns 0 at the end of the file, 1 for a      */
+/* whole section, and 2 for one that reached IO_SECTION_MAX unfinished */
+
+static int io_read_section(struct io_buf_handle *iobh, struct io_out_buf *text, char *line, int *pending) {
+    int len;
+    text->len = 0;
+    for (;;) {
+        if (*pending) {
+            *pending = 0;
+            len = strlen(line);
+        } else {
+            if (iobh->io_buf_ptr == iobh->io_buf_end && io_fill(iobh) == 0)
+                return(text->len > 0);
+            len = io_gets(iobh, line);
+            if (text->len > 0 && strncmp(line, "##foma-net ", 11) == 0) {
+                *pending = 1;
+                return 1;
+            }
+        }
+        io_out_reserve(text, len + 1);
+        memcpy(text->buf + text->len, line, len);
+        text->len += len;
+        *(text->buf + text->len++) = '\n';
+        if (text->len > IO_SECTION_MAX)
+            return 2;
+    }
+}
+
+/* Like the sequential reader, stops at the first net that fails; */
+/* returns the number of nets read, or -1 if the file is unreadable */
+
+static int io_read_all(char *filename, struct fsm ***nets, char ***names) {
+    struct io_buf_handle *iobh;
+    struct io_net_job *jobs, *job;
+    struct fsm *net;
+    char *line, *name;
+    int i, status, pending, failed, nthreads, numnets, maxnets;
+
+    iobh = io_init();
+    if (io_gz_file_open(iobh, filename) == 0) {
+        io_free(iobh);
+        return -1;
+    }
+    nthreads = foma_num_cpus();
+    jobs = calloc(nthreads, sizeof(struct io_net_job));
+    line = malloc(READ_BUF_SIZE);
+    maxnets = 16;
+    *nets = malloc(sizeof(struct fsm *) * maxnets);
+    *names = malloc(sizeof(char *) * maxnets);
+    numnets = 0;
+    pending = 0;
+    for (status = 1, failed = 0; status != 0 && !failed; ) {
+        for (i = 0; i < nthreads && (status = io_read_section(iobh, &(jobs+i)->text, line, &pending)) == 1; i++) { }
+        foma_parallel_run(io_net_read_job, jobs, sizeof(struct io_net_job), i, nthreads);
+        if (status == 2) {
+            job = jobs+i;
+            iobh->next_ptr = iobh->io_buf_ptr;
+            iobh->next_end = iobh->io_buf_end;
+            iobh->io_buf_ptr = job->text.buf;
+            iobh->io_buf_end = job->text.buf + job->text.len;
+            job->name = NULL;
+            job->net = io_net_read(iobh, &job->name);
+            /* A net that ended before the end of the pushed-back */
+            /* part was broken; one may end right at its end       */
+            if (iobh->next_ptr != NULL && iobh->io_buf_ptr != iobh->io_buf_end && job->net != NULL) {
+                fsm_destroy(job->net);
+                job->net = NULL;
+            }
+            i++;
+            status = 1;
+        }
+        for (job = jobs; job < jobs + i; job++) {
+            net = job->net;
+            name = job->name;
+            if (net == NULL)
+                failed = 1;
+            if (failed) {
+                if (net != NULL)
+                    fsm_destroy(net);
+                free(name);
+                continue;
+            }
+            if (numnets == maxnets) {
+                maxnets *= 2;
+                *nets = realloc(*nets, sizeof(struct fsm *) * maxnets);
+                *names = realloc(*names, sizeof(char *) * maxnets);
+            }
+            *(*nets+numnets) = net;
+            *(*names+numnets) = name;
+            numnets++;
+        }
+    }
+    for (i = 0; i < nthreads; i++)
+        free((jobs+i)->text.buf);
+    free(jobs);
+    free(line);
+    io_free(iobh);
+    return(numnets);
+}
+
+struct fsm **fsm_read_binary_file_all(char *filename, int *numnets) {
+    struct fsm **nets;
+    char **names;
+    int i;
+    if ((*numnets = io_read_all(filename, &nets, &names)) < 0) {
+        *numnets = 0;
+        return NULL;
+    }
+    for (i = 0; i < *numnets; i++)
+        free(*(names+i));
+    free(names);
+    nets = realloc(nets, sizeof(struct fsm *) * (*numnets + 1));
+    *(nets+*numnets) = NULL;
+    return(nets);
+}
+
 int save_defined(struct defined_networks *def, char *filename) {
     struct defined_networks *d;
-    gzFile outfile;
+    struct fsm **nets;
+    FILE *outfile;
+    int numnets;
     if (def == NULL) {
         fprintf(stderr, "No defined networks.\n");
         return(0);
     }
-    if ((outfile = gzopen(filename, "wb")) == NULL) {
+    if ((outfile = fopen(filename, "wb")) == NULL) {
         printf("Error opening file %s for writing.\n", filename);
         return(-1);
     }
     printf("Writing definitions to file %s.\n", filename);
-    for (d = def; d != NULL; d = d->next) {
+    for (numnets = 0, d = def; d != NULL; d = d->next) {
+        numnets++;
+    }
+    nets = malloc(sizeof(struct fsm *) * numnets);
+    for (numnets = 0, d = def; d != NULL; d = d->next) {
         if (!d->net) {
             printf("Skipping definition without network.\n");
             continue;
         }
         strncpy(d->net->name, d->name, FSM_NAME_LEN);
-        foma_net_print(d->net, outfile);
+        *(nets+numnets++) = d->net;
     }
-    gzclose(outfile);
+    io_write_nets(outfile, nets, numnets, g_compression_level);
+    free(nets);
+    fclose(outfile);
     return(1);
 }
 
 int load_defined(struct defined_networks *def, char *filename) {
-    struct fsm *net;
-    char *net_name;
-    struct io_buf_handle *iobh;
+    struct fsm **nets;
+    char **names;
+    int i, numnets;
 
-    iobh = io_init();
     printf("Loading definitions from %s.\n",filename);
-    if (io_gz_file_to_mem(iobh, filename) == 0) {
+    if ((numnets = io_read_all(filename, &nets, &names)) < 0) {
         fprintf(stderr, "File error.\n");
-	io_free(iobh);
         return 0;
     }
-    while ((net = io_net_read(iobh, &net_name)) != NULL) {
-        add_defined(def, net, net_name);
+    for (i = 0; i < numnets; i++) {
+        add_defined(def, *(nets+i), *(names+i));
+        free(*(names+i));
     }
-    io_free(iobh);
+    free(nets);
+    free(names);
     return(1);
 }
 
@@ -631,6 +885,8 @@ static INLINE int explode_line(char *buf, int *values) {
 /* ...SIGMA LINES... */
 /* ##states## */
 /* ...TRANSITION LINES... */
+/* ##cmatrix-sparse## (optional) */
+/* ...CONFUSION MATRIX LINES... */
 /* ##end## */
 
 /* Several networks may be concatenated in one file */
@@ -667,6 +923,11 @@ static INLINE int explode_line(char *buf, int *values) {
 
 /* There is no harm in always using 5 fields; however this will take up more space */
 
+/* The optional confusion matrix section starts with a line giving the default */
+/* substitution, insertion and deletion costs, followed by "in out cost" lines */
+/* for the symbol pairs whose cost differs from the default. Older versions   */
+/* wrote a dense ##cmatrix## section of one cost per line, which is still read */
+
 /* As in struct fsm_state, states without transitions are represented as a 4-field: */
 /* state_no -1 -1 final_state (since in=out for 4-field lines, out = -1 as well) */
 
@@ -680,7 +941,7 @@ struct fsm *io_net_read(struct io_buf_handle *iobh, char **net_name) {
     struct fsm_state *fsm;
 
     char *new_symbol;
-    int i, items, new_symbol_number, laststate, lineint[5], *cm;
+    int i, items, new_symbol_number, laststate, lineint[5], *cm, maxsigma;
     int extras;
     char last_final = '1';
 
@@ -803,16 +1064,33 @@ struct fsm *io_net_read(struct io_buf_handle *iobh, char **net_name) {
         }
 
     }
-    if (strcmp(buf, "##cmatrix##") == 0) {
+    if (strcmp(buf, "##cmatrix-sparse##") == 0) {
+        /* Default substitute/insert/delete costs, then in out cost lines */
         cmatrix_init(net);
-        cm = net->medlookup->confusion_matrix;
+        io_gets(iobh, buf);
+        if (explode_line(buf, &lineint[0]) == 3) {
+            net->medlookup->substitute_cost = lineint[0];
+            net->medlookup->insert_cost = lineint[1];
+            net->medlookup->delete_cost = lineint[2];
+        }
         for (;;) {
             io_gets(iobh, buf);
             if (buf[0] == '#') break;
-            sscanf(buf,"%i", &i);
-            *cm = i;
-            cm++;
+            if (explode_line(buf, &lineint[0]) == 3)
+                cmatrix_put(net->medlookup, lineint[0], lineint[1], lineint[2]);
         }
+    } else if (strcmp(buf, "##cmatrix##") == 0) {
+        /* Dense matrix written by older versions */
+        maxsigma = sigma_max(net->sigma)+1;
+        cm = calloc(maxsigma*maxsigma, sizeof(int));
+        for (i = 0; ; i++) {
+            io_gets(iobh, buf);
+            if (buf[0] == '#') break;
+            if (i < maxsigma*maxsigma)
+                *(cm+i) = atoi(buf);
+        }
+        cmatrix_import_dense(net, cm);
+        free(cm);
     }
     if (strcmp(buf, "##end##") != 0) {
         printf("File format error!\n");
@@ -821,77 +1099,277 @@ struct fsm *io_net_read(struct io_buf_handle *iobh, char **net_name) {
     return(net);
 }
 
+/* Read the next line into target (at most READ_BUF_SIZE-1 bytes are kept), */
+/* refilling the buffer from the file as needed; returns the line length   */
+
 static int io_gets(struct io_buf_handle *iobh, char *target) {
     int i;
-    for (i = 0; *((iobh->io_buf_ptr)+i) != '\n' && *((iobh->io_buf_ptr)+i) != '\0'; i++) {
-        *(target+i) = *((iobh->io_buf_ptr)+i);
+    size_t len, copy;
+    char *nl;
+    for (i = 0; ; ) {
+        if (iobh->io_buf_ptr == iobh->io_buf_end && io_fill(iobh) == 0)
+            break;
+        nl = memchr(iobh->io_buf_ptr, '\n', iobh->io_buf_end - iobh->io_buf_ptr);
+        len = (nl != NULL ? nl : iobh->io_buf_end) - iobh->io_buf_ptr;
+        copy = len < (size_t) (READ_BUF_SIZE - 1 - i) ? len : (size_t) (READ_BUF_SIZE - 1 - i);
+        memcpy(target+i, iobh->io_buf_ptr, copy);
+        i += copy;
+        iobh->io_buf_ptr += len;
+        if (nl != NULL) {
+            iobh->io_buf_ptr++;
+            break;
+        }
     }
     *(target+i) = '\0';
-    if (*((iobh->io_buf_ptr)+i) == '\0')
-    (iobh->io_buf_ptr) = (iobh->io_buf_ptr) + i;
-    else
-        (iobh->io_buf_ptr) = (iobh->io_buf_ptr) + i + 1;
-
     return(i);
 }
 
-int foma_net_print(struct fsm *net, gzFile outfile) {
+static int io_fill(struct io_buf_handle *iobh) {
+    int numbytes;
+    /* Go on in the file buffer after a pushed-back one */
+    if (iobh->next_ptr != NULL) {
+        iobh->io_buf_ptr = iobh->next_ptr;
+        iobh->io_buf_end = iobh->next_end;
+        iobh->next_ptr = NULL;
+        if (iobh->io_buf_ptr < iobh->io_buf_end)
+            return(iobh->io_buf_end - iobh->io_buf_ptr);
+    }
+    numbytes = gzread(iobh->gzfile, iobh->io_buf, IO_CHUNK_SIZE);
+    if (numbytes < 0)
+        numbytes = 0;
+    iobh->io_buf_ptr = iobh->io_buf;
+    iobh->io_buf_end = iobh->io_buf + numbytes;
+    return(numbytes);
+}
+
+static void io_out_deflate(struct io_out_buf *out, int flush) {
+    struct io_out_buf *zout;
+    size_t avail;
+    int ret;
+    zout = out->zout;
+    out->crc = crc32(out->crc, (Bytef *) out->buf, out->len);
+    out->total += out->len;
+    out->zs->next_in = (Bytef *) out->buf;
+    out->zs->avail_in = out->len;
+    do {
+        if (zout->size - zout->len < 65536) {
+            zout->size = zout->size ? zout->size * 2 : IO_OUT_FLUSH_SIZE;
+            zout->buf = realloc(zout->buf, zout->size);
+        }
+        avail = (zout->size - zout->len) < (1U << 30) ? zout->size - zout->len : (1U << 30);
+        out->zs->next_out = (Bytef *) (zout->buf + zout->len);
+        out->zs->avail_out = avail;
+        ret = deflate(out->zs, flush);
+        zout->len += avail - out->zs->avail_out;
+    } while (ret != Z_STREAM_ERROR && (out->zs->avail_in > 0 || out->zs->avail_out == 0));
+    out->len = 0;
+}
+
+static void io_out_reserve(struct io_out_buf *out, size_t len) {
+    if (out->zs != NULL && out->len > 0 && out->len + len > IO_OUT_FLUSH_SIZE)
+        io_out_deflate(out, Z_NO_FLUSH);
+    if (out->len + len > out->size) {
+        while (out->len + len > out->size)
+            out->size = out->size ? out->size * 2 : READ_BUF_SIZE;
+        out->buf = realloc(out->buf, out->size);
+    }
+}
+
+static void io_out_string(struct io_out_buf *out, char *string) {
+    size_t len;
+    len = strlen(string);
+    io_out_reserve(out, len);
+    memcpy(out->buf + out->len, string, len);
+    out->len += len;
+}
+
+/* printf is too slow for the state lines */
+
+static INLINE void io_out_int(struct io_out_buf *out, int n, char sep) {
+    char digits[12];
+    unsigned int u;
+    int i;
+    io_out_reserve(out, 13);
+    if (n < 0) {
+        *(out->buf + out->len++) = '-';
+        u = -(unsigned int) n;
+    } else {
+        u = n;
+    }
+    i = 0;
+    do {
+        digits[i++] = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    while (i > 0)
+        *(out->buf + out->len++) = digits[--i];
+    *(out->buf + out->len++) = sep;
+}
+
+static void io_net_to_buf(struct fsm *net, struct io_out_buf *out) {
     struct sigma *sigma;
     struct fsm_state *fsm;
-    int i, maxsigma, laststate, *cm, extras;
+    struct medlookup *ml;
+    int i, laststate, extras;
+    char props[READ_BUF_SIZE];
 
     /* Header */
-    gzprintf(outfile, "%s","##foma-net 1.0##\n");
+    io_out_string(out, "##foma-net 1.0##\n");
 
     /* Properties */
-    gzprintf(outfile, "%s","##props##\n");
+    io_out_string(out, "##props##\n");
 
     extras = (net->is_completed) | (net->arcs_sorted_in << 2) | (net->arcs_sorted_out << 4);
 
-    gzprintf(outfile,
+    snprintf(props, READ_BUF_SIZE,
 	     "%i %i %i %i %i %lld %i %i %i %i %i %i %s\n", net->arity, net->arccount, net->statecount, net->linecount, net->finalcount, net->pathcount, net->is_deterministic, net->is_pruned, net->is_minimized, net->is_epsilon_free, net->is_loop_free, extras, net->name);
+    io_out_string(out, props);
 
     /* Sigma */
-    gzprintf(outfile, "%s","##sigma##\n");
+    io_out_string(out, "##sigma##\n");
     for (sigma = net->sigma; sigma != NULL && sigma->number != -1; sigma = sigma->next) {
-        gzprintf(outfile, "%i %s\n",sigma->number, sigma->symbol);
+        io_out_int(out, sigma->number, ' ');
+        io_out_string(out, sigma->symbol);
+        io_out_string(out, "\n");
     }
 
     /* State array */
     laststate = -1;
-    gzprintf(outfile, "%s","##states##\n");
+    io_out_string(out, "##states##\n");
     for (fsm = net->states; fsm->state_no !=-1; fsm++) {
         if (fsm->state_no != laststate) {
+            io_out_int(out, fsm->state_no, ' ');
+            io_out_int(out, fsm->in, ' ');
             if (fsm->in != fsm->out) {
-                gzprintf(outfile, "%i %i %i %i %i\n",fsm->state_no, fsm->in, fsm->out, fsm->target, fsm->final_state);
-            } else {
-                gzprintf(outfile, "%i %i %i %i\n",fsm->state_no, fsm->in, fsm->target, fsm->final_state);
+                io_out_int(out, fsm->out, ' ');
             }
+            io_out_int(out, fsm->target, ' ');
+            io_out_int(out, fsm->final_state, '\n');
         } else {
+            io_out_int(out, fsm->in, ' ');
             if (fsm->in != fsm->out) {
-                gzprintf(outfile, "%i %i %i\n", fsm->in, fsm->out, fsm->target);
-            } else {
-                gzprintf(outfile, "%i %i\n", fsm->in, fsm->target);
+                io_out_int(out, fsm->out, ' ');
             }
+            io_out_int(out, fsm->target, '\n');
         }
         laststate = fsm->state_no;
     }
     /* Sentinel for states */
-    gzprintf(outfile, "-1 -1 -1 -1 -1\n");
+    io_out_string(out, "-1 -1 -1 -1 -1\n");
 
     /* Store confusion matrix */
-    if (net->medlookup != NULL && net->medlookup->confusion_matrix != NULL) {
-
-        gzprintf(outfile, "%s","##cmatrix##\n");
-        cm = net->medlookup->confusion_matrix;
-        maxsigma = sigma_max(net->sigma)+1;
-        for (i=0; i < maxsigma*maxsigma; i++) {
-            gzprintf(outfile, "%i\n", *(cm+i));
+    if (net->medlookup != NULL) {
+        ml = net->medlookup;
+        io_out_string(out, "##cmatrix-sparse##\n");
+        io_out_int(out, ml->substitute_cost, ' ');
+        io_out_int(out, ml->insert_cost, ' ');
+        io_out_int(out, ml->delete_cost, '\n');
+        for (i = 0; i < ml->tablesize; i++) {
+            if ((ml->cells+i)->in == -1)
+                continue;
+            io_out_int(out, (ml->cells+i)->in, ' ');
+            io_out_int(out, (ml->cells+i)->out, ' ');
+            io_out_int(out, (ml->cells+i)->cost, '\n');
         }
     }
 
     /* End */
-    gzprintf(outfile, "%s","##end##\n");
+    io_out_string(out, "##end##\n");
+}
+
+static void *io_write_job(void *arg) {
+    struct io_write_job *job;
+    struct io_out_buf text;
+    z_stream zs;
+    job = arg;
+    memset(&text, 0, sizeof(struct io_out_buf));
+    memset(&job->data, 0, sizeof(struct io_out_buf));
+    /* Level 0 writes plain text, which gzopen also reads */
+    if (job->level != 0) {
+        memset(&zs, 0, sizeof(z_stream));
+        deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        text.zs = &zs;
+        text.zout = &job->data;
+        text.crc = crc32(0L, Z_NULL, 0);
+    }
+    io_net_to_buf(job->net, &text);
+    if (job->level == 0) {
+        job->data = text;
+    } else {
+        /* Only the last net closes the deflate stream */
+        io_out_deflate(&text, job->last ? Z_FINISH : Z_FULL_FLUSH);
+        deflateEnd(&zs);
+        job->crc = text.crc;
+        job->total = text.total;
+        free(text.buf);
+    }
+    return NULL;
+}
+
+static void io_put_le32(unsigned char *p, uLong n) {
+    p[0] = n & 0xff;
+    p[1] = (n >> 8) & 0xff;
+    p[2] = (n >> 16) & 0xff;
+    p[3] = (n >> 24) & 0xff;
+}
+
+/* Format and compress the nets a batch at a time, in parallel, */
+/* and write them in order as one gzip member                    */
+
+static int io_write_nets(FILE *outfile, struct fsm **nets, int numnets, int level) {
+    static unsigned char gzheader[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned char trailer[8];
+    struct io_write_job *jobs, *job;
+    uLong crc;
+    size_t total;
+    int i, batch, nthreads, ret;
+
+    if (numnets == 0)
+        return 0;
+    if (level < -1 || level > 9)
+        level = Z_DEFAULT_COMPRESSION;
+    ret = 0;
+    crc = crc32(0L, Z_NULL, 0);
+    total = 0;
+    if (level != 0 && fwrite(gzheader, 1, 10, outfile) != 10)
+        ret = 1;
+    nthreads = foma_num_cpus();
+    jobs = calloc(nthreads, sizeof(struct io_write_job));
+    for (batch = 0; batch < numnets; batch += nthreads) {
+        for (i = 0; i < nthreads && batch + i < numnets; i++) {
+            (jobs+i)->net = *(nets+batch+i);
+            (jobs+i)->level = level;
+            (jobs+i)->last = batch + i == numnets - 1;
+        }
+        foma_parallel_run(io_write_job, jobs, sizeof(struct io_write_job), i, nthreads);
+        for (job = jobs; job < jobs + i; job++) {
+            if (fwrite(job->data.buf, 1, job->data.len, outfile) != job->data.len)
+                ret = 1;
+            free(job->data.buf);
+            crc = crc32_combine(crc, job->crc, job->total);
+            total += job->total;
+        }
+    }
+    free(jobs);
+    if (level != 0) {
+        io_put_le32(trailer, crc);
+        io_put_le32(trailer + 4, total & 0xffffffffUL);
+        if (fwrite(trailer, 1, 8, outfile) != 8)
+            ret = 1;
+    }
+    return(ret);
+}
+
+int foma_net_print(struct fsm *net, gzFile outfile) {
+    struct io_out_buf text;
+    size_t pos, chunk;
+    memset(&text, 0, sizeof(struct io_out_buf));
+    io_net_to_buf(net, &text);
+    for (pos = 0; pos < text.len; pos += chunk) {
+        chunk = text.len - pos < (1U << 30) ? text.len - pos : (1U << 30);
+        gzwrite(outfile, text.buf + pos, chunk);
+    }
+    free(text.buf);
     return(1);
 }
 
@@ -920,71 +1398,16 @@ int net_print_att(struct fsm *net, FILE *outfile) {
     return(1);
 }
 
-static size_t io_get_gz_file_size(char *filename) {
-
-    FILE    *infile;
-    size_t    numbytes;
-    unsigned char bytes[4];
-    unsigned int ints[4], i;
-
-    /* The last four bytes in a .gz file shows the size of the uncompressed data */
-    infile = fopen(filename, "r");
-    fseek(infile, -4, SEEK_END);
-    fread(&bytes, 1, 4, infile);
-    fclose(infile);
-    for (i = 0 ; i < 4 ; i++) {
-        ints[i] = bytes[i];
-    }
-    numbytes = ints[0] | (ints[1] << 8) | (ints[2] << 16 ) | (ints[3] << 24);
-    return(numbytes);
-}
-
-static size_t io_get_regular_file_size(char *filename) {
-
-    FILE    *infile;
-    size_t    numbytes;
-
-    infile = fopen(filename, "r");
-    fseek(infile, 0L, SEEK_END);
-    numbytes = ftell(infile);
-    fclose(infile);
-    return(numbytes);
-}
-
+/* Open a (possibly gzipped) file for streaming; returns 0 if it */
+/* cannot be opened or is empty                                  */
 
-static size_t io_get_file_size(char *filename) {
-    gzFile FILE;
-    size_t size;
-    FILE = gzopen(filename, "r");
-    if (FILE == NULL) {
-        return(0);
-    }
-    if (gzdirect(FILE) == 1) {
-        gzclose(FILE);
-        size = io_get_regular_file_size(filename);
-    } else {
-        gzclose(FILE);
-        size = io_get_gz_file_size(filename);
-    }
-    return(size);
-}
-
-size_t io_gz_file_to_mem(struct io_buf_handle *iobh, char *filename) {
-
-    size_t size;
-    gzFile FILE;
-
-    size = io_get_file_size(filename);
-    if (size == 0) {
+int io_gz_file_open(struct io_buf_handle *iobh, char *filename) {
+    if ((iobh->gzfile = gzopen(filename, "rb")) == NULL) {
         return 0;
     }
-    (iobh->io_buf) = malloc((size+1)*sizeof(char));
-    FILE = gzopen(filename, "rb");
-    gzread(FILE, iobh->io_buf, size);
-    gzclose(FILE);
-    *((iobh->io_buf)+size) = '\0';
-    iobh->io_buf_ptr = iobh->io_buf;
-    return(size);
+    gzbuffer(iobh->gzfile, IO_CHUNK_SIZE);
+    iobh->io_buf = malloc(IO_CHUNK_SIZE);
+    return(io_fill(iobh) > 0);
 }
 
 typedef struct BOM {
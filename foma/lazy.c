@@ -0,0 +1,490 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <string.h>
+#include "foma.h"
+
+/* Lazy determinization for apply_up/apply_down on nondeterministic nets */
+
+/* Before the depth-first search of apply_net, the tokenized input is    */
+/* run through a subset construction of the net's input side that is     */
+/* built on demand: each subset state (the epsilon-closure of a set of   */
+/* states, sorted) and each transition out of it is created the first   */
+/* time some input needs it and kept in a cache for later words.  Flag   */
+/* diacritics count as epsilons here, which can only make the sets       */
+/* larger than what is really reachable.                                 */
+
+/* If the last subset has no final state, the word is rejected without   */
+/* any search.  Otherwise a backward pass over the subsets of the word   */
+/* finds, for every input position, the states from which the rest of    */
+/* the input can still be accepted, and apply_net never follows an arc   */
+/* into any other state.  So the search no longer backtracks out of dead */
+/* ends, while the output (and the order of the outputs) is unchanged.   */
+/* The exception is a net with epsilon cycles on the input side: there   */
+/* the loop check of apply_net depends on the marks left behind by the  */
+/* branches explored before, dead ends included, so for such nets only   */
+/* the early rejection is done.                                         */
+
+/* When the cache outgrows its memory limit it is flushed as a whole     */
+/* before the next word.                                                 */
+
+struct lazy_dstate {
+    int *states;
+    int numstates;
+    int final;
+    unsigned int hash;
+    int hnext;
+};
+
+struct lazy_trans {
+    int from;
+    int symbol;
+    int to;
+};
+
+struct apply_lazy {
+    size_t mem_limit;
+    size_t mem_used;
+    int direction;
+    int prune;
+    int start;
+    int numnetstates;
+
+    struct lazy_dstate *dstates;
+    int numdstates;
+    int dstates_size;
+    int *dhash;
+    int dhash_size;
+    struct lazy_trans *trans;
+    int numtrans;
+    int trans_size;
+
+    /* Scratch space for building sets */
+    int *work;
+    int *mark;
+    int *mark2;
+    int stamp;
+
+    /* Per word: subset state after each token, token number of each */
+    /* input position, and the live states at each token boundary     */
+    int *levels;
+    int *tokidx;
+    int *tokpos;
+    int word_size;
+    int *liveoff;
+    int *live;
+    int live_size;
+    int live_count;
+};
+
+static void lazy_flush(struct apply_lazy *l) {
+    int i;
+    for (i = 0; i < l->numdstates; i++)
+        free((l->dstates+i)->states);
+    l->numdstates = 0;
+    for (i = 0; i < l->dhash_size; i++)
+        *(l->dhash+i) = -1;
+    for (i = 0; i < l->trans_size; i++)
+        (l->trans+i)->from = -1;
+    l->numtrans = 0;
+    l->start = -1;
+    l->mem_used = sizeof(struct lazy_dstate) * l->dstates_size + sizeof(int) * l->dhash_size + sizeof(struct lazy_trans) * l->trans_size;
+}
+
+void apply_set_lazy(struct apply_handle *h, size_t mem_limit) {
+    struct apply_lazy *l;
+    int i;
+    if (h->lazy != NULL) {
+        apply_lazy_free(h->lazy);
+        h->lazy = NULL;
+    }
+    if (mem_limit == 0)
+        return;
+    l = calloc(1, sizeof(struct apply_lazy));
+    l->mem_limit = mem_limit;
+    l->numnetstates = h->last_net->statecount;
+    l->dstates_size = 64;
+    l->dstates = malloc(sizeof(struct lazy_dstate) * l->dstates_size);
+    l->dhash_size = 256;
+    l->dhash = malloc(sizeof(int) * l->dhash_size);
+    l->trans_size = 256;
+    l->trans = malloc(sizeof(struct lazy_trans) * l->trans_size);
+    l->work = malloc(sizeof(int) * (l->numnetstates + 1));
+    l->mark = calloc(l->numnetstates + 1, sizeof(int));
+    l->mark2 = calloc(l->numnetstates + 1, sizeof(int));
+    l->direction = -1;
+    for (i = 0; i < l->dhash_size; i++)
+        *(l->dhash+i) = -1;
+    lazy_flush(l);
+    h->lazy = l;
+}
+
+void apply_lazy_free(struct apply_lazy *l) {
+    lazy_flush(l);
+    free(l->dstates);
+    free(l->dhash);
+    free(l->trans);
+    free(l->work);
+    free(l->mark);
+    free(l->mark2);
+    free(l->levels);
+    free(l->tokidx);
+    free(l->tokpos);
+    free(l->liveoff);
+    free(l->live);
+    free(l);
+}
+
+static INLINE int lazy_label(struct apply_handle *h, struct fsm_state *line) {
+    return(h->lazy->direction == APPLY_INDEX_INPUT ? line->in : line->out);
+}
+
+static INLINE int lazy_is_epsilon(struct apply_handle *h, int label) {
+    return(label == EPSILON || (h->has_flags && (h->flag_lookup+label)->type));
+}
+
+/* Same test as apply_match_str for a token symbol */
+
+static INLINE int lazy_matches(int label, int symbol) {
+    return(label == symbol || ((label == IDENTITY || label == UNKNOWN) && symbol == IDENTITY));
+}
+
+static void lazy_reset_stamps(struct apply_lazy *l) {
+    int i;
+    for (i = 0; i <= l->numnetstates; i++)
+        *(l->mark+i) = *(l->mark2+i) = 0;
+    l->stamp = 0;
+}
+
+static int lazy_next_stamp(struct apply_lazy *l) {
+    if (l->stamp == 0x7fffffff - 1)
+        lazy_reset_stamps(l);
+    return(++l->stamp);
+}
+
+static int lazy_compare_int(const void *a, const void *b) {
+    return(*(const int *)a - *(const int *)b);
+}
+
+/* Close l->work[0..count) (all marked with stamp) under epsilon arcs, */
+/* sort it, and return the number of the subset state it forms         */
+
+static int lazy_intern(struct apply_handle *h, struct apply_lazy *l, int count, int stamp) {
+    struct fsm_state *line;
+    struct lazy_dstate *d;
+    unsigned int hash;
+    int i, s, final, id, *newhash;
+
+    for (i = 0, final = 0; i < count; i++) {
+        s = *(l->work+i);
+        for (line = h->gstates + *(h->statemap+s); line->state_no == s; line++) {
+            if (line->final_state == 1)
+                final = 1;
+            if (line->target == -1)
+                break;
+            if (lazy_is_epsilon(h, lazy_label(h, line)) && *(l->mark+line->target) != stamp) {
+                *(l->mark+line->target) = stamp;
+                *(l->work+count++) = line->target;
+            }
+        }
+    }
+    qsort(l->work, count, sizeof(int), lazy_compare_int);
+    for (i = 0, hash = 2166136261U; i < count; i++)
+        hash = (hash ^ (unsigned int) *(l->work+i)) * 16777619U;
+
+    for (id = *(l->dhash + (hash & (l->dhash_size - 1))); id != -1; id = (l->dstates+id)->hnext) {
+        d = l->dstates+id;
+        if (d->hash == hash && d->numstates == count && memcmp(d->states, l->work, sizeof(int) * count) == 0)
+            return(id);
+    }
+    if (l->numdstates == l->dstates_size) {
+        l->mem_used += sizeof(struct lazy_dstate) * l->dstates_size;
+        l->dstates_size *= 2;
+        l->dstates = realloc(l->dstates, sizeof(struct lazy_dstate) * l->dstates_size);
+    }
+    id = l->numdstates++;
+    d = l->dstates+id;
+    d->states = malloc(sizeof(int) * (count + 1));
+    memcpy(d->states, l->work, sizeof(int) * count);
+    d->numstates = count;
+    d->final = final;
+    d->hash = hash;
+    d->hnext = *(l->dhash + (hash & (l->dhash_size - 1)));
+    *(l->dhash + (hash & (l->dhash_size - 1))) = id;
+    l->mem_used += sizeof(int) * (count + 1);
+
+    if (l->numdstates > l->dhash_size) {
+        newhash = malloc(sizeof(int) * l->dhash_size * 2);
+        l->mem_used += sizeof(int) * l->dhash_size;
+        l->dhash_size *= 2;
+        for (i = 0; i < l->dhash_size; i++)
+            *(newhash+i) = -1;
+        for (i = 0; i < l->numdstates; i++) {
+            d = l->dstates+i;
+            d->hnext = *(newhash + (d->hash & (l->dhash_size - 1)));
+            *(newhash + (d->hash & (l->dhash_size - 1))) = i;
+        }
+        free(l->dhash);
+        l->dhash = newhash;
+    }
+    return(id);
+}
+
+static INLINE unsigned int lazy_trans_hash(int from, int symbol) {
+    return((unsigned int) from * 2654435761U ^ (unsigned int) symbol * 40503U);
+}
+
+static void lazy_add_trans(struct apply_lazy *l, int from, int symbol, int to) {
+    struct lazy_trans *old;
+    unsigned int i, mask;
+    int j, oldsize;
+    if ((l->numtrans + 1) * 2 > l->trans_size) {
+        old = l->trans;
+        oldsize = l->trans_size;
+        l->mem_used += sizeof(struct lazy_trans) * l->trans_size;
+        l->trans_size *= 2;
+        l->trans = malloc(sizeof(struct lazy_trans) * l->trans_size);
+        for (j = 0; j < l->trans_size; j++)
+            (l->trans+j)->from = -1;
+        mask = l->trans_size - 1;
+        for (j = 0; j < oldsize; j++) {
+            if ((old+j)->from == -1)
+                continue;
+            for (i = lazy_trans_hash((old+j)->from, (old+j)->symbol) & mask; (l->trans+i)->from != -1; i = (i+1) & mask) { }
+            *(l->trans+i) = *(old+j);
+        }
+        free(old);
+    }
+    mask = l->trans_size - 1;
+    for (i = lazy_trans_hash(from, symbol) & mask; (l->trans+i)->from != -1; i = (i+1) & mask) { }
+    (l->trans+i)->from = from;
+    (l->trans+i)->symbol = symbol;
+    (l->trans+i)->to = to;
+    l->numtrans++;
+}
+
+/* The subset state reached from dstate from on token symbol */
+
+static int lazy_step(struct apply_handle *h, struct apply_lazy *l, int from, int symbol) {
+    struct lazy_trans *t;
+    struct fsm_state *line;
+    unsigned int i, mask;
+    int j, s, count, stamp, *states, numstates, to;
+
+    mask = l->trans_size - 1;
+    for (i = lazy_trans_hash(from, symbol) & mask; (t = l->trans+i)->from != -1; i = (i+1) & mask) {
+        if (t->from == from && t->symbol == symbol)
+            return(t->to);
+    }
+    stamp = lazy_next_stamp(l);
+    states = (l->dstates+from)->states;
+    numstates = (l->dstates+from)->numstates;
+    for (j = 0, count = 0; j < numstates; j++) {
+        s = *(states+j);
+        for (line = h->gstates + *(h->statemap+s); line->state_no == s && line->target != -1; line++) {
+            if (lazy_matches(lazy_label(h, line), symbol) && *(l->mark+line->target) != stamp) {
+                *(l->mark+line->target) = stamp;
+                *(l->work+count++) = line->target;
+            }
+        }
+    }
+    to = lazy_intern(h, l, count, stamp);
+    lazy_add_trans(l, from, symbol, to);
+    return(to);
+}
+
+/* Mark (in mark with stamp) the states of dstate d that can reach a */
+/* state already so marked through epsilon arcs                      */
+
+static void lazy_close_live(struct apply_handle *h, struct apply_lazy *l, struct lazy_dstate *d, int *mark, int stamp) {
+    struct fsm_state *line;
+    int j, s, changed;
+    do {
+        changed = 0;
+        for (j = 0; j < d->numstates; j++) {
+            s = *(d->states+j);
+            if (*(mark+s) == stamp)
+                continue;
+            for (line = h->gstates + *(h->statemap+s); line->state_no == s && line->target != -1; line++) {
+                if (lazy_is_epsilon(h, lazy_label(h, line)) && *(mark+line->target) == stamp) {
+                    *(mark+s) = stamp;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+}
+
+/* Is there a cycle of epsilon (or flag) arcs on the input side? */
+
+static int lazy_has_epsilon_cycle(struct apply_handle *h, struct apply_lazy *l) {
+    struct fsm_state *line;
+    int i, s, sp, cycle, *colour, *cursor;
+    colour = calloc(l->numnetstates + 1, sizeof(int));
+    cursor = malloc(sizeof(int) * (l->numnetstates + 1));
+    for (i = 0, cycle = 0; i < l->numnetstates && !cycle; i++) {
+        if (*(colour+i) != 0)
+            continue;
+        /* Iterative DFS: work holds the states, cursor the next line of each */
+        *(l->work) = i;
+        *(cursor) = *(h->statemap+i);
+        *(colour+i) = 1;
+        for (sp = 1; sp > 0 && !cycle; ) {
+            s = *(l->work+sp-1);
+            line = h->gstates + *(cursor+sp-1);
+            if (line->state_no != s || line->target == -1) {
+                *(colour+s) = 2;
+                sp--;
+                continue;
+            }
+            (*(cursor+sp-1))++;
+            if (!lazy_is_epsilon(h, lazy_label(h, line)))
+                continue;
+            if (*(colour+line->target) == 1) {
+                cycle = 1;
+            } else if (*(colour+line->target) == 0) {
+                *(colour+line->target) = 1;
+                *(l->work+sp) = line->target;
+                *(cursor+sp) = *(h->statemap+line->target);
+                sp++;
+            }
+        }
+    }
+    free(colour);
+    free(cursor);
+    return(cycle);
+}
+
+/* Run the word in h->sigmatch_array through the subset construction and */
+/* compute the live states; inout is the side the input is matched on   */
+/* (APPLY_INDEX_INPUT or APPLY_INDEX_OUTPUT); returns 0 if the word      */
+/* cannot be accepted, 1 if apply_lazy_live can be used to prune the     */
+/* search, and 2 if the search has to go ahead unpruned                  */
+
+int apply_lazy_prepare(struct apply_handle *h, int inout) {
+    struct apply_lazy *l;
+    struct lazy_dstate *d;
+    struct fsm_state *line;
+    int inlen, pos, k, n, j, s, stamp, nextstamp, *mark, *nextmark, *tmp, symbol, count;
+
+    l = h->lazy;
+    if (l->direction != inout || l->mem_used > l->mem_limit) {
+        lazy_flush(l);
+        if (l->direction != inout) {
+            l->direction = inout;
+            l->prune = !lazy_has_epsilon_cycle(h, l);
+        }
+    }
+    if (l->start == -1) {
+        stamp = lazy_next_stamp(l);
+        *(l->work) = 0;
+        *(l->mark) = stamp;
+        l->start = lazy_intern(h, l, 1, stamp);
+    }
+
+    inlen = h->current_instring_length;
+    if (inlen + 2 > l->word_size) {
+        l->word_size = inlen + 2;
+        l->levels = realloc(l->levels, sizeof(int) * l->word_size);
+        l->tokidx = realloc(l->tokidx, sizeof(int) * l->word_size);
+        l->tokpos = realloc(l->tokpos, sizeof(int) * l->word_size);
+        l->liveoff = realloc(l->liveoff, sizeof(int) * l->word_size);
+    }
+
+    /* Forward */
+    *(l->levels) = l->start;
+    for (pos = 0, k = 0; pos < inlen; pos += (h->sigmatch_array+pos)->consumes, k++) {
+        *(l->tokidx+pos) = k;
+        *(l->tokpos+k) = pos;
+        *(l->levels+k+1) = lazy_step(h, l, *(l->levels+k), (h->sigmatch_array+pos)->signumber);
+        if ((l->dstates + *(l->levels+k+1))->numstates == 0)
+            return 0;
+    }
+    *(l->tokidx+inlen) = n = k;
+    if (!(l->dstates + *(l->levels+n))->final)
+        return 0;
+    if (!l->prune)
+        return 2;
+
+    /* Backward: live states at each token boundary, stored sorted */
+    for (k = 0, count = 0; k <= n; k++)
+        count += (l->dstates + *(l->levels+k))->numstates;
+    if (count > l->live_size) {
+        l->live_size = count;
+        l->live = realloc(l->live, sizeof(int) * l->live_size);
+    }
+    l->live_count = count;
+    /* Both mark arrays stay in use across the pass */
+    if (l->stamp >= 0x7fffffff - 2 - n)
+        lazy_reset_stamps(l);
+    mark = l->mark;
+    nextmark = l->mark2;
+    nextstamp = 0;
+    for (k = n, pos = count; k >= 0; k--) {
+        d = l->dstates + *(l->levels+k);
+        stamp = lazy_next_stamp(l);
+        for (j = 0; j < d->numstates; j++) {
+            s = *(d->states+j);
+            line = h->gstates + *(h->statemap+s);
+            if (k == n) {
+                if (line->final_state == 1)
+                    *(mark+s) = stamp;
+                continue;
+            }
+            symbol = (h->sigmatch_array + *(l->tokpos+k))->signumber;
+            for ( ; line->state_no == s && line->target != -1; line++) {
+                if (*(nextmark+line->target) == nextstamp && lazy_matches(lazy_label(h, line), symbol)) {
+                    *(mark+s) = stamp;
+                    break;
+                }
+            }
+        }
+        lazy_close_live(h, l, d, mark, stamp);
+        for (j = d->numstates - 1; j >= 0; j--) {
+            if (*(mark + *(d->states+j)) == stamp)
+                *(l->live + --pos) = *(d->states+j);
+        }
+        *(l->liveoff+k) = pos;
+        tmp = mark; mark = nextmark; nextmark = tmp;
+        nextstamp = stamp;
+    }
+    return 1;
+}
+
+/* Is state live after consuming the input up to position pos? */
+
+int apply_lazy_live(struct apply_handle *h, int state, int pos) {
+    struct apply_lazy *l;
+    int k, lo, hi, mid, *live;
+    l = h->lazy;
+    k = *(l->tokidx+pos);
+    live = l->live + *(l->liveoff+k);
+    lo = 0;
+    hi = (k == *(l->tokidx+h->current_instring_length) ? l->live_count : *(l->liveoff+k+1)) - *(l->liveoff+k) - 1;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (*(live+mid) == state)
+            return 1;
+        if (*(live+mid) < state)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <string.h>
+#include "foma.h"
+
+/* Entry points of the lookup-only WebAssembly runtime (target      */
+/* foma-lookup).  It links the static library, of which the linker  */
+/* only keeps what these reach: the binary loader, apply and flags. */
+/* The caller copies a binary file into memory, loads it, and then  */
+/* applies words in batches given as one buffer of '\0'-terminated  */
+/* strings; see lookup.js for the JavaScript side.                  */
+
+struct apply_handle *foma_lookup_load(char *data, int len) {
+    struct fsm *net;
+    if ((net = fsm_read_binary_mem(data, (size_t) len)) == NULL)
+	return NULL;
+    return(apply_init(net));
+}
+
+/* Applies nwords words packed in words, up if up is nonzero, else    */
+/* down; returns the results as apply_down_batch()/apply_up_batch() do */
+char *foma_lookup_batch(struct apply_handle *h, int up, char *words, int nwords, int *counts, int *len) {
+    char **wordv, *result;
+    size_t rlen;
+    int i;
+
+    wordv = malloc(sizeof(char *) * (nwords + 1));
+    for (i = 0; i < nwords; i++) {
+	wordv[i] = words;
+	words += strlen(words) + 1;
+    }
+    if (up)
+	result = apply_up_batch(h, wordv, nwords, counts, &rlen);
+    else
+	result = apply_down_batch(h, wordv, nwords, counts, &rlen);
+    free(wordv);
+    *len = (int) rlen;
+    return(result);
+}
+
+void foma_lookup_free(struct apply_handle *h) {
+    struct fsm *net;
+    net = h->last_net;
+    apply_clear(h);
+    fsm_destroy(net);
+}
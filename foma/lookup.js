@@ -0,0 +1,63 @@
+// JavaScript side of the lookup-only runtime (target foma-lookup), appended
+// to the generated module with --post-js.  A net is loaded from the bytes
+// of a foma binary file, gzipped or not, and words are applied to it a
+// batch at a time, the whole batch crossing into the module in one call.
+//
+//   FomaLookup().then(function (foma) {
+//       var net = foma.load(bytes);                // Uint8Array
+//       var res = foma.applyDown(net, ['cat+N+Pl', 'dog+N+Sg']);
+//       // res[i] is the array of outputs of the i-th word
+//       foma.unload(net);
+//   });
+
+Module['load'] = function (bytes) {
+    var data = Module._malloc(bytes.length);
+    HEAPU8.set(bytes, data);
+    var handle = Module._foma_lookup_load(data, bytes.length);
+    Module._free(data);
+    if (handle === 0) {
+        throw new Error('foma: not a binary net');
+    }
+    return handle;
+};
+
+function fomaLookupBatch(handle, up, words) {
+    var size = 0, i, j, pos;
+    for (i = 0; i < words.length; i++) {
+        size += lengthBytesUTF8(words[i]) + 1;
+    }
+    var packed = Module._malloc(size + 1);
+    var counts = Module._malloc(4 * words.length + 4);
+    var len = Module._malloc(4);
+    for (i = 0, pos = packed; i < words.length; i++) {
+        stringToUTF8(words[i], pos, size + 1 - (pos - packed));
+        pos += lengthBytesUTF8(words[i]) + 1;
+    }
+    var result = Module._foma_lookup_batch(handle, up, packed, words.length, counts, len);
+    var answers = [];
+    for (i = 0, pos = result; i < words.length; i++) {
+        var outputs = [];
+        for (j = HEAP32[(counts >> 2) + i]; j > 0; j--) {
+            var output = UTF8ToString(pos);
+            outputs.push(output);
+            pos += lengthBytesUTF8(output) + 1;
+        }
+        answers.push(outputs);
+    }
+    Module._free(packed);
+    Module._free(counts);
+    Module._free(len);
+    return answers;
+}
+
+Module['applyDown'] = function (handle, words) {
+    return fomaLookupBatch(handle, 0, words);
+};
+
+Module['applyUp'] = function (handle, words) {
+    return fomaLookupBatch(handle, 1, words);
+};
+
+Module['unload'] = function (handle) {
+    Module._foma_lookup_free(handle);
+};
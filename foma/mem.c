@@ -35,10 +35,14 @@ int g_sort_arcs = 1;
 int g_verbose = 1;
 int g_minimize_hopcroft = 1;
 int g_compose_tristate = 0;
+int g_compose_minimize = 1;
 int g_list_limit = 100;
 int g_list_random_limit = 15;
 int g_med_limit  = 3;
 int g_med_cutoff = 15;
+int g_med_threads = 1;
+int g_write_threads = 1;
+int g_compression_level = -1;
 int g_lexc_align = 0;
 char *g_att_epsilon = "@0@";
 
@@ -61,14 +65,3 @@ int next_power_of_two(int v) {
         v = v >> 1;
     return (1 << i);
 }
-
-unsigned int round_up_to_power_of_two(unsigned int v) {
-    v--;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    v |= v >> 16;
-    v++;
-    return(v);
-}
@@ -63,6 +63,10 @@ foma_apply_down = foma.apply_down
 foma_apply_down.restype = c_char_p
 foma_apply_up = foma.apply_up
 foma_apply_up.restype = c_char_p
+foma_apply_down_batch = foma.apply_down_batch
+foma_apply_down_batch.restype = c_void_p
+foma_apply_up_batch = foma.apply_up_batch
+foma_apply_up_batch.restype = c_void_p
 foma_apply_set_space_symbol = foma.apply_set_space_symbol
 foma_fsm_count = foma.fsm_count
 foma_fsm_topsort = foma.fsm_topsort
@@ -218,23 +222,33 @@ class FST(object):
                 raise ValueError("Syntax error in regex")
         else:
             self.fsthandle = None
-        self.getitemapplyer = None
+        self.applyers = {}
+
+    def _applyer(self, key):
+        """Returns the apply handle cached under key, creating it on first use.
+           Handles live as long as the FST, so apply_init() runs once per key."""
+        if not self.fsthandle:
+            raise ValueError('FST not defined')
+        applyers = self.__dict__.setdefault('applyers', {})
+        if key not in applyers:
+            applyers[key] = foma_apply_init(self.fsthandle)
+            if key[1]:
+                foma_apply_set_space_symbol(c_void_p(applyers[key]), c_char_p(b'\x07'))
+        return applyers[key]
+
+    def _clear_applyers(self):
+        """Frees the cached apply handles; needed whenever fsthandle changes."""
+        for handle in self.__dict__.get('applyers', {}).values():
+            foma_apply_clear(c_void_p(handle))
+        self.applyers = {}
 
     def __getitem__(self, key):
         if not self.fsthandle:
             raise KeyError('FST not defined')
-        if not self.getitemapplyer:
-            self.getitemapplyer = foma_apply_init(self.fsthandle)
-        result = []
-        output = foma_apply_down(c_void_p(self.getitemapplyer), c_char_p(self.encode(key)))
-        while True:
-            if output == None:
-                return result
-            else:
-                result.append(output)
-                output = foma_apply_down(c_void_p(self.getitemapplyer), None)
-            
+        return [self.encode(w) for w in self._applyword(foma_apply_down, key)]
+
     def __del__(self):
+        self._clear_applyers()
         if self.fsthandle:
             foma_fsm_destroy(self.fsthandle)
 
@@ -254,6 +268,7 @@ class FST(object):
     def __len__(self):
         if self.fsthandle:
             if self.fsthandle.contents.pathcount == -3: # UNKNOWN
+                self._clear_applyers()
                 self.fsthandle = foma_fsm_topsort(self.fsthandle)
             if self.fsthandle.contents.pathcount == -1: # CYCLIC
                 raise ValueError("FSM is cyclic")
@@ -297,12 +312,7 @@ class FST(object):
         return not(self.__eq__(other))
 
     def __contains__(self, word):
-        af = self.apply_down(word)
-        try:
-            i = af.next()
-            return True
-        except StopIteration:
-            return False
+        return len(self._applyword(foma_apply_down, word)) > 0
                 
     def __call__(self, other):
         if isinstance(other, FST.string_type):
@@ -318,9 +328,42 @@ class FST(object):
     def __iter__(self):
         return self._apply(foma_apply_upper_words, word = None, tokenize = False)
     
+    def _applyword(self, applyf, word, tokenize = False):
+        """Applies one word with the cached handle of applyf and returns
+           all results as a list, so that interleaved calls can't clash."""
+        applyerhandle = c_void_p(self._applyer((applyf.__name__, tokenize)))
+        result = []
+        output = applyf(applyerhandle, c_char_p(self.encode(word)))
+        while output is not None:
+            if tokenize:
+                result.append(self.decode(output)[:-1].split('\x07'))
+            else:
+                result.append(self.decode(output))
+            output = applyf(applyerhandle, None)
+        return result
+
+    def _applybatch(self, batchf, key, words):
+        """Applies a list of words in one native call."""
+        applyerhandle = c_void_p(self._applyer(key))
+        words = [self.encode(w) for w in words]
+        counts = (c_int * len(words))()
+        length = c_size_t(0)
+        buf = batchf(applyerhandle, (c_char_p * len(words))(*words), c_int(len(words)), counts, byref(length))
+        outputs = self.decode(string_at(buf, length.value)).split('\0') if length.value else []
+        result, pos = [], 0
+        for count in counts:
+            result.append(outputs[pos:pos+count])
+            pos += count
+        return result
+
     def _apply(self, applyf, word = None, tokenize = False):
         if not self.fsthandle:
             raise ValueError('FST not defined')
+        if word is not None:
+            return iter(self._applyword(applyf, word, tokenize))
+        return self._enumerate(applyf, tokenize)
+
+    def _enumerate(self, applyf, tokenize = False, word = None):
         applyerhandle = foma_apply_init(self.fsthandle)
         if tokenize:
             toksym = '\x07'
@@ -361,6 +404,16 @@ class FST(object):
         else:
             raise ValueError('Undefined FST')
 
+    def apply_down_batch(self, words):
+        """Applies down every word of a list in one call; returns a list
+           holding the list of results of each word."""
+        return self._applybatch(foma_apply_down_batch, (foma_apply_down.__name__, False), words)
+
+    def apply_up_batch(self, words):
+        """Applies up every word of a list in one call; returns a list
+           holding the list of results of each word."""
+        return self._applybatch(foma_apply_up_batch, (foma_apply_up.__name__, False), words)
+
     def _fomacallunary(self, func, minimize = True):
         if self.fsthandle:
             handle = func(foma_fsm_copy(self.fsthandle))
@@ -26,6 +26,22 @@ def test_apply_down(eat_fst):
     assert result == 'eats'
 
 
+def test_apply_repeated(eat_fst):
+    for i in range(3):
+        result, = eat_fst.apply_up('ate')
+        assert result == 'eat+V+Past'
+        result, = eat_fst.apply_down('eat+V+Past')
+        assert result == 'ate'
+
+
+def test_apply_batch(eat_fst):
+    results = eat_fst.apply_up_batch(['ate', 'xyz', 'ate'])
+    assert results == [['eat+V+Past'], [], ['eat+V+Past']]
+    results = eat_fst.apply_down_batch(['eat+V+3P+Sg', 'eat+V+Past'])
+    assert results == [['eats'], ['ate']]
+    assert eat_fst.apply_up_batch([]) == []
+
+
 @pytest.fixture
 def eat_fst():
     return FST.load('ate.fsm')
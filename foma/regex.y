@@ -195,17 +195,55 @@ void add_rule(struct fsm *L, struct fsm *R, struct fsm *R2, int type) {
     }
 }
 
+/* A .o. B .o. C ... is collected and composed in one go by fsm_compose_n() */
+struct compose_chain {
+    struct fsm **nets;
+    int count;
+    int size;
+};
+
+struct compose_chain *compose_chain_add(struct compose_chain *chain, struct fsm *net) {
+    if (chain == NULL) {
+        chain = malloc(sizeof(struct compose_chain));
+        chain->count = 0;
+        chain->size = 4;
+        chain->nets = malloc(sizeof(struct fsm *) * chain->size);
+    }
+    if (chain->count == chain->size) {
+        chain->size *= 2;
+        chain->nets = realloc(chain->nets, sizeof(struct fsm *) * chain->size);
+    }
+    chain->nets[chain->count++] = net;
+    return(chain);
+}
+
+struct fsm *compose_chain_done(struct compose_chain *chain) {
+    struct fsm *net;
+    net = fsm_compose_n(chain->nets, chain->count);
+    free(chain->nets);
+    free(chain);
+    return(net);
+}
+
+void compose_chain_destroy(struct compose_chain *chain) {
+    int i;
+    for (i = 0; i < chain->count; i++)
+        fsm_destroy(chain->nets[i]);
+    free(chain->nets);
+    free(chain);
+}
 
 %}
 
 %union {
      char *string;
      struct fsm *net;
+     struct compose_chain *chain;
      int  type;
 }
 
 %define api.pure full
-%expect 686
+%expect 687
 %parse-param { void *scanner }
 %parse-param { struct defined_networks *defined_nets }
 %parse-param { struct defined_functions *defined_funcs } /* Assume yyparse is called with this argument */
@@ -241,6 +279,7 @@ void add_rule(struct fsm *L, struct fsm *R, struct fsm *R2, int type) {
 
 %token <type> ARROW DIRECTION
 
+%type <chain> composition
 %type <net> network networkA n0 network1 network2 network3 network4 network5 network6 network7 network8 network9 network10 network11 network12 fstart fmid fend sub1 sub2
 
 %left COMPOSE CROSS_PRODUCT HIGH_CROSS_PRODUCT COMMA SHUFFLE PRECEDES FOLLOWS LENIENT_COMPOSE
@@ -250,6 +289,7 @@ void add_rule(struct fsm *L, struct fsm *R, struct fsm *R2, int type) {
 %left TERM_NEGATION
 
 %destructor { fsm_destroy($$); } <net>
+%destructor { compose_chain_destroy($$); } <chain>
 
 /* Regular expression grammar */
 %%
@@ -261,10 +301,13 @@ regex:
 network END                        { current_parse = $1;              }
 
 network: networkA { }
-| network COMPOSE networkA         { $$ = fsm_compose($1,$3);         }
+| composition                      { $$ = compose_chain_done($1);     }
 | network LENIENT_COMPOSE networkA { $$ = fsm_lenient_compose($1,$3); }
 | network CROSS_PRODUCT networkA   { $$ = fsm_cross_product($1,$3);   }
 
+composition: network COMPOSE networkA { $$ = compose_chain_add(compose_chain_add(NULL,$1),$3); }
+| composition COMPOSE networkA     { $$ = compose_chain_add($1,$3);   }
+
 networkA: n0 { if (rewrite) { add_rewrite_rule(); $$ = fsm_rewrite(rewrite_rules); clear_rewrite_ruleset(rewrite_rules); } rewrite = 0; contexts = NULL; rules = NULL; rewrite_rules = NULL; }
 
 n0: network1 { }
@@ -0,0 +1,257 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "foma.h"
+
+/* Uniform random sampling of the accepting paths of a net */
+
+/* Every state gets the number of accepting paths that leave it, and a  */
+/* path is drawn by stopping in a final state or following an arc in   */
+/* proportion to these counts, which makes every accepting path of the */
+/* net equally likely.  In an acyclic net the counts are exact and     */
+/* each line stores the cumulative probability of stopping or taking   */
+/* one of the arcs up to and including it, so that an arc is found by  */
+/* binary search.  A cyclic net has infinitely many paths: there, the  */
+/* paths are bounded by maxlen arcs and counted for every remaining    */
+/* length 0..maxlen.  Counts are kept as logarithms, since they easily */
+/* exceed the range of a double.  Epsilon and flag arcs are arcs like  */
+/* any other, so the samples are uniform over paths, not strings.      */
+
+#define DEFAULT_SAMPLE_MAXLEN 20
+
+struct apply_sampler {
+    int states;
+    int lines;
+    int maxlen;               /* 0 for acyclic nets                   */
+    double *logcount;         /* [state] or [state*(maxlen+1)+length] */
+    double *cum;              /* [line], acyclic nets only            */
+};
+
+/* xorshift64* */
+unsigned int apply_random_next(struct apply_handle *h) {
+    h->rng ^= h->rng >> 12;
+    h->rng ^= h->rng << 25;
+    h->rng ^= h->rng >> 27;
+    return((unsigned int)((h->rng * 2685821657736338717ULL) >> 32));
+}
+
+static double apply_random_double(struct apply_handle *h) {
+    return(apply_random_next(h) / 4294967296.0);
+}
+
+void apply_set_seed(struct apply_handle *h, unsigned long long seed) {
+    /* Spread the seed with splitmix64; the state must not be 0 */
+    seed += 0x9E3779B97F4A7C15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+    seed ^= seed >> 31;
+    h->rng = seed ? seed : 1;
+}
+
+void apply_set_sample_maxlen(struct apply_handle *h, int maxlen) {
+    h->sample_maxlen = maxlen;
+    apply_sampler_free(h->sampler);
+    h->sampler = NULL;
+}
+
+void apply_sampler_free(struct apply_sampler *s) {
+    if (s == NULL)
+	return;
+    free(s->logcount);
+    free(s->cum);
+    free(s);
+}
+
+/* log(exp(a)+exp(b)) */
+static double log_add(double a, double b) {
+    if (a == -INFINITY)
+	return(b);
+    if (b == -INFINITY)
+	return(a);
+    return(a > b ? a + log1p(exp(b - a)) : b + log1p(exp(a - b)));
+}
+
+/* Reverse topological order of the states reachable from the start */
+/* state, found by an iterative DFS; returns 0 if there is a cycle   */
+int apply_topsort_states(struct apply_handle *h, int states, int *order) {
+    int *color, *stack, *next, sp, s, t, line, count, acyclic;
+
+    color = calloc(states, sizeof(int));
+    stack = malloc(sizeof(int) * states);
+    next = malloc(sizeof(int) * states);
+    acyclic = 1;
+    count = 0;
+    sp = 0;
+    s = h->gstates->state_no;
+    stack[sp++] = s;
+    color[s] = 1;
+    next[s] = h->statemap[s];
+    while (sp > 0 && acyclic) {
+	s = stack[sp-1];
+	line = next[s];
+	if (line != -1 && (h->gstates+line)->state_no == s && (h->gstates+line)->target != -1) {
+	    next[s]++;
+	    t = (h->gstates+line)->target;
+	    if (color[t] == 1) {
+		acyclic = 0;
+	    } else if (color[t] == 0) {
+		color[t] = 1;
+		next[t] = h->statemap[t];
+		stack[sp++] = t;
+	    }
+	} else {
+	    color[s] = 2;
+	    order[count++] = s;
+	    sp--;
+	}
+    }
+    free(color);
+    free(stack);
+    free(next);
+    return(acyclic ? count : 0);
+}
+
+static void sample_prepare_acyclic(struct apply_handle *h, struct apply_sampler *s, int *order, int count) {
+    int i, line, state, first;
+    double total, sum;
+
+    s->cum = malloc(sizeof(double) * s->lines);
+    for (i = 0; i < s->states; i++)
+	s->logcount[i] = -INFINITY;
+    for (i = 0; i < count; i++) {
+	state = order[i];
+	if ((first = h->statemap[state]) == -1)
+	    continue;
+	total = (h->gstates+first)->final_state ? 0 : -INFINITY;
+	for (line = first; (h->gstates+line)->state_no == state && (h->gstates+line)->target != -1; line++)
+	    total = log_add(total, s->logcount[(h->gstates+line)->target]);
+	s->logcount[state] = total;
+	if (total == -INFINITY)
+	    continue;
+	sum = (h->gstates+first)->final_state ? 0 : -INFINITY;
+	for (line = first; (h->gstates+line)->state_no == state; line++) {
+	    if ((h->gstates+line)->target != -1)
+		sum = log_add(sum, s->logcount[(h->gstates+line)->target]);
+	    s->cum[line] = exp(sum - total);
+	}
+	/* Against rounding, the last live arc and the lines after it end at 1 */
+	for (line--; line > first && ((h->gstates+line)->target == -1 || s->logcount[(h->gstates+line)->target] == -INFINITY); line--)
+	    s->cum[line] = 1.0;
+	s->cum[line] = 1.0;
+    }
+}
+
+static void sample_prepare_cyclic(struct apply_handle *h, struct apply_sampler *s) {
+    int len, state, line, width;
+    double total;
+
+    width = s->maxlen + 1;
+    for (state = 0; state < s->states; state++) {
+	line = h->statemap[state];
+	s->logcount[state*width] = (line != -1 && (h->gstates+line)->final_state) ? 0 : -INFINITY;
+    }
+    for (len = 1; len <= s->maxlen; len++) {
+	for (state = 0; state < s->states; state++) {
+	    total = s->logcount[state*width];
+	    if ((line = h->statemap[state]) != -1) {
+		for ( ; (h->gstates+line)->state_no == state && (h->gstates+line)->target != -1; line++)
+		    total = log_add(total, s->logcount[(h->gstates+line)->target*width+len-1]);
+	    }
+	    s->logcount[state*width+len] = total;
+	}
+    }
+}
+
+static struct apply_sampler *apply_sampler_init(struct apply_handle *h) {
+    struct apply_sampler *s;
+    int *order, count;
+
+    s = calloc(1, sizeof(struct apply_sampler));
+    s->states = h->last_net->statecount;
+    for (s->lines = 0; (h->gstates+s->lines)->state_no != -1; s->lines++) { }
+    order = malloc(sizeof(int) * s->states);
+    if ((count = apply_topsort_states(h, s->states, order)) > 0) {
+	s->logcount = malloc(sizeof(double) * s->states);
+	sample_prepare_acyclic(h, s, order, count);
+    } else {
+	s->maxlen = h->sample_maxlen > 0 ? h->sample_maxlen : DEFAULT_SAMPLE_MAXLEN;
+	s->logcount = malloc(sizeof(double) * s->states * (s->maxlen + 1));
+	sample_prepare_cyclic(h, s);
+    }
+    free(order);
+    return(s);
+}
+
+/* Draws one accepting path; stores its lines in h->sample_path and */
+/* returns its length, or -1 if the net accepts nothing             */
+
+int apply_sample_path(struct apply_handle *h) {
+    struct apply_sampler *s;
+    int state, line, lo, hi, mid, len, width, count;
+    double u, total, sum;
+
+    if (h->sampler == NULL)
+	h->sampler = apply_sampler_init(h);
+    s = h->sampler;
+    state = h->gstates->state_no;
+    width = s->maxlen + 1;
+    if (s->logcount[s->maxlen ? state*width+s->maxlen : state] == -INFINITY)
+	return -1;
+    for (count = 0, len = s->maxlen; ; count++) {
+	line = h->statemap[state];
+	u = apply_random_double(h);
+	if (s->maxlen == 0) {
+	    if ((h->gstates+line)->final_state && u < exp(-s->logcount[state]))
+		break;
+	    /* Binary search for the first line whose cumulative probability exceeds u */
+	    for (lo = line, hi = line + h->numlines[state] - 1; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (s->cum[mid] > u)
+		    hi = mid;
+		else
+		    lo = mid + 1;
+	    }
+	    line = lo;
+	} else {
+	    /* Stop, or take an arc, in proportion to the paths of at most len arcs */
+	    total = s->logcount[state*width+len];
+	    sum = (h->gstates+line)->final_state ? exp(-total) : 0;
+	    if (u < sum || len == 0)
+		break;
+	    for ( ; (h->gstates+line)->state_no == state && (h->gstates+line)->target != -1; line++) {
+		sum += exp(s->logcount[(h->gstates+line)->target*width+len-1] - total);
+		if (u < sum)
+		    break;
+	    }
+	    /* Rounding may leave u past the last arc: take the last live one */
+	    if ((h->gstates+line)->state_no != state || (h->gstates+line)->target == -1) {
+		for (line--; s->logcount[(h->gstates+line)->target*width+len-1] == -INFINITY; line--) { }
+	    }
+	    len--;
+	}
+	if (count >= h->sample_path_size) {
+	    h->sample_path_size = h->sample_path_size ? h->sample_path_size * 2 : 64;
+	    h->sample_path = realloc(h->sample_path, sizeof(int) * h->sample_path_size);
+	}
+	h->sample_path[count] = line;
+	state = (h->gstates+line)->target;
+    }
+    return(count);
+}
@@ -19,6 +19,123 @@
 #include <stdlib.h>
 #include "foma.h"
 
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#endif
+
+/* Session-wide table of interned symbol strings.  A symbol gets the same */
+/* id in every net for the lifetime of the process, so once the ids of a  */
+/* sigma are known, symbols are compared as ints instead of with strcmp() */
+/* The strings are kept in a dense array indexed by id, and found through */
+/* an open addressing hash table that stores id+1 (0 marks a free slot)   */
+/* Strings are never freed, as cached ids must stay valid; the table only */
+/* grows by the symbols of nets, since sigma_find() does not add queries. */
+/* With threads, a mutex guards the table itself; building nets is still  */
+/* not thread-safe as a whole, since dynarray.c keeps global state.       */
+
+static struct sigma_intern_table {
+    char **strings;
+    int count;
+    int size;
+    int *slots;
+    unsigned int mask;
+} sigma_interned;
+
+#ifdef FOMA_PTHREADS
+static pthread_mutex_t sigma_intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void sigma_intern_lock(void) {
+#ifdef FOMA_PTHREADS
+    pthread_mutex_lock(&sigma_intern_mutex);
+#endif
+}
+
+static void sigma_intern_unlock(void) {
+#ifdef FOMA_PTHREADS
+    pthread_mutex_unlock(&sigma_intern_mutex);
+#endif
+}
+
+static unsigned int sigma_intern_hashf(char *symbol) {
+    unsigned int hash = 2166136261U;
+    for ( ; *symbol != '\0'; symbol++)
+        hash = (hash ^ (unsigned char)*symbol) * 16777619U;
+    return(hash);
+}
+
+static void sigma_intern_rehash(void) {
+    int i;
+    unsigned int h;
+    struct sigma_intern_table *t = &sigma_interned;
+    t->mask = t->mask == 0 ? 1023 : t->mask * 2 + 1;
+    free(t->slots);
+    t->slots = calloc(t->mask + 1, sizeof(int));
+    for (i = 0; i < t->count; i++) {
+        for (h = sigma_intern_hashf(t->strings[i]) & t->mask; t->slots[h] != 0; h = (h + 1) & t->mask) { }
+        t->slots[h] = i + 1;
+    }
+}
+
+/* The slot holding symbol, or the free slot where it would go */
+static unsigned int sigma_intern_probe(char *symbol) {
+    unsigned int h;
+    struct sigma_intern_table *t = &sigma_interned;
+    for (h = sigma_intern_hashf(symbol) & t->mask; t->slots[h] != 0; h = (h + 1) & t->mask) {
+        if (strcmp(t->strings[t->slots[h]-1], symbol) == 0)
+            break;
+    }
+    return(h);
+}
+
+/* Returns the id of symbol, adding it to the table if it is new */
+int sigma_intern(char *symbol) {
+    unsigned int h;
+    int id;
+    struct sigma_intern_table *t = &sigma_interned;
+    sigma_intern_lock();
+    if (t->count * 2 >= (int)t->mask)
+        sigma_intern_rehash();
+    h = sigma_intern_probe(symbol);
+    if (t->slots[h] != 0) {
+        id = t->slots[h]-1;
+    } else {
+        if (t->count == t->size) {
+            t->size = t->size == 0 ? 1024 : t->size * 2;
+            t->strings = realloc(t->strings, sizeof(char *) * t->size);
+        }
+        id = t->count++;
+        t->strings[id] = strdup(symbol);
+        t->slots[h] = id + 1;
+    }
+    sigma_intern_unlock();
+    return(id);
+}
+
+/* Returns the id of symbol, or -1 if it has not been interned */
+int sigma_intern_lookup(char *symbol) {
+    int id;
+    sigma_intern_lock();
+    id = sigma_interned.mask == 0 ? -1 : sigma_interned.slots[sigma_intern_probe(symbol)]-1;
+    sigma_intern_unlock();
+    return(id);
+}
+
+char *sigma_intern_string(int id) {
+    char *string;
+    sigma_intern_lock();
+    string = id < 0 || id >= sigma_interned.count ? NULL : sigma_interned.strings[id];
+    sigma_intern_unlock();
+    return(string);
+}
+
+/* Interned id of a sigma entry, looked up on first use and cached */
+int sigma_symbol_id(struct sigma *sigma) {
+    if (sigma->id < 0 && sigma->symbol != NULL)
+        sigma->id = sigma_intern(sigma->symbol);
+    return(sigma->id);
+}
+
 struct sigma *sigma_remove(char *symbol, struct sigma *sigma) {
   struct sigma *sigma_start, *sigma_prev = NULL;
   sigma_prev = NULL;
@@ -82,20 +199,24 @@ int sigma_add_special (int symbol, struct sigma *sigma) {
 	(sigma_previous)->next = sigma_splice;
 	sigma_splice->number = symbol;
 	sigma_splice->symbol = str;
+	sigma_splice->id = -1;
 	(sigma_splice)->next = sigma; 
 	return(symbol);
       } else {
 	sigma_splice->symbol = sigma->symbol;
 	sigma_splice->number = sigma->number;
 	sigma_splice->next = sigma->next;
+	sigma_splice->id = sigma->id;
 	sigma->number = symbol;
 	sigma->symbol = str;
+	sigma->id = -1;
 	sigma->next = sigma_splice;
 	return(symbol);
       }
     }
     sigma->next = NULL;
     sigma->symbol = str;
+    sigma->id = -1;
     return(symbol);
 }
 
@@ -132,6 +253,7 @@ int sigma_add (char *symbol, struct sigma *sigma) {
     }
     sigma->next = NULL;  
     sigma->symbol = strdup(symbol);
+    sigma->id = -1;
     return(sigma->number);
   } else {
     /* Insert special symbols pre-sorted */
@@ -146,21 +268,25 @@ int sigma_add (char *symbol, struct sigma *sigma) {
 	sigma_splice->number = assert;
 	sigma_splice->symbol = malloc(sizeof(char)*(strlen(symbol)+1));
 	strcpy(sigma_splice->symbol, symbol);
+	sigma_splice->id = -1;
 	(sigma_splice)->next = sigma; 
 	return(assert);
       } else {
 	sigma_splice->symbol = sigma->symbol;
 	sigma_splice->number = sigma->number;
 	sigma_splice->next = sigma->next;
+	sigma_splice->id = sigma->id;
 	sigma->number = assert;
 	sigma->symbol = malloc(sizeof(char)*(strlen(symbol)+1));
 	strcpy(sigma->symbol, symbol);
+	sigma->id = -1;
 	sigma->next = sigma_splice;
 	return(assert);
       }
     }
     sigma->next = NULL;
     sigma->symbol = strdup(symbol);
+    sigma->id = -1;
     return(assert);
   }
 }
@@ -263,6 +389,7 @@ int sigma_add_number(struct sigma *sigma, char *symbol, int number) {
         sigma->symbol = strdup(symbol);
         sigma->number = number;
         sigma->next = NULL;
+        sigma->id = -1;
         return(1);
     }
     for (newsigma = sigma; newsigma != NULL; newsigma = newsigma->next) {
@@ -272,6 +399,7 @@ int sigma_add_number(struct sigma *sigma, char *symbol, int number) {
     newsigma->symbol = strdup(symbol);
     newsigma->number = number;
     newsigma->next = NULL;
+    newsigma->id = -1;
     prev_sigma->next = newsigma;
     return(1);
 }
@@ -314,6 +442,7 @@ int sigma_substitute(char *symbol, char *sub, struct sigma *sigma) {
         if (strcmp(sigma->symbol, symbol) == 0) {
 	    free(sigma->symbol);
 	    sigma->symbol = strdup(sub);
+	    sigma->id = -1;
             return(sigma->number);
         }
     }
@@ -321,12 +450,21 @@ int sigma_substitute(char *symbol, char *sub, struct sigma *sigma) {
 }
 
 int sigma_find(char *symbol, struct sigma *sigma) {
-    
+    int id;
     if (sigma == NULL || sigma->number == -1) {
         return -1;
     }
+    /* A symbol never interned can only match entries not interned yet */
+    if ((id = sigma_intern_lookup(symbol)) == -1) {
+        for (; sigma != NULL && sigma->number != -1 ; sigma = sigma->next) {
+            if (sigma->id == -1 && strcmp(sigma->symbol, symbol) == 0) {
+                return (sigma->number);
+            }
+        }
+        return -1;
+    }
     for (; sigma != NULL && sigma->number != -1 ; sigma = sigma->next) {
-        if (strcmp(sigma->symbol, symbol) == 0) {
+        if (sigma_symbol_id(sigma) == id) {
             return (sigma->number);
         }
     }
@@ -336,6 +474,7 @@ int sigma_find(char *symbol, struct sigma *sigma) {
 struct ssort {
   char *symbol;
   int number;
+  int id;
 };
 
 int ssortcmp(const void *_a, const void *_b) {
@@ -357,6 +496,7 @@ struct sigma *sigma_copy(struct sigma *sigma) {
 	    copy_sigma = copy_sigma->next;
 	}
 	copy_sigma->number = sigma->number;
+	copy_sigma->id = sigma->id;
 	if (sigma->symbol != NULL)
 	    copy_sigma->symbol = strdup(sigma->symbol);
 	else
@@ -385,6 +525,7 @@ int sigma_sort(struct fsm *net) {
     if (sigma->number > IDENTITY) {
       ssort[i].symbol = (char *)sigma->symbol;
       ssort[i].number = sigma->number;
+      ssort[i].id = sigma->id;
       i++;
     }
   }
@@ -406,6 +547,7 @@ int sigma_sort(struct fsm *net) {
     if (sigma->number > IDENTITY) {
       sigma->number = i+3;
       sigma->symbol = (ssort+i)->symbol;
+      sigma->id = (ssort+i)->id;
       i++;
     }
   }
@@ -420,5 +562,6 @@ struct sigma *sigma_create() {
   sigma->number = -1; /*Empty sigma*/
   sigma->next = NULL;
   sigma->symbol = NULL;
+  sigma->id = -1;
   return(sigma);
 }
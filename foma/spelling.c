@@ -37,6 +37,7 @@
 #define min_(X, Y)  ((X) < (Y) ? (X) : (Y))
 
 static int calculate_h(struct apply_med_handle *medh, int *intword, int currpos, int state);
+static char *med_search(struct apply_med_handle *medh, int resume);
 static struct astarnode *node_delete_min(struct apply_med_handle *medh);
 int node_insert(struct apply_med_handle *medh, int wordpos, int fsmstate, int g, int h, int in, int out, int parent);
 
@@ -50,25 +51,39 @@ char *print_sym(int sym, struct sigma *sigma) {
     return NULL;
 }
 
-void print_match(struct apply_med_handle *medh, struct astarnode *node, struct sigma *sigma, char *word) {
-    int sym, i, wordlen , printptr;
+/* Collect the path from node back to the root in medh->path,       */
+/* reading either the in or out side; returns the length of the path */
+/* with the symbol closest to the root last.                         */
+
+static int med_collect_path(struct apply_med_handle *medh, struct astarnode *node, int side) {
+    int len;
     struct astarnode *n;
-    int_stack_clear();
-    wordlen = medh->wordlen;
-    for (n = node; n != NULL ; n = medh->agenda+(n->parent)) {
+    for (n = node, len = 0; n != NULL ; n = medh->agenda+(n->parent)) {
         if (n->in == 0 && n->out == 0)
             break;
         if (n->parent == -1)
             break;
-        int_stack_push(n->in);
+        if (len >= medh->path_size) {
+            medh->path_size = medh->path_size ? medh->path_size * 2 : INITIAL_STRING_SIZE;
+            medh->path = realloc(medh->path, medh->path_size*sizeof(int));
+        }
+        *(medh->path+len) = side == M_UPPER ? n->in : n->out;
+        len++;
     }
+    return(len);
+}
+
+void print_match(struct apply_med_handle *medh, struct astarnode *node, struct sigma *sigma, char *word) {
+    int sym, i, wordlen , printptr, len;
+    wordlen = medh->wordlen;
+    len = med_collect_path(medh, node, M_UPPER);
     printptr = 0;
     if (medh->outstring_length < 2*wordlen) {
 	medh->outstring_length *= 2;
 	medh->outstring = realloc(medh->outstring, medh->outstring_length*sizeof(char));
     }
-    while (!(int_stack_isempty())) {
-        sym = int_stack_pop();
+    while (len > 0) {
+        sym = *(medh->path+(--len));
         if (sym > 2) {
             printptr += sprintf(medh->outstring+printptr,"%s", print_sym(sym, sigma));
         }
@@ -81,21 +96,14 @@ void print_match(struct apply_med_handle *medh, struct astarnode *node, struct s
             printptr += sprintf(medh->outstring+printptr,"@");
         }
     }
-    for (n = node; n != NULL ; n = medh->agenda+(n->parent)) {
-        if (n->in == 0 && n->out == 0)
-            break;
-        if (n->parent == -1)
-            break;
-        else
-            int_stack_push(n->out);
-    }
+    len = med_collect_path(medh, node, M_LOWER);
     printptr = 0;
     if (medh->instring_length < 2*wordlen) {
 	medh->instring_length *= 2;
 	medh->instring = realloc(medh->instring, medh->instring_length*sizeof(char));
     }
-    for (i = 0; !(int_stack_isempty()); ) {
-        sym = int_stack_pop();	
+    for (i = 0; len > 0; ) {
+        sym = *(medh->path+(--len));
         if (sym > 2) {
             printptr += sprintf(medh->instring+printptr,"%s", print_sym(sym, sigma));
             i += utf8skip(word+i)+1;
@@ -119,9 +127,51 @@ void print_match(struct apply_med_handle *medh, struct astarnode *node, struct s
     // printf("Cost[f]: %i\n\n", node->g);
 }
 
+static void med_results_clear(struct apply_med_handle *medh) {
+    int i;
+    for (i = 0; i < medh->numresults; i++) {
+        free((medh->results+i)->instring);
+        free((medh->results+i)->outstring);
+    }
+    medh->numresults = 0;
+    medh->currresult = 0;
+}
+
+static void med_results_add(struct apply_med_handle *medh, char *instring, char *outstring, int cost) {
+    if (medh->numresults == medh->results_size) {
+        medh->results_size = medh->results_size ? medh->results_size * 2 : MED_DEFAULT_LIMIT;
+        medh->results = realloc(medh->results, medh->results_size*sizeof(struct med_result));
+    }
+    (medh->results+medh->numresults)->instring = strdup(instring);
+    (medh->results+medh->numresults)->outstring = strdup(outstring);
+    (medh->results+medh->numresults)->cost = cost;
+    medh->numresults++;
+}
+
 void apply_med_clear(struct apply_med_handle *medh) {
+    int i;
     if (medh == NULL)
 	return;
+    if (medh->workers != NULL) {
+	for (i = 0; i < medh->threads; i++) {
+	    apply_med_clear(*(medh->workers+i));
+	}
+	free(medh->workers);
+    }
+    med_results_clear(medh);
+    if (medh->results != NULL)
+	free(medh->results);
+    if (medh->path != NULL)
+	free(medh->path);
+    if (medh->parent != NULL) {
+	/* Worker handles only own their search space */
+	free(medh->agenda);
+	free(medh->heap);
+	free(medh->instring);
+	free(medh->outstring);
+	free(medh);
+	return;
+    }
     if (medh->agenda != NULL)
 	free(medh->agenda);
     if (medh->instring != NULL)
@@ -161,9 +211,9 @@ struct apply_med_handle *apply_med_init(struct fsm *net) {
     medh->astarcount = 1;
     medh->heapcount = 0;
     medh->state_array = map_firstlines(net);
-    if (net->medlookup != NULL && net->medlookup->confusion_matrix != NULL) {
+    if (net->medlookup != NULL) {
 	medh->hascm = 1;
-	medh->cm = net->medlookup->confusion_matrix;
+	medh->cm = net->medlookup;
     }
     medh->maxsigma = sigma_max(net->sigma)+1;
     medh->sigmahash = sh_init();
@@ -211,6 +261,24 @@ void apply_med_set_med_cutoff(struct apply_med_handle *medh, int max) {
     }
 }
 
+void apply_med_set_threads(struct apply_med_handle *medh, int threads) {
+    int i;
+    if (medh == NULL || medh->parent != NULL)
+	return;
+    if (threads <= 0)
+	threads = foma_num_cpus();
+    if (threads == medh->threads)
+	return;
+    if (medh->workers != NULL) {
+	for (i = 0; i < medh->threads; i++) {
+	    apply_med_clear(*(medh->workers+i));
+	}
+	free(medh->workers);
+	medh->workers = NULL;
+    }
+    medh->threads = threads;
+}
+
 int apply_med_get_cost(struct apply_med_handle *medh) {
     return(medh->cost);
 }
@@ -223,31 +291,14 @@ char *apply_med_get_outstring(struct apply_med_handle *medh) {
     return(medh->outstring);
 }
 
-char *apply_med(struct apply_med_handle *medh, char *word) {
-
-    /* local ok: i, j, target, in, out, g, h, curr_node                                   */
-    /* not ok: curr_ptr, curr_pos, lines, nummatches, nodes_expanded, curr_state           */
+/* Tokenize word into sigma numbers in medh->intword */
 
-    int i, j, target, in, out, g, h, thisskip;
-
-    int delcost, subscost, inscost;
+static void med_prepare_word(struct apply_med_handle *medh, char *word) {
+    int i, j, thisskip;
     char temputf[5] ;
 
-    struct astarnode *curr_node;
-
-    delcost = subscost = inscost = 1;
-
-
-    if (word == NULL) {
-	goto resume;
-    }
-
     medh->word = word;
 
-    medh->nodes_expanded = 0;
-    medh->astarcount = 1;
-    medh->heapcount = 0;
-
     medh->wordlen = strlen(word);
     medh->utf8len = utf8strlen(word);
     if (medh->intword != NULL) {
@@ -267,9 +318,31 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
         }
     }
 
-    
-
     *(medh->intword+j) = -1; /* sentinel */
+}
+
+static char *med_search(struct apply_med_handle *medh, int resume) {
+
+    /* local ok: i, j, target, in, out, g, h, curr_node                                   */
+    /* not ok: curr_ptr, curr_pos, lines, nummatches, nodes_expanded, curr_state           */
+
+    int target, in, out, g, h;
+
+    int delcost, subscost, inscost;
+
+    struct astarnode *curr_node;
+
+    delcost = subscost = inscost = 1;
+
+
+    if (resume) {
+	goto resume;
+    }
+
+    medh->nodes_expanded = 0;
+    medh->astarcount = 1;
+    medh->heapcount = 0;
+    medh->root_children = 0;
     
     /* Insert (0,0) g = 0 */
     
@@ -315,7 +388,8 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
             }
             medh->lines++;
             if (medh->curr_ptr->final_state && medh->curr_pos == medh->utf8len) {
-                if (medh->curr_node_has_match == 0) {
+                /* A match at the root is only reported by the first worker */
+                if (medh->curr_node_has_match == 0 && (medh->partition == 0 || medh->curr_agenda_offset != 1)) {
                     /* Found a match */
                     medh->curr_node_has_match = 1;
                     print_match(medh, medh->agenda+medh->curr_agenda_offset, medh->net->sigma, medh->word);
@@ -343,7 +417,7 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
             /* Delete a symbol from input */
             in = medh->curr_ptr->in;
             out = 0;
-            g = medh->hascm ? medh->curr_g + *(medh->cm+in*medh->maxsigma) : medh->curr_g + delcost;
+            g = medh->hascm ? medh->curr_g + cmatrix_cost(medh->cm, in, 0) : medh->curr_g + delcost;
             h = calculate_h(medh, medh->intword, medh->curr_pos, medh->curr_ptr->target);
 
             if ((medh->curr_pos == medh->utf8len) && (medh->curr_ptr->final_state == 0) && (h == 0)) {
@@ -362,7 +436,7 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
             in = medh->curr_ptr->in;
             out = *(medh->intword+medh->curr_pos);
             if (in != out) {
-                g = medh->hascm ? medh->curr_g + *(medh->cm+in*medh->maxsigma+out) : medh->curr_g + subscost;
+                g = medh->hascm ? medh->curr_g + cmatrix_cost(medh->cm, in, out) : medh->curr_g + subscost;
             } else {
                 g = medh->curr_g;
             }
@@ -382,7 +456,7 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
                 in = 0;
                 out = *(medh->intword+medh->curr_pos);
                 
-                g = medh->hascm ? medh->curr_g + *(medh->cm+out) : medh->curr_g + inscost;
+                g = medh->hascm ? medh->curr_g + cmatrix_cost(medh->cm, 0, out) : medh->curr_g + inscost;
                 h = calculate_h(medh, medh->intword, medh->curr_pos+1, medh->curr_state);
                 
                 if (g+h <= medh->med_cutoff)
@@ -403,6 +477,129 @@ char *apply_med(struct apply_med_handle *medh, char *word) {
      return(NULL);
 }
 
+static struct apply_med_handle *med_worker_init(struct apply_med_handle *medh, int partition) {
+    struct apply_med_handle *w;
+    w = calloc(1,sizeof(struct apply_med_handle));
+    w->parent = medh;
+    w->net = medh->net;
+    w->state_array = medh->state_array;
+    w->letterbits = medh->letterbits;
+    w->nletterbits = medh->nletterbits;
+    w->bytes_per_letter_array = medh->bytes_per_letter_array;
+    w->maxdepth = medh->maxdepth;
+    w->maxsigma = medh->maxsigma;
+    w->hascm = medh->hascm;
+    w->cm = medh->cm;
+    w->agenda = malloc(sizeof(struct astarnode)*INITIAL_AGENDA_SIZE);
+    w->agenda->f = -1;
+    w->agenda_size = INITIAL_AGENDA_SIZE;
+    w->heap = malloc(sizeof(int)*INITIAL_HEAP_SIZE);
+    w->heap_size = INITIAL_HEAP_SIZE;
+    *(w->heap) = 0;
+    w->instring = malloc(sizeof(char)*INITIAL_STRING_SIZE);
+    w->instring_length = INITIAL_STRING_SIZE;
+    w->outstring = malloc(sizeof(char)*INITIAL_STRING_SIZE);
+    w->outstring_length = INITIAL_STRING_SIZE;
+    w->partitions = medh->threads;
+    w->partition = partition;
+    return(w);
+}
+
+static void *med_worker_run(void *arg) {
+    struct apply_med_handle *w;
+    char *result;
+    w = *(struct apply_med_handle **) arg;
+    med_results_clear(w);
+    for (result = med_search(w, 0); result != NULL; result = med_search(w, 1)) {
+        med_results_add(w, w->instring, w->outstring, w->cost);
+    }
+    return NULL;
+}
+
+/* Run the search for word on all workers and merge their (cost-ordered) */
+/* result lists into medh->results, keeping the med_limit cheapest ones. */
+
+static void med_search_parallel(struct apply_med_handle *medh, char *word) {
+    int i, best, *pos;
+    struct apply_med_handle *w;
+
+    med_prepare_word(medh, word);
+    if (medh->workers == NULL) {
+        medh->workers = malloc(sizeof(struct apply_med_handle *)*medh->threads);
+        for (i = 0; i < medh->threads; i++) {
+            *(medh->workers+i) = med_worker_init(medh, i);
+        }
+    }
+    for (i = 0; i < medh->threads; i++) {
+        w = *(medh->workers+i);
+        w->word = medh->word;
+        w->wordlen = medh->wordlen;
+        w->utf8len = medh->utf8len;
+        w->intword = medh->intword;
+        w->align_symbol = medh->align_symbol;
+        w->med_limit = medh->med_limit;
+        w->med_cutoff = medh->med_cutoff;
+        w->med_max_heap_size = medh->med_max_heap_size;
+    }
+    foma_parallel_run(med_worker_run, medh->workers, sizeof(struct apply_med_handle *), medh->threads, medh->threads);
+
+    med_results_clear(medh);
+    pos = calloc(medh->threads, sizeof(int));
+    while (medh->numresults < medh->med_limit) {
+        for (i = 0, best = -1; i < medh->threads; i++) {
+            w = *(medh->workers+i);
+            if (*(pos+i) < w->numresults && (best == -1 || (w->results+*(pos+i))->cost < ((*(medh->workers+best))->results+*(pos+best))->cost)) {
+                best = i;
+            }
+        }
+        if (best == -1)
+            break;
+        w = *(medh->workers+best);
+        med_results_add(medh, (w->results+*(pos+best))->instring, (w->results+*(pos+best))->outstring, (w->results+*(pos+best))->cost);
+        (*(pos+best))++;
+    }
+    free(pos);
+    medh->nodes_expanded = 0;
+    for (i = 0; i < medh->threads; i++) {
+        medh->nodes_expanded += (*(medh->workers+i))->nodes_expanded;
+    }
+}
+
+static char *med_next_result(struct apply_med_handle *medh) {
+    struct med_result *r;
+    int len;
+    if (medh->currresult >= medh->numresults)
+        return NULL;
+    r = medh->results+medh->currresult;
+    medh->currresult++;
+    if ((len = strlen(r->instring)+1) > medh->instring_length) {
+        medh->instring_length = len;
+        medh->instring = realloc(medh->instring, len*sizeof(char));
+    }
+    if ((len = strlen(r->outstring)+1) > medh->outstring_length) {
+        medh->outstring_length = len;
+        medh->outstring = realloc(medh->outstring, len*sizeof(char));
+    }
+    strcpy(medh->instring, r->instring);
+    strcpy(medh->outstring, r->outstring);
+    medh->cost = r->cost;
+    return(medh->outstring);
+}
+
+char *apply_med(struct apply_med_handle *medh, char *word) {
+    if (medh->threads > 1) {
+        if (word != NULL) {
+            med_search_parallel(medh, word);
+        }
+        return(med_next_result(medh));
+    }
+    if (word == NULL) {
+        return(med_search(medh, 1));
+    }
+    med_prepare_word(medh, word);
+    return(med_search(medh, 0));
+}
+
 int calculate_h(struct apply_med_handle *medh, int *intword, int currpos, int state) {
     int i, j, hinf, hn, curr_sym;
     uint8_t *bitptr, *nbitptr;
@@ -474,6 +671,11 @@ struct astarnode *node_delete_min(struct apply_med_handle *medh) {
 
 int node_insert(struct apply_med_handle *medh, int wordpos, int fsmstate, int g, int h, int in, int out, int parent) {
     int i,j,f;
+    /* A worker only explores its own share of the root's successors */
+    if (medh->partitions > 1 && parent == 1) {
+        if ((medh->root_children++) % medh->partitions != medh->partition)
+            return 1;
+    }
     /* We add the node in the array */
     i = medh->astarcount;
     if (i >= (medh->agenda_size-1)) {
@@ -586,6 +788,8 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
     int num_states, num_symbols, index, v, vp, copystate, i, j;
     struct fsm_state *curr_ptr;
     struct sccinfo *sccinfo;
+    struct int_stack *istack;
+    struct ptr_stack *pstack;
     int depth;
     medh->maxdepth = 2;
 
@@ -598,6 +802,8 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
 
     sccinfo = calloc(num_states,sizeof(struct sccinfo));
     
+    istack = int_stack_init();
+    pstack = ptr_stack_init();
     index = 1;
     curr_ptr = net->states;
     goto l1;
@@ -605,9 +811,9 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
     /* Here we go again, converting a recursive algorithm to an iterative one */
     /* by gotos */
 
-    while(!ptr_stack_isempty()) {
+    while(!ptr_stack_isempty(pstack)) {
 
-        curr_ptr = ptr_stack_pop();
+        curr_ptr = ptr_stack_pop(pstack);
 
         v = curr_ptr->state_no; /* source state number */
         vp = curr_ptr->target;  /* target state number */
@@ -632,7 +838,7 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
         (sccinfo+v)->index = index;
         (sccinfo+v)->lowlink = index;
         index++;
-        int_stack_push(v);
+        int_stack_push(istack, v);
         (sccinfo+v)->on_t_stack = 1;
         /* if v' not visited (is v'.index set) */
 
@@ -644,7 +850,7 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
         letterbits_add(v, curr_ptr->in, medh->letterbits,medh->bytes_per_letter_array);
         if ((sccinfo+vp)->index == 0) {
             /* push (v,e) ptr on stack */
-            ptr_stack_push(curr_ptr);
+            ptr_stack_push(pstack, curr_ptr);
             curr_ptr = (medh->state_array+(curr_ptr->target))->transitions;
             /* (v,e) = (v',firstedge), goto init */
             goto l1;
@@ -670,7 +876,7 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
     l4:
         if ((sccinfo+v)->lowlink == (sccinfo+v)->index) {
             //printf("\nSCC: [%i] ",v);
-            while((copystate = int_stack_pop()) != v) {
+            while((copystate = int_stack_pop(istack)) != v) {
                 (sccinfo+copystate)->on_t_stack = 0;
                 letterbits_copy(v, copystate, medh->letterbits, medh->bytes_per_letter_array);
                 //printf("%i ", copystate);
@@ -689,17 +895,17 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
         }    
         //printf("\n");
     }
-    int_stack_clear();
+    int_stack_clear(istack);
 
     /* We do the same thing for some finite n (up to maxdepth) */
     /* and store the result in nletterbits                     */
 
     for (v=0; v < num_states; v++) {
-        ptr_stack_push((medh->state_array+v)->transitions);
-        int_stack_push(0);
-        while (!ptr_stack_isempty()) {
-            curr_ptr = ptr_stack_pop();
-            depth = int_stack_pop();
+        ptr_stack_push(pstack, (medh->state_array+v)->transitions);
+        int_stack_push(istack, 0);
+        while (!ptr_stack_isempty(pstack)) {
+            curr_ptr = ptr_stack_pop(pstack);
+            depth = int_stack_pop(istack);
         looper:
             if (depth == medh->maxdepth)
                 continue;
@@ -708,8 +914,8 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
             }
             if (curr_ptr->target != -1) {
                 if (curr_ptr->state_no == (curr_ptr+1)->state_no) {
-                    ptr_stack_push(curr_ptr+1);
-                    int_stack_push(depth);
+                    ptr_stack_push(pstack, curr_ptr+1);
+                    int_stack_push(istack, depth);
                 }
                 depth++;
                 curr_ptr = (medh->state_array+(curr_ptr->target))->transitions;
@@ -727,23 +933,26 @@ void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net) {
         //printf("\n");
     }
     free(sccinfo);
+    int_stack_free(istack);
+    ptr_stack_free(pstack);
 }
 
 void cmatrix_print_att(struct fsm *net, FILE *outfile) {
-    int i, j, *cm, maxsigma;
+    int i, j, maxsigma;
+    struct medlookup *cm;
     maxsigma = sigma_max(net->sigma) + 1;
-    cm = net->medlookup->confusion_matrix;
+    cm = net->medlookup;
 
 
     for (i = 0; i < maxsigma ; i++) {        
         for (j = 0; j < maxsigma ; j++) {
             if ((i != 0 && i < 3) || (j != 0 && j < 3)) { continue; }
             if (i == 0 && j != 0) {
-                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", "@0@", sigma_string(j, net->sigma), *(cm+i*maxsigma+j));
+                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", "@0@", sigma_string(j, net->sigma), cmatrix_cost(cm, i, j));
             } else if (j == 0 && i != 0) {
-                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", sigma_string(i,net->sigma), "@0@", *(cm+i*maxsigma+j));
+                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", sigma_string(i,net->sigma), "@0@", cmatrix_cost(cm, i, j));
             } else if (j != 0 && i != 0) {
-                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", sigma_string(i,net->sigma),sigma_string(j, net->sigma), *(cm+i*maxsigma+j));
+                fprintf(outfile,"0\t0\t%s\t%s\t%i\n", sigma_string(i,net->sigma),sigma_string(j, net->sigma), cmatrix_cost(cm, i, j));
             }
         }
     }
@@ -751,11 +960,12 @@ void cmatrix_print_att(struct fsm *net, FILE *outfile) {
 }
 
 void cmatrix_print(struct fsm *net) {
-    int lsymbol, i, j, *cm, maxsigma;
+    int lsymbol, i, j, maxsigma;
     char *thisstring;
     struct sigma *sigma;
+    struct medlookup *cm;
     maxsigma = sigma_max(net->sigma) + 1;
-    cm = net->medlookup->confusion_matrix;
+    cm = net->medlookup;
 
     lsymbol = 0 ;
     for (sigma = net->sigma; sigma != NULL; sigma = sigma->next) {
@@ -784,7 +994,7 @@ void cmatrix_print(struct fsm *net) {
                     printf("%*s",2,"*");
                 } else {
                     printf("%*s",lsymbol+1, sigma_string(i, net->sigma));
-                    printf("%*d",2,*(cm+i*maxsigma+j));
+                    printf("%*d",2,cmatrix_cost(cm, i, j));
                 }
                 j++;
                 j++;
@@ -793,7 +1003,7 @@ void cmatrix_print(struct fsm *net) {
             if (i == j) {
                 printf("%.*s",(int)strlen(sigma_string(j, net->sigma))+1,"*");
             } else {
-                printf("%.*d",(int)strlen(sigma_string(j, net->sigma))+1,*(cm+i*maxsigma+j));
+                printf("%.*d",(int)strlen(sigma_string(j, net->sigma))+1,cmatrix_cost(cm, i, j));
             }
         }
         printf("\n");
@@ -803,61 +1013,173 @@ void cmatrix_print(struct fsm *net) {
     }
 }
 
+static INLINE unsigned int cmatrix_hash(int in, int out) {
+    return(((unsigned int) in * 2654435761U) ^ ((unsigned int) out * 40503U));
+}
+
+/* The cost of a pair when it has no cell of its own */
+
+static INLINE int cmatrix_default(struct medlookup *ml, int in, int out) {
+    if (in == out)
+        return 0;
+    if (in == 0)
+        return(ml->insert_cost);
+    if (out == 0)
+        return(ml->delete_cost);
+    return(ml->substitute_cost);
+}
+
+int cmatrix_cost(struct medlookup *ml, int in, int out) {
+    struct cmatrix_cell *cell;
+    unsigned int i, mask;
+    if (ml->numcells > 0) {
+        mask = ml->tablesize - 1;
+        for (i = cmatrix_hash(in, out) & mask; (cell = ml->cells+i)->in != -1; i = (i+1) & mask) {
+            if (cell->in == in && cell->out == out)
+                return(cell->cost);
+        }
+    }
+    return(cmatrix_default(ml, in, out));
+}
+
+/* Rehash into a table of newsize slots, keeping only the cells */
+/* for which keep(in, out) is true (or all if keep is NULL)     */
+
+static void cmatrix_rehash(struct medlookup *ml, int newsize, int (*keep)(int, int)) {
+    struct cmatrix_cell *oldcells, *cell;
+    unsigned int i, j, mask;
+    int oldsize;
+    oldcells = ml->cells;
+    oldsize = ml->tablesize;
+    ml->cells = malloc(sizeof(struct cmatrix_cell) * newsize);
+    ml->tablesize = newsize;
+    ml->numcells = 0;
+    mask = newsize - 1;
+    for (i = 0; i < (unsigned int) newsize; i++)
+        (ml->cells+i)->in = -1;
+    for (i = 0; i < (unsigned int) oldsize; i++) {
+        cell = oldcells+i;
+        if (cell->in == -1 || (keep != NULL && !keep(cell->in, cell->out)))
+            continue;
+        for (j = cmatrix_hash(cell->in, cell->out) & mask; (ml->cells+j)->in != -1; j = (j+1) & mask) { }
+        *(ml->cells+j) = *cell;
+        ml->numcells++;
+    }
+    free(oldcells);
+}
+
+void cmatrix_put(struct medlookup *ml, int in, int out, int cost) {
+    struct cmatrix_cell *cell;
+    unsigned int i, mask;
+    if (ml->numcells > 0) {
+        mask = ml->tablesize - 1;
+        for (i = cmatrix_hash(in, out) & mask; (cell = ml->cells+i)->in != -1; i = (i+1) & mask) {
+            if (cell->in == in && cell->out == out) {
+                cell->cost = cost;
+                return;
+            }
+        }
+    }
+    if (cost == cmatrix_default(ml, in, out))
+        return;
+    /* Keep the load factor at most 1/2 */
+    if ((ml->numcells + 1) * 2 > ml->tablesize)
+        cmatrix_rehash(ml, ml->tablesize ? ml->tablesize * 2 : 64, NULL);
+    mask = ml->tablesize - 1;
+    for (i = cmatrix_hash(in, out) & mask; (ml->cells+i)->in != -1; i = (i+1) & mask) { }
+    (ml->cells+i)->in = in;
+    (ml->cells+i)->out = out;
+    (ml->cells+i)->cost = cost;
+    ml->numcells++;
+}
+
+static int cmatrix_not_substitution(int in, int out) {
+    return(in == 0 || out == 0);
+}
+
+static int cmatrix_not_insertion(int in, int out) {
+    return(in != 0);
+}
+
+static int cmatrix_not_deletion(int in, int out) {
+    return(out != 0);
+}
+
 void cmatrix_init(struct fsm *net) {
-    int maxsigma, *cm, i, j;
     if (net->medlookup == NULL) {
         net->medlookup = calloc(1,sizeof(struct medlookup));
     }
-    maxsigma = sigma_max(net->sigma)+1;
-    cm = calloc(maxsigma*maxsigma, sizeof(int));
-    net->medlookup->confusion_matrix = cm;
-    for (i = 0; i < maxsigma; i++) {
-        for (j = 0; j < maxsigma; j++) {
-            if (i == j)
-                *(cm+i*maxsigma+j) = 0;
-            else
-                *(cm+i*maxsigma+j) = 1;
-        }
-    } 
+    free(net->medlookup->cells);
+    net->medlookup->cells = NULL;
+    net->medlookup->numcells = 0;
+    net->medlookup->tablesize = 0;
+    net->medlookup->substitute_cost = 1;
+    net->medlookup->insert_cost = 1;
+    net->medlookup->delete_cost = 1;
 }
 
+/* Setting a default overrides all earlier costs of that kind */
+
 void cmatrix_default_substitute(struct fsm *net, int cost) {
-    int i, j, maxsigma, *cm;
-    cm = net->medlookup->confusion_matrix;
-    maxsigma = sigma_max(net->sigma)+1;
-    for (i = 1; i < maxsigma; i++) {
-        for (j = 1; j < maxsigma; j++) {
-            if (i == j) {
-                *(cm+i*maxsigma+j) = 0;                
-            } else {
-                *(cm+i*maxsigma+j) = cost;
-            }
-        }
-    } 
+    net->medlookup->substitute_cost = cost;
+    if (net->medlookup->numcells > 0)
+        cmatrix_rehash(net->medlookup, net->medlookup->tablesize, cmatrix_not_substitution);
 }
 
 void cmatrix_default_insert(struct fsm *net, int cost) {
-    int i, maxsigma, *cm;
-    cm = net->medlookup->confusion_matrix;
-    maxsigma = sigma_max(net->sigma)+1;
-    for (i = 0; i < maxsigma; i++) {
-        *(cm+i) = cost;
-    }
+    net->medlookup->insert_cost = cost;
+    if (net->medlookup->numcells > 0)
+        cmatrix_rehash(net->medlookup, net->medlookup->tablesize, cmatrix_not_insertion);
 }
 
 void cmatrix_default_delete(struct fsm *net, int cost) {
-    int i, maxsigma, *cm;
-    cm = net->medlookup->confusion_matrix;
+    net->medlookup->delete_cost = cost;
+    if (net->medlookup->numcells > 0)
+        cmatrix_rehash(net->medlookup, net->medlookup->tablesize, cmatrix_not_deletion);
+}
+
+/* Convert a dense maxsigma x maxsigma matrix (as stored by older */
+/* versions) taking the most common cost of each kind as default  */
+
+static int cmatrix_majority(int *cm, int maxsigma, int kind) {
+    int i, j, candidate, count, value;
+    candidate = 1;
+    count = 0;
+    for (i = kind == 1 ? 0 : 1; i < (kind == 1 ? 1 : maxsigma); i++) {
+        for (j = kind == 2 ? 0 : 1; j < (kind == 2 ? 1 : maxsigma); j++) {
+            if (i == j)
+                continue;
+            value = *(cm+i*maxsigma+j);
+            if (count == 0) {
+                candidate = value;
+                count = 1;
+            } else if (value == candidate) {
+                count++;
+            } else {
+                count--;
+            }
+        }
+    }
+    return(candidate);
+}
+
+void cmatrix_import_dense(struct fsm *net, int *cm) {
+    int i, j, maxsigma;
     maxsigma = sigma_max(net->sigma)+1;
+    cmatrix_init(net);
+    net->medlookup->substitute_cost = cmatrix_majority(cm, maxsigma, 0);
+    net->medlookup->insert_cost = cmatrix_majority(cm, maxsigma, 1);
+    net->medlookup->delete_cost = cmatrix_majority(cm, maxsigma, 2);
     for (i = 0; i < maxsigma; i++) {
-        *(cm+i*maxsigma) = cost;
+        for (j = 0; j < maxsigma; j++) {
+            if (i != 0 || j != 0)
+                cmatrix_put(net->medlookup, i, j, *(cm+i*maxsigma+j));
+        }
     }
 }
 
 void cmatrix_set_cost(struct fsm *net, char *in, char *out, int cost) {
-    int i, o, maxsigma, *cm;
-    cm = net->medlookup->confusion_matrix;
-    maxsigma = sigma_max(net->sigma) + 1;
+    int i, o;
     if (in == NULL) {
         i = 0;
     } else {
@@ -876,5 +1198,5 @@ void cmatrix_set_cost(struct fsm *net, char *in, char *out, int cost) {
         printf("Warning, symbol '%s' not in alphabet\n",out);
         return;
     }
-    *(cm+i*maxsigma+o) = cost;
+    cmatrix_put(net->medlookup, i, o, cost);
 }
@@ -46,44 +46,118 @@ void *fsm_get_option(unsigned long long option) {
 	return NULL;
 }
 
-int linesortcompin(const void *_a, const void *_b) {
-    const struct fsm_state *a = _a;
-    const struct fsm_state *b = _b;
-    return (a->in - b->in);
+/* Arc sorting: the arcs of each state are sorted by their in or out  */
+/* symbol with a stable counting sort on the symbol number, in one    */
+/* pass if the symbols of the state span at most 256 numbers and in   */
+/* two passes of 8 bits otherwise; states with only a few arcs use an */
+/* insertion sort.  A big net is cut into runs of whole states that   */
+/* are sorted by separate threads.                                    */
+
+#define ARCSORT_INSERTION_MAX 16
+#define ARCSORT_PARALLEL_MIN 1048576
+
+struct arcsort_job {
+    struct fsm_state *fsm;
+    int first;
+    int last;                   /* Sort the states of lines first..last-1 */
+    int direction;
+};
+
+static INLINE int arcsort_key(struct fsm_state *line, int direction) {
+    return(direction == 1 ? (unsigned short) line->in : (unsigned short) line->out);
+}
+
+static void arcsort_state(struct fsm_state *lines, int numlines, int direction, struct fsm_state **scratch, int *scratchsize) {
+    struct fsm_state tmp, *src, *dst, *swap;
+    int i, j, key, min, max, shift, passes, count[257];
+
+    if (numlines <= ARCSORT_INSERTION_MAX) {
+	for (i = 1; i < numlines; i++) {
+	    tmp = *(lines+i);
+	    key = arcsort_key(&tmp, direction);
+	    for (j = i; j > 0 && arcsort_key(lines+j-1, direction) > key; j--)
+		*(lines+j) = *(lines+j-1);
+	    *(lines+j) = tmp;
+	}
+	return;
+    }
+    min = max = arcsort_key(lines, direction);
+    for (i = 1; i < numlines; i++) {
+	key = arcsort_key(lines+i, direction);
+	if (key < min)
+	    min = key;
+	if (key > max)
+	    max = key;
+    }
+    if (numlines > *scratchsize) {
+	*scratchsize = numlines * 2;
+	*scratch = realloc(*scratch, sizeof(struct fsm_state) * *scratchsize);
+    }
+    src = lines;
+    dst = *scratch;
+    passes = (max - min) < 256 ? 1 : 2;
+    for (shift = 0; shift < passes * 8; shift += 8) {
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < numlines; i++)
+	    count[(((arcsort_key(src+i, direction) - min) >> shift) & 255) + 1]++;
+	for (i = 1; i < 257; i++)
+	    count[i] += count[i-1];
+	for (i = 0; i < numlines; i++)
+	    *(dst+count[((arcsort_key(src+i, direction) - min) >> shift) & 255]++) = *(src+i);
+	swap = src; src = dst; dst = swap;
+    }
+    if (src != lines)
+	memcpy(lines, src, sizeof(struct fsm_state) * numlines);
 }
 
-int linesortcompout(const void *_a, const void *_b) {
-    const struct fsm_state *a = _a;
-    const struct fsm_state *b = _b;
-    return (a->out - b->out);
+static void *arcsort_run(void *arg) {
+    struct arcsort_job *job;
+    struct fsm_state *fsm, *scratch;
+    int i, lasthead, scratchsize;
+
+    job = arg;
+    fsm = job->fsm;
+    scratch = NULL;
+    scratchsize = 0;
+    for (i = job->first, lasthead = job->first; i < job->last; i++) {
+	/* A run of arcs ends at a change of state or at an arcless line */
+	if ((fsm+i)->target == -1) {
+	    lasthead = i + 1;
+	} else if (i + 1 == job->last || (fsm+i)->state_no != (fsm+i+1)->state_no || (fsm+i+1)->target == -1) {
+	    if (i + 1 - lasthead > 1)
+		arcsort_state(fsm+lasthead, i + 1 - lasthead, job->direction, &scratch, &scratchsize);
+	    lasthead = i + 1;
+	}
+    }
+    free(scratch);
+    return NULL;
 }
 
 void fsm_sort_arcs(struct fsm *net, int direction) {
     /* direction 1 = in, direction = 2, out */
     struct fsm_state *fsm;
-    int i, lasthead, numlines;
-    int(*scin)(const void*,const void*) = linesortcompin;
-    int(*scout)(const void*, const void*) = linesortcompout;
+    struct arcsort_job *jobs;
+    int i, numlines, numjobs, nthreads, cut;
+
     fsm = net->states;
-    for (i=0, numlines = 0, lasthead = 0 ; (fsm+i)->state_no != -1; i++) {
-	if ((fsm+i)->state_no != (fsm+i+1)->state_no || (fsm+i)->target == -1) {
-	    numlines++;
-	    if ((fsm+i)->target == -1) {
-		numlines--;
-	    }
-	    if (numlines > 1) {
-		/* Sort, set numlines = 0 */
-		if (direction == 1)
-		    qsort(fsm+lasthead, numlines, sizeof(struct fsm_state), scin);
-		else
-		    qsort(fsm+lasthead, numlines, sizeof(struct fsm_state), scout);		
-	    }
-	    numlines = 0;
-	    lasthead = i + 1;
-	    continue;
-	}
-	numlines++;
+    for (numlines = 0; (fsm+numlines)->state_no != -1; numlines++) { }
+    nthreads = numlines >= ARCSORT_PARALLEL_MIN ? foma_num_cpus() : 1;
+    jobs = malloc(sizeof(struct arcsort_job) * nthreads);
+    /* Cut the lines into runs of about equal size at state boundaries */
+    for (i = 0, numjobs = 0; i < numlines; numjobs++) {
+	cut = (int) ((long long) numlines * (numjobs + 1) / nthreads);
+	if (cut <= i)
+	    cut = i + 1;
+	while (cut < numlines && (fsm+cut)->state_no == (fsm+cut-1)->state_no)
+	    cut++;
+	(jobs+numjobs)->fsm = fsm;
+	(jobs+numjobs)->first = i;
+	(jobs+numjobs)->last = cut;
+	(jobs+numjobs)->direction = direction;
+	i = cut;
     }
+    foma_parallel_run(arcsort_run, jobs, sizeof(struct arcsort_job), numjobs, nthreads);
+    free(jobs);
     if (net->arity == 1) {
 	net->arcs_sorted_in = 1;
 	net->arcs_sorted_out = 1;
@@ -214,9 +288,9 @@ int fsm_destroy(struct fsm *net) {
     if (net == NULL) {
         return 0;
     }
-    if (net->medlookup != NULL && net->medlookup->confusion_matrix != NULL) {
-        free(net->medlookup->confusion_matrix);
-	net->medlookup->confusion_matrix = NULL;
+    if (net->medlookup != NULL && net->medlookup->cells != NULL) {
+        free(net->medlookup->cells);
+	net->medlookup->cells = NULL;
     }
     if (net->medlookup != NULL) {
         free(net->medlookup);
@@ -282,6 +356,7 @@ struct fsm *fsm_identity() {
   sigma->number = IDENTITY;
   sigma->symbol = strdup("@_IDENTITY_SYMBOL_@");
   sigma->next = NULL;
+  sigma->id = -1;
   net->sigma = sigma;
   fsm_update_flags(net,YES,YES,YES,YES,YES,NO);
   net->statecount = 2;
@@ -448,6 +523,7 @@ int fsm_isidentity(struct fsm *net) {
     short int in, out, *newstring = NULL;
     struct discrepancy *discrepancy, *currd, *targetd;
     struct fsm *tmp;
+    struct ptr_stack *stack;
 
     tmp = fsm_minimize(fsm_copy(net));
     fsm_count(tmp);
@@ -455,12 +531,12 @@ int fsm_isidentity(struct fsm *net) {
     num_states = tmp->statecount;
     discrepancy = calloc(num_states,sizeof(struct discrepancy));
     state_array = map_firstlines(tmp);
-    ptr_stack_clear();
-    ptr_stack_push(state_array->transitions);
+    stack = ptr_stack_init();
+    ptr_stack_push(stack, state_array->transitions);
 
-    while(!ptr_stack_isempty()) {
+    while(!ptr_stack_isempty(stack)) {
 
-        curr_ptr = ptr_stack_pop();
+        curr_ptr = ptr_stack_pop(stack);
 
     nopop:
         v = curr_ptr->state_no; /* source state number */
@@ -542,7 +618,7 @@ int fsm_isidentity(struct fsm *net) {
         if (((state_array+vp)->transitions)->final_state && newlength != 0)
             goto fail;
         if (curr_ptr->state_no == (curr_ptr+1)->state_no) {
-            ptr_stack_push(curr_ptr+1);
+            ptr_stack_push(stack, curr_ptr+1);
         }
         if ((discrepancy+vp)->visited) {
             //free(newstring);
@@ -562,6 +638,7 @@ int fsm_isidentity(struct fsm *net) {
     }
     free(state_array);
     free(discrepancy);
+    ptr_stack_free(stack);
     fsm_destroy(tmp);
     if (newstring != NULL)
         free(newstring);
@@ -569,7 +646,7 @@ int fsm_isidentity(struct fsm *net) {
  fail:
     free(state_array);
     free(discrepancy);
-    ptr_stack_clear();
+    ptr_stack_free(stack);
     fsm_destroy(tmp);
     if (newstring != NULL)
         free(newstring);
@@ -681,6 +758,7 @@ struct fsm *fsm_extract_nonidentity(struct fsm *net) {
     int i, j, v, vp, num_states, factor = 0, newlength = 1, startfrom, killnum;
     short int in, out, *newstring;
     struct discrepancy *discrepancy, *currd, *targetd;
+    struct ptr_stack *stack;
 
     fsm_minimize(net);
     fsm_count(net);
@@ -689,11 +767,12 @@ struct fsm *fsm_extract_nonidentity(struct fsm *net) {
     num_states = net->statecount;
     discrepancy = calloc(num_states,sizeof(struct discrepancy));
     state_array = map_firstlines(net);
-    ptr_stack_push(state_array->transitions);
+    stack = ptr_stack_init();
+    ptr_stack_push(stack, state_array->transitions);
 
-    while(!ptr_stack_isempty()) {
+    while(!ptr_stack_isempty(stack)) {
 
-        curr_ptr = ptr_stack_pop();
+        curr_ptr = ptr_stack_pop(stack);
 
     nopop:
         v = curr_ptr->state_no; /* source state number */
@@ -772,7 +851,7 @@ struct fsm *fsm_extract_nonidentity(struct fsm *net) {
         if (((state_array+vp)->transitions)->final_state && newlength != 0)
             goto fail;
         if (curr_ptr->state_no == (curr_ptr+1)->state_no) {
-            ptr_stack_push(curr_ptr+1);
+            ptr_stack_push(stack, curr_ptr+1);
         }
 
         if ((discrepancy+vp)->visited) {
@@ -794,10 +873,10 @@ struct fsm *fsm_extract_nonidentity(struct fsm *net) {
     fail:        
         curr_ptr->out = killnum;
         if (curr_ptr->state_no == (curr_ptr+1)->state_no) {
-            ptr_stack_push(curr_ptr+1);
+            ptr_stack_push(stack, curr_ptr+1);
         }        
     }
-    ptr_stack_clear();
+    ptr_stack_free(stack);
     sigma_sort(net);
     net2 = fsm_upper(fsm_compose(net,fsm_contains(fsm_symbol("@KILL@"))));
     sigma_remove("@KILL@",net2->sigma);
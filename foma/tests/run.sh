@@ -10,3 +10,34 @@ fi
 foma -q -f test-segfault-long-name > /dev/null || exit 1
 foma -q -f test-segfault-empty-fst.foma > /dev/null || exit 1;
 foma -q -f test-leaky-test.foma > /dev/null || exit 1;
+test-lib || exit 1
+foma -q -f test-bench.foma > /dev/null || exit 1;
+cp /tmp/foma-test-bench.bin '/tmp/foma-test-bench"\.bin'
+printf 'a\nc\ne\n' > /tmp/foma-test-bench.txt
+fomabench -i -t 0 '/tmp/foma-test-bench"\.bin' /tmp/foma-test-bench.txt > /tmp/foma-test-bench.out || exit 1
+grep -qF '{"file": "/tmp/foma-test-bench\"\\.bin", "words": 3, "mode": "down"' /tmp/foma-test-bench.out || exit 1
+grep -q '"threads": [1-9]' /tmp/foma-test-bench.out || exit 1
+foma -q -f test-multi-net.foma > /dev/null || exit 1;
+cat /tmp/foma-test-multi-1.bin /tmp/foma-test-multi-2.bin /tmp/foma-test-multi-1.bin > /tmp/foma-test-multi.bin
+printf 'a\nc\ne\ng\n' | flookup -a -i -x /tmp/foma-test-multi.bin > /tmp/foma-test-multi.out || exit 1
+[ "$(grep -v '^$' /tmp/foma-test-multi.out | tr '\n' ' ')" = "b d f +? " ] || exit 1
+foma -q -f test-multi-net-load.foma > /dev/null || exit 1;
+printf 'a\nc\ne\ng\n' | flookup -a -i -x /tmp/foma-test-multi-resaved.bin > /tmp/foma-test-multi.out || exit 1
+[ "$(grep -v '^$' /tmp/foma-test-multi.out | tr '\n' ' ')" = "b d f +? " ] || exit 1
+gzip -t /tmp/foma-test-multi-2.bin /tmp/foma-test-multi-9.bin || exit 1
+head -n 1 /tmp/foma-test-multi-plain.bin | grep -q '^##foma-net' || exit 1
+for f in /tmp/foma-test-multi-plain.bin /tmp/foma-test-multi-9.bin; do
+  [ "$(printf 'c\ne\n' | flookup -a -i -x $f | grep -v '^$' | tr '\n' ' ')" = "d f " ] || exit 1
+done
+foma -q -f test-compose-n.foma | grep -q '^1 (1 = TRUE' || exit 1
+foma -q -f test-write-words.foma > /dev/null || exit 1;
+sort /tmp/foma-test-words-1.txt > /tmp/foma-test-words-1.sorted
+sort /tmp/foma-test-words-4.txt > /tmp/foma-test-words-4.sorted
+cmp /tmp/foma-test-words-1.sorted /tmp/foma-test-words-4.sorted || exit 1
+[ "$(wc -l < /tmp/foma-test-words-4.txt)" -eq 1093 ] || exit 1
+[ "$(sort -u /tmp/foma-test-lower-4.txt | wc -l)" -eq 1093 ] && ! grep -q a /tmp/foma-test-lower-4.txt || exit 1
+foma -q -f test-limits.foma > /dev/null || exit 1;
+echo aaaa | flookup -i -x -l 0,3,0 /tmp/foma-test-limits.bin > /tmp/foma-test-limits.out || exit 1
+[ "$(grep -c . /tmp/foma-test-limits.out)" = 4 ] && grep -qx '+!' /tmp/foma-test-limits.out || exit 1
+printf 'aaaa\naaaa\n' | flookup -i -x -c 1M -l 0,3,0 /tmp/foma-test-limits.bin > /tmp/foma-test-limits.out || exit 1
+[ "$(grep -cx '+!' /tmp/foma-test-limits.out)" = 2 ] || exit 1
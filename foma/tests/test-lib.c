@@ -0,0 +1,1114 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+/* Checks of library calls that the foma and flookup command lines */
+/* cannot reach.  Nets are built with fsm_construct, with the trie */
+/* builder or line by line, so that this does not depend on the    */
+/* regex parser.  Run from tests/run.sh.                           */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "fomalib.h"
+
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#endif
+
+static int failures = 0;
+
+#define TEST_WORDS 500
+#define TEST_THREADS 4
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* [a:b|a:c]* */
+static struct fsm *net_ab_ac(void) {
+    struct fsm_construct_handle *c;
+    c = fsm_construct_init("ab_ac");
+    fsm_construct_add_arc(c, 0, 0, "a", "b");
+    fsm_construct_add_arc(c, 0, 0, "a", "c");
+    fsm_construct_set_initial(c, 0);
+    fsm_construct_set_final(c, 0);
+    return(fsm_construct_done(c));
+}
+
+static int count_down(struct apply_handle *h, char *word) {
+    int count;
+    char *result;
+    for (count = 0, result = apply_down(h, word); result != NULL; result = apply_down(h, NULL))
+        count++;
+    return(count);
+}
+
+/* A small cache still keeps what it can: its own tables take only */
+/* part of its budget                                                */
+static void test_cache_budget(void) {
+    struct fsm *net;
+    struct apply_handle *h;
+    struct apply_cache *cache;
+    unsigned long long hits, misses;
+    size_t mem_used;
+
+    net = net_ab_ac();
+    h = apply_init(net);
+    cache = apply_cache_init(4096);
+    apply_set_cache(h, cache);
+    CHECK(count_down(h, "a") == 2);
+    CHECK(count_down(h, "aa") == 4);
+    CHECK(count_down(h, "a") == 2);
+    CHECK(count_down(h, "aa") == 4);
+    apply_cache_stats(cache, &hits, &misses, &mem_used);
+    CHECK(hits == 2 && misses == 2);
+    CHECK(mem_used <= 4096);
+    apply_clear(h);
+    apply_cache_clear(cache);
+    fsm_destroy(net);
+}
+
+/* A result limit applies to answers replayed from the cache too */
+static void test_limits_cached(void) {
+    struct fsm *net;
+    struct apply_handle *h;
+    struct apply_cache *cache;
+
+    net = net_ab_ac();
+    h = apply_init(net);
+    cache = apply_cache_init(1024*1024);
+    apply_set_cache(h, cache);
+    CHECK(count_down(h, "aaaa") == 16);
+    CHECK(apply_truncated(h) == 0);
+    apply_set_limits(h, 0, 3, 0);
+    CHECK(count_down(h, "aaaa") == 3);
+    CHECK(apply_truncated(h) == 1);
+    apply_set_limits(h, 0, 16, 0);
+    CHECK(count_down(h, "aaaa") == 16);
+    CHECK(apply_truncated(h) == 0);
+    apply_set_limits(h, 0, 0, 0);
+    CHECK(count_down(h, "aaaa") == 16);
+    CHECK(apply_truncated(h) == 0);
+    apply_clear(h);
+    apply_cache_clear(cache);
+    fsm_destroy(net);
+}
+
+/* The word for i on the upper side, and on the lower side */
+static void word_pair(int i, char *upper, char *lower) {
+    int len;
+    len = sprintf(upper, "%i", i * 7919 % 100000);
+    for (lower[len] = '\0'; len > 0; len--)
+        lower[strlen(upper)-len] = upper[len-1] == '0' ? 'o' : upper[len-1];
+}
+
+/* Digit strings mapped to their reverse, with 0 written as o */
+static struct fsm *net_reverse_digits(void) {
+    struct fsm_trie_handle *th;
+    char upper[16], lower[16], in[2], out[2];
+    int i, j;
+    th = fsm_trie_init();
+    for (i = 0; i < TEST_WORDS; i++) {
+        word_pair(i, upper, lower);
+        for (j = 0; upper[j] != '\0'; j++) {
+            in[0] = upper[j]; in[1] = '\0';
+            out[0] = lower[j]; out[1] = '\0';
+            fsm_trie_symbol(th, in, out);
+        }
+        fsm_trie_end_word(th);
+    }
+    return(fsm_minimize(fsm_trie_done(th)));
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return(strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/* All results of word, sorted and joined by commas */
+static char *results_of(struct apply_handle *h, char *word, int down) {
+    char *result, *results[64], *joined;
+    int i, count;
+    size_t len;
+    result = down ? apply_down(h, word) : apply_up(h, word);
+    for (count = 0, len = 1; result != NULL && count < 64; count++) {
+        results[count] = strdup(result);
+        len += strlen(result) + 1;
+        result = down ? apply_down(h, NULL) : apply_up(h, NULL);
+    }
+    qsort(results, count, sizeof(char *), compare_strings);
+    joined = calloc(len, 1);
+    for (i = 0; i < count; i++) {
+        strcat(joined, results[i]);
+        strcat(joined, ",");
+        free(results[i]);
+    }
+    return(joined);
+}
+
+/* Every word in both directions gives the same results through h as */
+/* through plain, an unindexed handle                                */
+static int same_results(struct apply_handle *h, struct apply_handle *plain) {
+    char upper[16], lower[16], *a, *b;
+    int i, same;
+    for (i = 0, same = 1; i < TEST_WORDS; i++) {
+        word_pair(i, upper, lower);
+        a = results_of(h, upper, 1);
+        b = results_of(plain, upper, 1);
+        same = same && strcmp(a, b) == 0 && *a != '\0';
+        free(a);
+        free(b);
+        a = results_of(h, lower, 0);
+        b = results_of(plain, lower, 0);
+        same = same && strcmp(a, b) == 0 && *a != '\0';
+        free(a);
+        free(b);
+    }
+    return(same);
+}
+
+struct index_thread {
+    struct fsm *net;
+    struct apply_handle *h;
+    int same;
+};
+
+static void *index_thread_run(void *arg) {
+    struct index_thread *t = arg;
+    struct apply_handle *plain;
+    plain = apply_init(t->net);
+    t->same = same_results(t->h, plain);
+    apply_clear(t->h);
+    apply_clear(plain);
+    return NULL;
+}
+
+/* Indexed results equal unindexed ones, and a shared index outlives */
+/* the handle that built it and may be released in any thread        */
+static void test_index_shared(void) {
+    struct fsm *net;
+    struct apply_handle *h, *plain;
+    struct index_thread t[TEST_THREADS];
+    int i;
+#ifdef FOMA_PTHREADS
+    pthread_t tids[TEST_THREADS];
+#endif
+
+    net = net_reverse_digits();
+    plain = apply_init(net);
+    for (i = 1; i <= 2; i++) {
+        h = apply_init(net);
+        apply_index(h, APPLY_INDEX_BOTH, i, INT_MAX, 0);
+        CHECK(same_results(h, plain));
+        apply_clear(h);
+    }
+    h = apply_init(net);
+    apply_index(h, APPLY_INDEX_BOTH, 1, INT_MAX, 0);
+    for (i = 0; i < TEST_THREADS; i++) {
+        t[i].net = net;
+        t[i].h = apply_init(net);
+        t[i].same = 0;
+        CHECK(apply_index_share(t[i].h, h));
+    }
+    apply_clear(h);
+#ifdef FOMA_PTHREADS
+    for (i = 1; i < TEST_THREADS; i++)
+        pthread_create(tids+i, NULL, index_thread_run, t+i);
+    index_thread_run(t);
+    for (i = 1; i < TEST_THREADS; i++)
+        pthread_join(tids[i], NULL);
+#else
+    for (i = 0; i < TEST_THREADS; i++)
+        index_thread_run(t+i);
+#endif
+    for (i = 0; i < TEST_THREADS; i++)
+        CHECK(t[i].same);
+    apply_clear(plain);
+    fsm_destroy(net);
+}
+
+/* A rewrite of one symbol, leaving the others (and anything else) as is */
+static struct fsm *net_rewrite(char *from, char *to) {
+    struct fsm_construct_handle *c;
+    c = fsm_construct_init("rewrite");
+    fsm_construct_add_arc(c, 0, 0, from, to);
+    fsm_construct_add_arc(c, 0, 0, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@");
+    fsm_construct_set_initial(c, 0);
+    fsm_construct_set_final(c, 0);
+    return(fsm_construct_done(c));
+}
+
+/* a:0 after b, or anything else as is */
+static struct fsm *net_delete_after(void) {
+    struct fsm_construct_handle *c;
+    c = fsm_construct_init("delete");
+    fsm_construct_add_arc(c, 0, 0, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@");
+    fsm_construct_add_arc(c, 0, 0, "a", "a");
+    fsm_construct_add_arc(c, 0, 1, "b", "b");
+    fsm_construct_add_arc(c, 1, 1, "b", "b");
+    fsm_construct_add_arc(c, 1, 0, "a", "@_EPSILON_SYMBOL_@");
+    fsm_construct_add_arc(c, 1, 0, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@");
+    fsm_construct_set_initial(c, 0);
+    fsm_construct_set_final(c, 0);
+    fsm_construct_set_final(c, 1);
+    return(fsm_construct_done(c));
+}
+
+/* The n-way cascade is the same as composing pairwise from the left */
+static void test_compose_n(void) {
+    struct fsm *nets[4], *copies[4], *pairwise, *cascade;
+    int i;
+
+    nets[0] = net_delete_after();
+    nets[1] = net_rewrite("a", "b");
+    nets[2] = net_rewrite("b", "c");
+    nets[3] = net_delete_after();
+    pairwise = fsm_copy(nets[0]);
+    for (i = 1; i < 4; i++)
+        pairwise = fsm_compose(pairwise, fsm_copy(nets[i]));
+    for (i = 0; i < 4; i++)
+        copies[i] = fsm_copy(nets[i]);
+    cascade = fsm_compose_n(copies, 4);
+    CHECK(fsm_equivalent(fsm_minimize(pairwise), fsm_minimize(cascade)));
+    for (i = 0; i < 4; i++)
+        fsm_destroy(nets[i]);
+    cascade = fsm_compose_n(NULL, 0);
+    CHECK(fsm_isidentity(cascade));
+    fsm_destroy(cascade);
+}
+
+/* Words and indexes map to each other, and input is split into */
+/* symbols as apply splits it                                    */
+static void test_word_index(void) {
+    struct fsm_construct_handle *c;
+    struct fsm *net;
+    struct fsm_word_index *wi;
+    char upper[16], lower[16], *word;
+    long long i, size;
+    int roundtrip;
+
+    net = fsm_minimize(fsm_upper(net_reverse_digits()));
+    wi = fsm_word_index_init(net);
+    CHECK(wi != NULL);
+    if (wi != NULL) {
+        size = fsm_word_index_size(wi);
+        CHECK(size == TEST_WORDS);
+        for (i = 0, roundtrip = 1; i < size; i++) {
+            word = fsm_index_to_word(wi, i);
+            roundtrip = roundtrip && word != NULL && fsm_word_to_index(wi, word) == i;
+        }
+        CHECK(roundtrip);
+        for (i = 0, roundtrip = 1; i < TEST_WORDS; i++) {
+            word_pair(i, upper, lower);
+            roundtrip = roundtrip && strcmp(fsm_index_to_word(wi, fsm_word_to_index(wi, upper)), upper) == 0;
+        }
+        CHECK(roundtrip);
+        CHECK(fsm_index_to_word(wi, size) == NULL);
+        CHECK(fsm_word_to_index(wi, "x") == -1);
+        fsm_word_index_clear(wi);
+    }
+    fsm_destroy(net);
+
+    /* a b | c ab: apply reads "ab" as the symbol ab, so only cab is found */
+    c = fsm_construct_init("multichar");
+    fsm_construct_add_arc(c, 0, 1, "a", "a");
+    fsm_construct_add_arc(c, 1, 3, "b", "b");
+    fsm_construct_add_arc(c, 0, 2, "c", "c");
+    fsm_construct_add_arc(c, 2, 3, "ab", "ab");
+    fsm_construct_set_initial(c, 0);
+    fsm_construct_set_final(c, 3);
+    net = fsm_construct_done(c);
+    wi = fsm_word_index_init(net);
+    CHECK(wi != NULL);
+    if (wi != NULL) {
+        CHECK(fsm_word_index_size(wi) == 2);
+        CHECK(fsm_word_to_index(wi, "ab") == -1);
+        CHECK(fsm_word_to_index(wi, "cab") != -1);
+        fsm_word_index_clear(wi);
+    }
+    fsm_destroy(net);
+}
+
+static char *med_words[] = {"cat", "cart", "dog", "dot", "cot", "toad"};
+#define MED_WORDS 6
+
+static int med_substitute_cost(char a, char b) {
+    if (a == b)
+        return 0;
+    if ((a == 'a' && b == 'o') || (a == 'o' && b == 'a'))
+        return 1;
+    if ((a == 't' && b == 'd') || (a == 'd' && b == 't'))
+        return 2;
+    return 3;
+}
+
+/* Edit distance with the costs above and 2 per insertion or deletion */
+static int med_distance(char *x, char *y) {
+    int d[16][16], i, j, lx, ly, c;
+    lx = strlen(x);
+    ly = strlen(y);
+    for (i = 0; i <= lx; i++) {
+        for (j = 0; j <= ly; j++) {
+            if (i == 0 || j == 0) {
+                d[i][j] = 2 * (i + j);
+                continue;
+            }
+            d[i][j] = d[i-1][j-1] + med_substitute_cost(x[i-1], y[j-1]);
+            if ((c = d[i-1][j] + 2) < d[i][j])
+                d[i][j] = c;
+            if ((c = d[i][j-1] + 2) < d[i][j])
+                d[i][j] = c;
+        }
+    }
+    return(d[lx][ly]);
+}
+
+/* Every query's best cost through apply_med equals the edit distance */
+/* to the closest word; returns the number of queries that differ     */
+static int med_mismatches(struct fsm *net) {
+    struct apply_med_handle *medh;
+    char query[4], *letters = "acdot";
+    int n, i, k, best, d, bad;
+    medh = apply_med_init(net);
+    apply_med_set_med_limit(medh, 1);
+    apply_med_set_med_cutoff(medh, 20);
+    for (n = 0, bad = 0; n < 5*5*5; n++) {
+        for (i = 0, k = n; i < 3; i++, k /= 5)
+            query[i] = letters[k % 5];
+        query[3] = '\0';
+        for (i = 0, best = 1000; i < MED_WORDS; i++) {
+            if ((d = med_distance(query, med_words[i])) < best)
+                best = d;
+        }
+        if (apply_med(medh, query) == NULL || apply_med_get_cost(medh) != best)
+            bad++;
+    }
+    apply_med_clear(medh);
+    return(bad);
+}
+
+/* The sparse confusion matrix gives the costs set, also after a save */
+static void test_cmatrix(void) {
+    struct fsm_trie_handle *th;
+    struct fsm *net, *loaded;
+    int i;
+
+    th = fsm_trie_init();
+    for (i = 0; i < MED_WORDS; i++)
+        fsm_trie_add_word(th, med_words[i]);
+    net = fsm_minimize(fsm_trie_done(th));
+    cmatrix_init(net);
+    cmatrix_default_substitute(net, 3);
+    cmatrix_default_insert(net, 2);
+    cmatrix_default_delete(net, 2);
+    cmatrix_set_cost(net, "a", "o", 1);
+    cmatrix_set_cost(net, "o", "a", 1);
+    cmatrix_set_cost(net, "t", "d", 2);
+    cmatrix_set_cost(net, "d", "t", 2);
+    CHECK(med_mismatches(net) == 0);
+    CHECK(fsm_write_binary_file(net, "/tmp/foma-test-lib-cmatrix.bin") == 0);
+    loaded = fsm_read_binary_file("/tmp/foma-test-lib-cmatrix.bin");
+    CHECK(loaded != NULL);
+    if (loaded != NULL) {
+        CHECK(med_mismatches(loaded) == 0);
+        fsm_destroy(loaded);
+    }
+    fsm_destroy(net);
+}
+
+/* A small automaton kept as arc lists, so that acceptance can be */
+/* checked directly against what the library makes of it          */
+struct test_nfa {
+    int states;
+    int arcs;
+    int *source;
+    int *target;
+    int *symbol;                /* 0 for epsilon, else a letter */
+    int *output;                /* the same, on the lower side   */
+    char *initial;
+    char *final;
+};
+
+static unsigned int test_seed = 1;
+
+static int test_rand(int n) {
+    test_seed = test_seed * 1103515245U + 12345U;
+    return((int)((test_seed >> 16) % (unsigned int) n));
+}
+
+static struct test_nfa *nfa_init(int states, int arcs) {
+    struct test_nfa *nfa;
+    nfa = calloc(1, sizeof(struct test_nfa));
+    nfa->states = states;
+    nfa->source = calloc(arcs, sizeof(int));
+    nfa->target = calloc(arcs, sizeof(int));
+    nfa->symbol = calloc(arcs, sizeof(int));
+    nfa->output = calloc(arcs, sizeof(int));
+    nfa->initial = calloc(states, 1);
+    nfa->final = calloc(states, 1);
+    return(nfa);
+}
+
+static void nfa_add_arc(struct test_nfa *nfa, int source, int target, int symbol) {
+    nfa->source[nfa->arcs] = source;
+    nfa->target[nfa->arcs] = target;
+    nfa->symbol[nfa->arcs] = symbol;
+    nfa->output[nfa->arcs] = symbol;
+    nfa->arcs++;
+}
+
+static void nfa_free(struct test_nfa *nfa) {
+    free(nfa->source);
+    free(nfa->target);
+    free(nfa->symbol);
+    free(nfa->output);
+    free(nfa->initial);
+    free(nfa->final);
+    free(nfa);
+}
+
+/* Random arcs over a, b, c; one in epsilon_every is an epsilon */
+static struct test_nfa *nfa_random(int states, int arcs, int epsilon_every) {
+    struct test_nfa *nfa;
+    int i;
+    nfa = nfa_init(states, arcs);
+    for (i = 0; i < arcs; i++)
+        nfa_add_arc(nfa, test_rand(states), test_rand(states), test_rand(epsilon_every) == 0 ? 0 : 'a' + test_rand(3));
+    for (i = 0; i < states; i++)
+        nfa->final[i] = test_rand(3) == 0;
+    nfa->initial[0] = 1;
+    nfa->initial[test_rand(states)] = 1;
+    return(nfa);
+}
+
+/* Letters are themselves, 0 is epsilon, ? the identity symbol and */
+/* * the unknown symbol                                             */
+static char *nfa_symbol_name(int symbol, char *buf) {
+    if (symbol == 0)
+        return("@_EPSILON_SYMBOL_@");
+    if (symbol == '?')
+        return("@_IDENTITY_SYMBOL_@");
+    if (symbol == '*')
+        return("@_UNKNOWN_SYMBOL_@");
+    buf[0] = (char) symbol;
+    buf[1] = '\0';
+    return(buf);
+}
+
+static struct fsm *nfa_to_fsm(struct test_nfa *nfa) {
+    struct fsm_construct_handle *c;
+    char in[2], out[2];
+    int i;
+    c = fsm_construct_init("nfa");
+    for (i = 0; i < nfa->arcs; i++)
+        fsm_construct_add_arc(c, nfa->source[i], nfa->target[i], nfa_symbol_name(nfa->symbol[i], in), nfa_symbol_name(nfa->output[i], out));
+    for (i = 0; i < nfa->states; i++) {
+        if (nfa->initial[i])
+            fsm_construct_set_initial(c, i);
+        if (nfa->final[i])
+            fsm_construct_set_final(c, i);
+    }
+    return(fsm_construct_done(c));
+}
+
+/* Add the epsilon closure of the states in active to it; the arcs */
+/* of state s are order[first[s]] to order[first[s+1]-1]           */
+static void nfa_close(struct test_nfa *nfa, char *active, int *stack, int *first, int *order) {
+    int i, a, top, s;
+    for (i = 0, top = 0; i < nfa->states; i++) {
+        if (active[i])
+            stack[top++] = i;
+    }
+    while (top > 0) {
+        s = stack[--top];
+        for (i = first[s]; i < first[s+1]; i++) {
+            a = order[i];
+            if (nfa->symbol[a] == 0 && !active[nfa->target[a]]) {
+                active[nfa->target[a]] = 1;
+                stack[top++] = nfa->target[a];
+            }
+        }
+    }
+}
+
+static int nfa_accepts(struct test_nfa *nfa, char *word) {
+    char *active, *next;
+    int *stack, *first, *order, i, accepts;
+    active = malloc(nfa->states);
+    next = malloc(nfa->states);
+    stack = malloc(nfa->states * sizeof(int));
+    first = calloc(nfa->states + 1, sizeof(int));
+    order = malloc(nfa->arcs * sizeof(int) + 1);
+    for (i = 0; i < nfa->arcs; i++)
+        first[nfa->source[i]+1]++;
+    for (i = 0; i < nfa->states; i++)
+        first[i+1] += first[i];
+    for (i = 0; i < nfa->arcs; i++)
+        order[first[nfa->source[i]]++] = i;
+    for (i = nfa->states; i > 0; i--)
+        first[i] = first[i-1];
+    first[0] = 0;
+    memcpy(active, nfa->initial, nfa->states);
+    nfa_close(nfa, active, stack, first, order);
+    for ( ; *word != '\0'; word++) {
+        memset(next, 0, nfa->states);
+        for (i = 0; i < nfa->arcs; i++) {
+            if (nfa->symbol[i] == *word && active[nfa->source[i]])
+                next[nfa->target[i]] = 1;
+        }
+        memcpy(active, next, nfa->states);
+        nfa_close(nfa, active, stack, first, order);
+    }
+    for (i = 0, accepts = 0; i < nfa->states; i++)
+        accepts = accepts || (active[i] && nfa->final[i]);
+    free(active);
+    free(next);
+    free(stack);
+    free(first);
+    free(order);
+    return(accepts);
+}
+
+/* Number of words over a, b, c of up to maxlen letters that net */
+/* and nfa disagree on                                          */
+static int nfa_mismatches(struct test_nfa *nfa, struct fsm *net, int maxlen) {
+    struct apply_handle *h;
+    char word[16];
+    int len, n, k, i, total, bad;
+    h = apply_init(net);
+    for (len = 0, bad = 0, total = 1; len <= maxlen; len++, total *= 3) {
+        for (n = 0; n < total; n++) {
+            for (i = 0, k = n; i < len; i++, k /= 3)
+                word[i] = 'a' + k % 3;
+            word[len] = '\0';
+            if ((apply_up(h, word) != NULL) != nfa_accepts(nfa, word))
+                bad++;
+        }
+    }
+    apply_clear(h);
+    return(bad);
+}
+
+/* No epsilons, and no two arcs of a state on the same symbol */
+static int is_deterministic(struct fsm *net) {
+    struct fsm_state *line, *other;
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target == -1)
+            continue;
+        if (line->in == EPSILON)
+            return 0;
+        for (other = line + 1; other->state_no == line->state_no; other++) {
+            if (other->target != -1 && other->in == line->in)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Determinization keeps the language of random automata, and the */
+/* subsets of (a|b)* a (a|b)^11 stay apart in a large table        */
+static void test_determinize(void) {
+    struct test_nfa *nfa;
+    struct fsm *net;
+    int i;
+
+    for (i = 0; i < 220; i++) {
+        /* The last ones have state numbers far apart within a set */
+        nfa = i < 200 ? nfa_random(2 + test_rand(10), 1 + test_rand(30), 4) : nfa_random(300, 360, 8);
+        net = fsm_determinize(nfa_to_fsm(nfa));
+        CHECK(is_deterministic(net));
+        CHECK(nfa_mismatches(nfa, net, 5) == 0);
+        fsm_destroy(net);
+        nfa_free(nfa);
+    }
+    nfa = nfa_init(13, 26);
+    nfa_add_arc(nfa, 0, 0, 'a');
+    nfa_add_arc(nfa, 0, 0, 'b');
+    nfa_add_arc(nfa, 0, 1, 'a');
+    for (i = 1; i < 12; i++) {
+        nfa_add_arc(nfa, i, i + 1, 'a');
+        nfa_add_arc(nfa, i, i + 1, 'b');
+    }
+    nfa->initial[0] = 1;
+    nfa->final[12] = 1;
+    net = fsm_determinize(nfa_to_fsm(nfa));
+    fsm_count(net);
+    CHECK(net->statecount == 4096);
+    CHECK(is_deterministic(net));
+    CHECK(nfa_mismatches(nfa, net, 7) == 0);
+    fsm_destroy(net);
+    nfa_free(nfa);
+}
+
+/* No arc of net is an epsilon */
+static int is_epsilon_free(struct fsm *net) {
+    struct fsm_state *line;
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1 && line->in == EPSILON && line->out == EPSILON)
+            return 0;
+    }
+    return 1;
+}
+
+/* Epsilon removal and determinization agree with the automaton when */
+/* epsilons are common and form cycles, and when a long epsilon chain */
+/* makes the closures too large to be stored                          */
+static void test_epsilon_closure(void) {
+    struct test_nfa *nfa;
+    struct fsm *net;
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        nfa = nfa_random(2 + test_rand(12), 1 + test_rand(30), 2);
+        /* Epsilon removal keeps every initial state, and apply */
+        /* only starts from state 0                             */
+        memset(nfa->initial, 0, nfa->states);
+        nfa->initial[0] = 1;
+        net = fsm_epsilon_remove(nfa_to_fsm(nfa));
+        CHECK(is_epsilon_free(net));
+        CHECK(nfa_mismatches(nfa, net, 5) == 0);
+        net = fsm_determinize(net);
+        CHECK(is_deterministic(net));
+        CHECK(nfa_mismatches(nfa, net, 5) == 0);
+        fsm_destroy(net);
+        nfa_free(nfa);
+    }
+    nfa = nfa_init(2000, 2200);
+    for (i = 0; i < 1999; i++)
+        nfa_add_arc(nfa, i, i + 1, 0);
+    nfa_add_arc(nfa, 1999, 1900, 0);
+    for (i = 0; i < 2000; i += 17)
+        nfa_add_arc(nfa, i, test_rand(2) ? test_rand(8) : test_rand(2000), 'a' + test_rand(3));
+    nfa->initial[1000] = 1;
+    nfa->final[3] = 1;
+    net = fsm_epsilon_remove(nfa_to_fsm(nfa));
+    CHECK(is_epsilon_free(net));
+    CHECK(nfa_mismatches(nfa, net, 3) == 0);
+    fsm_destroy(net);
+    nfa_free(nfa);
+}
+
+/* A random transducer from letters in to letters in out; input */
+/* epsilons only go forward, so that every input has finitely    */
+/* many outputs                                                  */
+static struct test_nfa *transducer_random(int states, int arcs, char *in, char *out) {
+    struct test_nfa *nfa;
+    int i, source;
+    nfa = nfa_init(states, arcs);
+    for (i = 0; i < arcs; i++) {
+        source = test_rand(states - 1);
+        nfa->source[i] = source;
+        nfa->target[i] = test_rand(states);
+        nfa->symbol[i] = in[test_rand(strlen(in))];
+        nfa->output[i] = out[test_rand(strlen(out))];
+        if (test_rand(4) == 0) {
+            nfa->symbol[i] = 0;
+            nfa->target[i] = source + 1 + test_rand(states - source - 1);
+        }
+        if (test_rand(8) == 0)
+            nfa->symbol[i] = nfa->output[i] = '?';
+        else if (test_rand(8) == 0)
+            nfa->symbol[i] = '*';
+        nfa->arcs++;
+    }
+    for (i = 0; i < states; i++)
+        nfa->final[i] = test_rand(3) == 0;
+    nfa->initial[0] = 1;
+    return(nfa);
+}
+
+/* Add the outputs of word to *list, if not there yet */
+static void outputs_add(struct apply_handle *h, char *word, char ***list, int *count) {
+    char *result;
+    int i;
+    for (result = apply_down(h, word); result != NULL; result = apply_down(h, NULL)) {
+        for (i = 0; i < *count && strcmp((*list)[i], result) != 0; i++) { }
+        if (i < *count)
+            continue;
+        *list = realloc(*list, (*count + 1) * sizeof(char *));
+        (*list)[(*count)++] = strdup(result);
+    }
+}
+
+/* The outputs in list, sorted and joined by commas; frees list */
+static char *outputs_join(char **list, int count) {
+    char *joined;
+    int i;
+    size_t len;
+    qsort(list, count, sizeof(char *), compare_strings);
+    for (i = 0, len = 1; i < count; i++)
+        len += strlen(list[i]) + 1;
+    joined = calloc(len, 1);
+    for (i = 0; i < count; i++) {
+        strcat(joined, list[i]);
+        strcat(joined, ",");
+        free(list[i]);
+    }
+    free(list);
+    return(joined);
+}
+
+/* Number of words over a, b, c, d of up to maxlen letters whose */
+/* outputs through composed differ from those through upper, then */
+/* lower                                                          */
+static int compose_mismatches(struct fsm *composed, struct fsm *upper, struct fsm *lower, int maxlen) {
+    struct apply_handle *hc, *hu, *hl;
+    char word[16], **list, **middle, *a, *b;
+    int len, n, k, i, total, bad, count, middlecount;
+    hc = apply_init(composed);
+    hu = apply_init(upper);
+    hl = apply_init(lower);
+    for (len = 0, bad = 0, total = 1; len <= maxlen; len++, total *= 4) {
+        for (n = 0; n < total; n++) {
+            for (i = 0, k = n; i < len; i++, k /= 4)
+                word[i] = 'a' + k % 4;
+            word[len] = '\0';
+            list = NULL;
+            count = 0;
+            outputs_add(hc, word, &list, &count);
+            a = outputs_join(list, count);
+            middle = NULL;
+            middlecount = 0;
+            outputs_add(hu, word, &middle, &middlecount);
+            list = NULL;
+            count = 0;
+            for (i = 0; i < middlecount; i++)
+                outputs_add(hl, middle[i], &list, &count);
+            b = outputs_join(list, count);
+            free(outputs_join(middle, middlecount));
+            if (strcmp(a, b) != 0)
+                bad++;
+            free(a);
+            free(b);
+        }
+    }
+    apply_clear(hc);
+    apply_clear(hu);
+    apply_clear(hl);
+    return(bad);
+}
+
+/* Composition maps each input to what the first transducer and then */
+/* the second make of it, with and without minimizing the arguments  */
+/* and with either epsilon filter.  c is only known to the second    */
+/* and d to neither, so they go through identity and unknown arcs    */
+static void test_compose(void) {
+    extern int g_compose_minimize, g_compose_tristate;
+    struct test_nfa *upper, *lower;
+    struct fsm *composed, *u, *l;
+    int i;
+
+    for (i = 0; i < 120; i++) {
+        g_compose_minimize = i % 2;
+        g_compose_tristate = (i / 2) % 2;
+        upper = transducer_random(2 + test_rand(6), 1 + test_rand(16), "ab", "abc");
+        lower = transducer_random(2 + test_rand(6), 1 + test_rand(16), "abc", "abc");
+        composed = fsm_compose(nfa_to_fsm(upper), nfa_to_fsm(lower));
+        u = nfa_to_fsm(upper);
+        l = nfa_to_fsm(lower);
+        CHECK(compose_mismatches(composed, u, l, 3) == 0);
+        fsm_destroy(composed);
+        fsm_destroy(u);
+        fsm_destroy(l);
+        nfa_free(upper);
+        nfa_free(lower);
+    }
+    g_compose_minimize = 1;
+    g_compose_tristate = 0;
+}
+
+/* Draw n samples and count them in counts[] by their index in */
+/* words[]; returns the number of samples not in words[]        */
+static int sample_counts(struct apply_handle *h, char *(*sample)(struct apply_handle *), int n, char **words, int *counts, int nwords) {
+    char *result;
+    int i, j, strays;
+    for (i = 0; i < nwords; i++)
+        counts[i] = 0;
+    for (i = 0, strays = 0; i < n; i++) {
+        result = sample(h);
+        for (j = 0; result != NULL && j < nwords && strcmp(result, words[j]) != 0; j++) { }
+        if (result == NULL || j == nwords)
+            strays++;
+        else
+            counts[j]++;
+    }
+    return(strays);
+}
+
+/* Every count is within a fifth of its expected value */
+static int counts_near(int *counts, int nwords, int *expected) {
+    int i;
+    for (i = 0; i < nwords; i++) {
+        if (counts[i] * 5 < expected[i] * 4 || counts[i] * 5 > expected[i] * 6)
+            return 0;
+    }
+    return 1;
+}
+
+#define SAMPLE_WORDS 21
+#define SAMPLE_RUNS 1000
+
+/* Samples are words of the net, equally likely however the net */
+/* branches, and the same seed gives the same samples           */
+static void test_sample(void) {
+    struct fsm_trie_handle *th;
+    struct fsm_construct_handle *c;
+    struct fsm *net;
+    struct apply_handle *h, *h2;
+    char *words[SAMPLE_WORDS], *result;
+    char *ab[] = {"", "a", "b", "aa", "ab", "ba", "bb", "aaa", "aab", "aba", "abb", "baa", "bab", "bba", "bbb"};
+    char *lower[] = {"", "b", "c", "bb", "bc", "cb", "cc"};
+    char *upper[] = {"", "a", "aa"};
+    int counts[SAMPLE_WORDS], expected[SAMPLE_WORDS], i, same;
+
+    /* a, and twenty words under b */
+    th = fsm_trie_init();
+    for (i = 0; i < SAMPLE_WORDS; i++) {
+        words[i] = malloc(4);
+        if (i == 0)
+            strcpy(words[i], "a");
+        else
+            sprintf(words[i], "b%c%i", i <= 10 ? 'a' : 'b', i % 10);
+        fsm_trie_add_word(th, words[i]);
+        expected[i] = SAMPLE_RUNS;
+    }
+    net = fsm_minimize(fsm_trie_done(th));
+    h = apply_init(net);
+    apply_set_seed(h, 1);
+    CHECK(sample_counts(h, apply_sample_upper, SAMPLE_WORDS * SAMPLE_RUNS, words, counts, SAMPLE_WORDS) == 0);
+    CHECK(counts_near(counts, SAMPLE_WORDS, expected));
+    h2 = apply_init(net);
+    apply_set_seed(h, 42);
+    apply_set_seed(h2, 42);
+    for (i = 0, same = 1; i < 100; i++) {
+        result = strdup(apply_sample_upper(h));
+        same = same && strcmp(result, apply_sample_upper(h2)) == 0;
+        free(result);
+    }
+    CHECK(same);
+    apply_set_seed(h2, 43);
+    for (i = 0, same = 1; i < 100; i++) {
+        result = strdup(apply_sample_upper(h));
+        same = same && strcmp(result, apply_sample_upper(h2)) == 0;
+        free(result);
+    }
+    CHECK(!same);
+    apply_clear(h);
+    apply_clear(h2);
+    fsm_destroy(net);
+    for (i = 0; i < SAMPLE_WORDS; i++)
+        free(words[i]);
+
+    /* (a|b)* up to 3 arcs: 15 paths */
+    c = fsm_construct_init("ab");
+    fsm_construct_add_arc(c, 0, 0, "a", "a");
+    fsm_construct_add_arc(c, 0, 0, "b", "b");
+    fsm_construct_set_initial(c, 0);
+    fsm_construct_set_final(c, 0);
+    net = fsm_construct_done(c);
+    h = apply_init(net);
+    apply_set_seed(h, 2);
+    apply_set_sample_maxlen(h, 3);
+    for (i = 0; i < 15; i++)
+        expected[i] = SAMPLE_RUNS;
+    CHECK(sample_counts(h, apply_sample_upper, 15 * SAMPLE_RUNS, ab, counts, 15) == 0);
+    CHECK(counts_near(counts, 15, expected));
+    apply_clear(h);
+    fsm_destroy(net);
+
+    /* [a:b|a:c]* up to 2 arcs: 7 paths, 1, 2 and 4 of them by length */
+    net = net_ab_ac();
+    h = apply_init(net);
+    apply_set_seed(h, 3);
+    apply_set_sample_maxlen(h, 2);
+    for (i = 0; i < 7; i++)
+        expected[i] = SAMPLE_RUNS;
+    CHECK(sample_counts(h, apply_sample_lower, 7 * SAMPLE_RUNS, lower, counts, 7) == 0);
+    CHECK(counts_near(counts, 7, expected));
+    expected[0] = SAMPLE_RUNS;
+    expected[1] = 2 * SAMPLE_RUNS;
+    expected[2] = 4 * SAMPLE_RUNS;
+    CHECK(sample_counts(h, apply_sample_upper, 7 * SAMPLE_RUNS, upper, counts, 3) == 0);
+    CHECK(counts_near(counts, 3, expected));
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+/* A transducer of about numlines lines with states of every kind */
+/* the arc sorter treats differently: without arcs, with a few    */
+/* arcs, and with many arcs whose symbols span less or more than  */
+/* 256 numbers.  Only the lines are filled in.                    */
+static struct fsm *net_random_lines(int numlines) {
+    struct fsm *net;
+    struct fsm_state *fsm;
+    int i, state, arcs, span, kind;
+    net = fsm_create("lines");
+    net->arity = 2;
+    fsm = net->states = malloc(sizeof(struct fsm_state) * (numlines + 1001));
+    for (i = 0, state = 0; i < numlines; state++) {
+        kind = test_rand(4);
+        arcs = kind == 0 ? 0 : kind == 1 ? 1 + test_rand(16) : 17 + test_rand(500);
+        span = kind == 3 ? 2000 : 200;
+        if (arcs == 0) {
+            fsm[i].state_no = state;
+            fsm[i].in = fsm[i].out = fsm[i].target = -1;
+            fsm[i].final_state = 1;
+            fsm[i].start_state = state == 0;
+            i++;
+        }
+        for ( ; arcs > 0; arcs--, i++) {
+            fsm[i].state_no = state;
+            fsm[i].in = 3 + test_rand(span);
+            fsm[i].out = 3 + test_rand(span);
+            fsm[i].target = test_rand(state + 1);
+            fsm[i].final_state = state % 2;
+            fsm[i].start_state = state == 0;
+        }
+    }
+    fsm[i].state_no = fsm[i].in = fsm[i].out = fsm[i].target = fsm[i].final_state = fsm[i].start_state = -1;
+    net->statecount = state;
+    net->linecount = i;
+    return(net);
+}
+
+struct arc_key {
+    int key;
+    int line;
+};
+
+static int compare_arc_keys(const void *a, const void *b) {
+    const struct arc_key *x = a, *y = b;
+    if (x->key != y->key)
+        return(x->key < y->key ? -1 : 1);
+    return(x->line < y->line ? -1 : x->line > y->line);
+}
+
+static int same_line(struct fsm_state *a, struct fsm_state *b) {
+    return(a->state_no == b->state_no && a->in == b->in && a->out == b->out && a->target == b->target && a->final_state == b->final_state && a->start_state == b->start_state);
+}
+
+/* Is sorted the result of a stable sort of the arcs of each state of */
+/* orig by input (direction 1) or output (direction 2)?               */
+static int sorted_stably(struct fsm_state *orig, struct fsm_state *sorted, int direction) {
+    struct arc_key *keys;
+    int i, j, first, same;
+    for (i = 0; orig[i].state_no != -1; i++) { }
+    keys = malloc(sizeof(struct arc_key) * (i + 1));
+    for (first = 0, same = 1; orig[first].state_no != -1; first = i) {
+        for (i = first; orig[i].state_no == orig[first].state_no; i++) {
+            keys[i-first].key = direction == 1 ? orig[i].in : orig[i].out;
+            keys[i-first].line = i;
+        }
+        qsort(keys, i - first, sizeof(struct arc_key), compare_arc_keys);
+        for (j = first; j < i; j++)
+            same = same && same_line(orig + keys[j-first].line, sorted + j);
+    }
+    free(keys);
+    return(same);
+}
+
+/* Arc sorting is stable within each state, in either direction, */
+/* also on a net big enough to be sorted by several threads      */
+static void test_sort_arcs(void) {
+    struct fsm *net;
+    struct fsm_state *orig;
+    int sizes[2] = {20000, 1100000};
+    int i, direction;
+
+    for (i = 0; i < 2; i++) {
+        for (direction = 1; direction <= 2; direction++) {
+            net = net_random_lines(sizes[i]);
+            orig = malloc(sizeof(struct fsm_state) * (net->linecount + 1));
+            memcpy(orig, net->states, sizeof(struct fsm_state) * (net->linecount + 1));
+            fsm_sort_arcs(net, direction);
+            CHECK(sorted_stably(orig, net->states, direction));
+            CHECK(direction == 1 ? net->arcs_sorted_in && !net->arcs_sorted_out : net->arcs_sorted_out && !net->arcs_sorted_in);
+            free(orig);
+            fsm_destroy(net);
+        }
+    }
+}
+
+/* The section size at which io.c parses a net from the stream */
+/* instead of reading it ahead (IO_SECTION_MAX)                */
+#define SECTION_MAX 16777216
+
+/* A one-arc net over symbol, padded with comment lines before its */
+/* sigma so that its text is size bytes long                        */
+static void write_padded_net(FILE *f, char *symbol, long size) {
+    char head[256], tail[256], pad[1001];
+    long left;
+    sprintf(head, "##foma-net 1.0##\n##props##\n1 1 2 3 1 1 1 1 1 1 1 2 %s\n", symbol);
+    sprintf(tail, "##sigma##\n3 %s\n##states##\n0 3 1 0\n1 -1 -1 1\n-1 -1 -1 -1 -1\n##end##\n", symbol);
+    fputs(head, f);
+    memset(pad, 'x', 1000);
+    pad[1000] = '\0';
+    /* Lines of 1001 bytes, then one or two of at least 2 bytes */
+    for (left = size - (long) (strlen(head) + strlen(tail)); left > 2002; left -= 1001)
+        fprintf(f, "%s\n", pad);
+    if (left > 1001) {
+        fprintf(f, "%s\n", pad + 1001 - left / 2);
+        left -= left / 2;
+    }
+    fprintf(f, "%s\n", pad + 1001 - left);
+    fputs(tail, f);
+}
+
+/* A net may reach the read-ahead limit anywhere, also on its last */
+/* line, and the nets after it are still read                      */
+static void test_read_section_limit(void) {
+    struct fsm **nets;
+    struct apply_handle *h;
+    FILE *f;
+    long sizes[] = {SECTION_MAX, SECTION_MAX + 1, SECTION_MAX + 4, SECTION_MAX + 8, SECTION_MAX + 9, 1000};
+    int i, j, numnets;
+
+    for (i = 0; i < 6; i++) {
+        f = fopen("/tmp/foma-test-lib-section.foma", "w");
+        write_padded_net(f, "a", sizes[i]);
+        write_padded_net(f, "b", 200);
+        fclose(f);
+        nets = fsm_read_binary_file_all("/tmp/foma-test-lib-section.foma", &numnets);
+        CHECK(numnets == 2);
+        for (j = 0; j < numnets; j++) {
+            h = apply_init(nets[j]);
+            CHECK(apply_up(h, j == 0 ? "a" : "b") != NULL);
+            apply_clear(h);
+            fsm_destroy(nets[j]);
+        }
+        free(nets);
+    }
+    remove("/tmp/foma-test-lib-section.foma");
+}
+
+int main(void) {
+    test_cache_budget();
+    test_read_section_limit();
+    test_cmatrix();
+    test_determinize();
+    test_epsilon_closure();
+    test_compose();
+    test_compose_n();
+    test_sample();
+    test_word_index();
+    test_sort_arcs();
+    test_index_shared();
+    test_limits_cached();
+    if (failures) {
+        fprintf(stderr, "%i check(s) failed\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    return(0);
+}
@@ -0,0 +1,105 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include "foma.h"
+
+#ifdef FOMA_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* A minimal work pool: the caller hands us an array of nargs argument  */
+/* blocks of argsize bytes each and a function to run on every one of   */
+/* them.  Up to nthreads worker threads pull blocks off a shared        */
+/* counter until all are done.  Without thread support (or when only    */
+/* one thread is asked for) the blocks are simply run in order.         */
+
+struct foma_pool {
+    void *(*func)(void *);
+    char *args;
+    size_t argsize;
+    int nargs;
+    int next;
+#ifdef FOMA_PTHREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+int foma_num_cpus(void) {
+#if defined(FOMA_PTHREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long n;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return(n > 0 ? (int) n : 1);
+#else
+    return 1;
+#endif
+}
+
+#ifdef FOMA_PTHREADS
+static void *foma_pool_worker(void *arg) {
+    struct foma_pool *pool;
+    int i;
+    pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->nargs)
+            break;
+        pool->func(pool->args + i * pool->argsize);
+    }
+    return NULL;
+}
+#endif
+
+void foma_parallel_run(void *(*func)(void *), void *args, size_t argsize, int nargs, int nthreads) {
+    int i;
+#ifdef FOMA_PTHREADS
+    struct foma_pool pool;
+    pthread_t *threads;
+    int started;
+
+    if (nthreads > nargs)
+        nthreads = nargs;
+    if (nthreads > 1) {
+        pool.func = func;
+        pool.args = args;
+        pool.argsize = argsize;
+        pool.nargs = nargs;
+        pool.next = 0;
+        pthread_mutex_init(&pool.lock, NULL);
+        threads = malloc(sizeof(pthread_t)*nthreads);
+        for (started = 0; started < nthreads; started++) {
+            if (pthread_create(threads+started, NULL, foma_pool_worker, &pool) != 0)
+                break;
+        }
+        /* If no thread could be started we do the work ourselves */
+        if (started == 0)
+            foma_pool_worker(&pool);
+        for (i = 0; i < started; i++) {
+            pthread_join(*(threads+i), NULL);
+        }
+        free(threads);
+        pthread_mutex_destroy(&pool.lock);
+        return;
+    }
+#endif
+    for (i = 0; i < nargs; i++) {
+        func((char *) args + i * argsize);
+    }
+}
@@ -40,6 +40,7 @@ struct fsm *fsm_topsort (struct fsm *net) {
     unsigned char *treated, overflow;
     long long grand_pathcount, *pathcount;
     struct fsm_state *fsm, *curr_fsm, *new_fsm;
+    struct int_stack *stack;
 
     if (net == NULL) { return NULL; }
 
@@ -53,6 +54,7 @@ struct fsm *fsm_topsort (struct fsm *net) {
     newnum = malloc(sizeof(int)*net->statecount);
     invcount = malloc(sizeof(unsigned short int)*net->statecount);
     treated =  malloc(sizeof(unsigned char)*net->statecount);
+    stack = int_stack_init();
 
     for (i=0; i < net->statecount; i++) {
 	*(statemap+i) = -1;
@@ -79,16 +81,15 @@ struct fsm *fsm_topsort (struct fsm *net) {
     }
 
     treatcount = net->statecount;
-    int_stack_clear();
-    int_stack_push(0);
+    int_stack_push(stack, 0);
     grand_pathcount = 0;
 
     *(pathcount+0) = 1;
 
     overflow = 0;
-    for (i=0 ; !int_stack_isempty(); i++) {
+    for (i=0 ; !int_stack_isempty(stack); i++) {
         /* Treat a state */
-        curr_state = int_stack_pop();
+        curr_state = int_stack_pop(stack);
         *(treated+curr_state) = 1;
         *(order+i) = curr_state;
         *(newnum+curr_state) = i;
@@ -115,7 +116,7 @@ struct fsm *fsm_topsort (struct fsm *net) {
                     goto cyclic;
                 }
                 if ( *(invcount+(curr_fsm->target)) == 0) {
-                    int_stack_push(curr_fsm->target);
+                    int_stack_push(stack, curr_fsm->target);
                 }
             }
             curr_fsm++;
@@ -167,6 +168,6 @@ struct fsm *fsm_topsort (struct fsm *net) {
     free(newnum);
     free(invcount);
     free(treated);
-    int_stack_clear();
+    int_stack_free(stack);
     return(net);
 }
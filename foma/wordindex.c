@@ -0,0 +1,287 @@
+/*   Foma: a finite-state toolkit and library.                                 */
+/*   Copyright © 2008-2021 Mans Hulden                                         */
+
+/*   This file is part of foma.                                                */
+
+/*   Licensed under the Apache License, Version 2.0 (the "License");           */
+/*   you may not use this file except in compliance with the License.          */
+/*   You may obtain a copy of the License at                                   */
+
+/*      http://www.apache.org/licenses/LICENSE-2.0                             */
+
+/*   Unless required by applicable law or agreed to in writing, software       */
+/*   distributed under the License is distributed on an "AS IS" BASIS,         */
+/*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  */
+/*   See the License for the specific language governing permissions and       */
+/*   limitations under the License.                                            */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "foma.h"
+
+/* Word <-> index mapping for acyclic nets */
+
+/* Every state counts the words of its right language, in reverse      */
+/* topological order, and the arcs of each state are sorted by symbol. */
+/* Each arc then stores how many words of its state sort before the    */
+/* ones that take it: 1 for the empty word if the state is final, and  */
+/* the counts of the targets of the arcs before it.  The index of a    */
+/* word is the sum of these along its path, and an index is turned back */
+/* into a word by following, in each state, the last arc whose sum is  */
+/* not larger than what is left of the index.  The input is split into */
+/* symbols as apply does: by longest match over the whole alphabet,    */
+/* not just the arcs of the current state, so a word is found if and   */
+/* only if apply would accept it.                                      */
+
+struct word_index_arc {
+    char *symbol;
+    int sym;
+    int target;
+};
+
+static int word_index_cmp(const void *a, const void *b) {
+    return(strcmp(((struct word_index_arc *)a)->symbol, ((struct word_index_arc *)b)->symbol));
+}
+
+/* The longest symbol of the alphabet that word starts with, or -1 */
+static int word_index_match(struct fsm_word_index *wi, char *word, int *len) {
+    int lo, hi, mid, i;
+    char *symbol;
+    /* The symbols that are prefixes of word sort, from the longest */
+    /* down, just before the first symbol that sorts after it       */
+    for (lo = 0, hi = wi->nalphabet; lo < hi; ) {
+	mid = (lo + hi) / 2;
+	if (strcmp(wi->symbols[wi->alphabet[mid]], word) > 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    for (i = lo - 1; i >= 0; i--) {
+	symbol = wi->symbols[wi->alphabet[i]];
+	if (*symbol != *word)
+	    break;
+	*len = strlen(symbol);
+	if (strncmp(symbol, word, *len) == 0)
+	    return(wi->alphabet[i]);
+    }
+    return -1;
+}
+
+/* Counts the words of each state reachable from the start state by an */
+/* iterative DFS; returns 0 on a cycle or if a count overflows         */
+static int word_index_count(struct fsm_word_index *wi, int states) {
+    int *color, *stack, *next, sp, s, t, arc, ok;
+    long long sum;
+
+    color = calloc(states, sizeof(int));
+    stack = malloc(sizeof(int) * states);
+    next = malloc(sizeof(int) * states);
+    ok = 1;
+    sp = 0;
+    stack[sp++] = wi->start;
+    color[wi->start] = 1;
+    next[wi->start] = wi->first[wi->start];
+    while (sp > 0 && ok) {
+	s = stack[sp-1];
+	if (next[s] < wi->first[s+1]) {
+	    t = wi->target[next[s]++];
+	    if (color[t] == 1) {
+		ok = 0;
+	    } else if (color[t] == 0) {
+		color[t] = 1;
+		next[t] = wi->first[t];
+		stack[sp++] = t;
+	    }
+	} else {
+	    /* All targets are counted */
+	    sum = wi->final[s];
+	    for (arc = wi->first[s]; arc < wi->first[s+1]; arc++) {
+		wi->before[arc] = sum;
+		if (wi->count[wi->target[arc]] > LLONG_MAX - sum)
+		    ok = 0;
+		sum += wi->count[wi->target[arc]];
+	    }
+	    wi->count[s] = sum;
+	    color[s] = 2;
+	    sp--;
+	}
+    }
+    free(color);
+    free(stack);
+    free(next);
+    return(ok);
+}
+
+struct fsm_word_index *fsm_word_index_init(struct fsm *net) {
+    struct fsm_word_index *wi;
+    struct fsm_sigma_list *sl;
+    struct fsm_state *fsm;
+    struct word_index_arc *arcs;
+    int i, states, maxsigma, numarcs, *pos, arc, ok;
+
+    fsm_count(net);
+    fsm = net->states;
+    states = net->statecount;
+    maxsigma = sigma_max(net->sigma);
+    wi = calloc(1, sizeof(struct fsm_word_index));
+    wi->first = calloc(states + 1, sizeof(int));
+    wi->final = calloc(states + 1, sizeof(unsigned char));
+    wi->count = calloc(states + 1, sizeof(long long));
+    wi->nsymbols = maxsigma + 1;
+    wi->symbols = calloc(wi->nsymbols, sizeof(char *));
+    sl = sigma_to_list(net->sigma);
+    for (i = 0; i <= maxsigma; i++) {
+	if ((sl+i)->symbol != NULL)
+	    wi->symbols[i] = strdup((sl+i)->symbol);
+    }
+    free(sl);
+    /* The symbols input is split into, as in apply's sigma trie, sorted */
+    arcs = malloc(sizeof(struct word_index_arc) * wi->nsymbols);
+    for (i = IDENTITY + 1, wi->nalphabet = 0; i <= maxsigma; i++) {
+	if (wi->symbols[i] != NULL && *(wi->symbols[i]) != '\0') {
+	    (arcs+wi->nalphabet)->symbol = wi->symbols[i];
+	    (arcs+wi->nalphabet++)->sym = i;
+	}
+    }
+    qsort(arcs, wi->nalphabet, sizeof(struct word_index_arc), word_index_cmp);
+    wi->alphabet = malloc(sizeof(int) * (wi->nalphabet + 1));
+    for (i = 0; i < wi->nalphabet; i++)
+	wi->alphabet[i] = (arcs+i)->sym;
+    free(arcs);
+
+    /* As in apply, the start state is the state of the first line */
+    wi->start = fsm->state_no == -1 ? 0 : fsm->state_no;
+    ok = 1;
+    for (i = 0, numarcs = 0; (fsm+i)->state_no != -1; i++) {
+	if ((fsm+i)->final_state == 1)
+	    wi->final[(fsm+i)->state_no] = 1;
+	if ((fsm+i)->target == -1)
+	    continue;
+	if ((fsm+i)->in == EPSILON || (fsm+i)->in == UNKNOWN || (fsm+i)->in == IDENTITY)
+	    ok = 0;
+	wi->first[(fsm+i)->state_no+1]++;
+	numarcs++;
+    }
+    for (i = 0; i < states; i++)
+	wi->first[i+1] += wi->first[i];
+    wi->sym = malloc(sizeof(int) * (numarcs + 1));
+    wi->target = malloc(sizeof(int) * (numarcs + 1));
+    wi->before = malloc(sizeof(long long) * (numarcs + 1));
+    if (!ok) {
+	fsm_word_index_clear(wi);
+	return NULL;
+    }
+
+    /* Sort the arcs of each state by symbol */
+    arcs = malloc(sizeof(struct word_index_arc) * (numarcs + 1));
+    pos = malloc(sizeof(int) * states);
+    memcpy(pos, wi->first, sizeof(int) * states);
+    for (i = 0; (fsm+i)->state_no != -1; i++) {
+	if ((fsm+i)->target == -1)
+	    continue;
+	arc = pos[(fsm+i)->state_no]++;
+	(arcs+arc)->symbol = wi->symbols[(fsm+i)->in];
+	(arcs+arc)->sym = (fsm+i)->in;
+	(arcs+arc)->target = (fsm+i)->target;
+    }
+    for (i = 0; i < states; i++) {
+	qsort(arcs+wi->first[i], wi->first[i+1] - wi->first[i], sizeof(struct word_index_arc), word_index_cmp);
+	for (arc = wi->first[i]; arc < wi->first[i+1]; arc++) {
+	    if (arc > wi->first[i] && (arcs+arc)->sym == (arcs+arc-1)->sym)
+		ok = 0;
+	    wi->sym[arc] = (arcs+arc)->sym;
+	    wi->target[arc] = (arcs+arc)->target;
+	}
+    }
+    free(arcs);
+    free(pos);
+
+    if (!ok || !word_index_count(wi, states)) {
+	fsm_word_index_clear(wi);
+	return NULL;
+    }
+    wi->wordsize = 64;
+    wi->word = malloc(wi->wordsize);
+    return(wi);
+}
+
+long long fsm_word_index_size(struct fsm_word_index *wi) {
+    return(wi->count[wi->start]);
+}
+
+long long fsm_word_to_index(struct fsm_word_index *wi, char *word) {
+    int s, lo, hi, mid, arc, sym, len, cmp;
+    long long index;
+
+    s = wi->start;
+    index = 0;
+    while (*word != '\0') {
+	/* A symbol with combining characters after it is ? to apply */
+	if ((sym = word_index_match(wi, word, &len)) == -1 || utf8iscombining((unsigned char *)(word+len)))
+	    return -1;
+	for (lo = wi->first[s], hi = wi->first[s+1], arc = -1; lo < hi && arc == -1; ) {
+	    mid = (lo + hi) / 2;
+	    if ((cmp = strcmp(wi->symbols[wi->sym[mid]], wi->symbols[sym])) == 0)
+		arc = mid;
+	    else if (cmp > 0)
+		hi = mid;
+	    else
+		lo = mid + 1;
+	}
+	if (arc == -1)
+	    return -1;
+	index += wi->before[arc];
+	word += len;
+	s = wi->target[arc];
+    }
+    return(wi->final[s] ? index : -1);
+}
+
+char *fsm_index_to_word(struct fsm_word_index *wi, long long index) {
+    int s, lo, hi, mid, len, wpos;
+
+    if (index < 0 || index >= wi->count[wi->start])
+	return NULL;
+    s = wi->start;
+    wpos = 0;
+    while (!(wi->final[s] && index == 0)) {
+	/* The last arc whose words do not all sort after index */
+	for (lo = wi->first[s], hi = wi->first[s+1] - 1; lo < hi; ) {
+	    mid = (lo + hi + 1) / 2;
+	    if (wi->before[mid] <= index)
+		lo = mid;
+	    else
+		hi = mid - 1;
+	}
+	index -= wi->before[lo];
+	len = strlen(wi->symbols[wi->sym[lo]]);
+	if (wpos + len + 1 > wi->wordsize) {
+	    wi->wordsize = (wpos + len + 1) * 2;
+	    wi->word = realloc(wi->word, wi->wordsize);
+	}
+	memcpy(wi->word + wpos, wi->symbols[wi->sym[lo]], len);
+	wpos += len;
+	s = wi->target[lo];
+    }
+    wi->word[wpos] = '\0';
+    return(wi->word);
+}
+
+void fsm_word_index_clear(struct fsm_word_index *wi) {
+    int i;
+    if (wi == NULL)
+	return;
+    for (i = 0; wi->symbols != NULL && i < wi->nsymbols; i++)
+	free(wi->symbols[i]);
+    free(wi->symbols);
+    free(wi->alphabet);
+    free(wi->first);
+    free(wi->sym);
+    free(wi->target);
+    free(wi->before);
+    free(wi->count);
+    free(wi->final);
+    free(wi->word);
+    free(wi);
+}